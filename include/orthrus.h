@@ -34,8 +34,25 @@ typedef struct orthrus_response_t orthrus_response_t;
 #define ORTHRUS_ALG_MD5 (1)
 #define ORTHRUS_ALG_SHA1 (2)
 
+/* Probes the CPU and picks, per algorithm, the fastest kernel and batch
+ * engine that pass the RFC 2289 Appendix C vectors.  ORTHRUS_KERNEL and
+ * ORTHRUS_ENGINE in the environment override the choice, either for all
+ * algorithms ("portable") or per algorithm ("sha1=avx2,md5=none").
+ */
 orthrus_error_t* orthrus_create(apr_pool_t *pool, orthrus_t **ort);
 
+/* Name of the fold/cycle implementation selected for @a alg when @a ort
+ * was created, e.g. "portable" or "sha-ni". */
+orthrus_error_t* orthrus_kernel_name(orthrus_t *ort,
+                                     apr_uint32_t alg,
+                                     const char **name);
+
+/* Name of the multi-buffer engine orthrus_calculate_batch uses for @a alg,
+ * e.g. "avx2", or "none" when chains are run one at a time. */
+orthrus_error_t* orthrus_engine_name(orthrus_t *ort,
+                                     apr_uint32_t alg,
+                                     const char **name);
+
 orthrus_error_t* orthrus_calculate(orthrus_t *ort,
                                    orthrus_response_t **reply,
                                    apr_uint32_t alg,
@@ -45,13 +62,152 @@ orthrus_error_t* orthrus_calculate(orthrus_t *ort,
                                    apr_size_t pwlen,
                                    apr_pool_t *pool);
 
+/* Sizes, including the NUL, of the text forms in orthrus_otp_t. */
+#define ORTHRUS_OTP_HEX_SIZE   (8 * 2 + 3 + 1)
+#define ORTHRUS_OTP_WORDS_SIZE (6 * 4 + 5 + 1)
+
+/* A calculated OTP in caller owned storage, for orthrus_calculate_into.
+ * Unlike orthrus_response_t it can live on the stack or inside another
+ * structure. */
+typedef struct orthrus_otp_t {
+  /* The raw 64 bit OTP, as from orthrus_response_value. */
+  apr_uint64_t value;
+  char hex[ORTHRUS_OTP_HEX_SIZE];
+  char words[ORTHRUS_OTP_WORDS_SIZE];
+} orthrus_otp_t;
+
+/* Like orthrus_calculate, but writes the OTP and both of its text forms
+ * into @a otp and never allocates, so it is safe on hot paths that must
+ * stay out of the allocator. */
+orthrus_error_t* orthrus_calculate_into(orthrus_t *ort,
+                                        orthrus_otp_t *otp,
+                                        apr_uint32_t alg,
+                                        apr_uint64_t sequence,
+                                        const char *seed,
+                                        const char *pw,
+                                        apr_size_t pwlen);
+
+/* One independent calculation for orthrus_calculate_batch. */
+typedef struct orthrus_request_t {
+  apr_uint32_t alg;
+  apr_uint64_t sequence;
+  const char *seed;
+  const char *pw;
+  apr_size_t pwlen;
+} orthrus_request_t;
+
+/* Calculates @a count independent OTPs, storing the reply for requests[i]
+ * in replies[i].  Results are identical to calling orthrus_calculate for
+ * each request, but chains of the same algorithm are computed several at a
+ * time when the CPU has wide vector units. */
+orthrus_error_t* orthrus_calculate_batch(orthrus_t *ort,
+                                         orthrus_response_t **replies,
+                                         const orthrus_request_t *requests,
+                                         apr_size_t count,
+                                         apr_pool_t *pool);
+
+/* Columns written by orthrus_calculate_range after the sequence number. */
+#define ORTHRUS_RANGE_HEX   (1 << 0)
+#define ORTHRUS_RANGE_WORDS (1 << 1)
+
+/* Upper bound on the length of one line of orthrus_calculate_range. */
+#define ORTHRUS_RANGE_LINE_MAX 80
+
+/* Calculates the @a count OTPs for @a sequence, @a sequence - 1, ... in
+ * that order, such as for printing an OTP sheet.  The seed and password are
+ * folded once and the chain is walked in O(n + count log count) hashes
+ * rather than the O(n * count) of repeated orthrus_calculate calls.
+ *
+ * Each OTP is written to @a buf as a line "<sequence>: <hex> <words>\n",
+ * with the columns chosen by the ORTHRUS_RANGE_* @a flags.  @a *len is
+ * the size of @a buf on entry, count * ORTHRUS_RANGE_LINE_MAX always
+ * suffices, and the number of bytes written on return.  The output is not
+ * NUL terminated.  Returns APR_ENOSPC if @a buf is too small.
+ */
+orthrus_error_t* orthrus_calculate_range(orthrus_t *ort,
+                                         char *buf,
+                                         apr_size_t *len,
+                                         int flags,
+                                         apr_uint32_t alg,
+                                         apr_uint64_t sequence,
+                                         apr_uint64_t count,
+                                         const char *seed,
+                                         const char *pw,
+                                         apr_size_t pwlen,
+                                         apr_pool_t *pool);
+
+/* Like orthrus_calculate, but starts from the nearest checkpoint at or
+ * below @a sequence in the file at @a path, and records new checkpoints
+ * there as the chain is walked.  The file is encrypted and authenticated
+ * with keys derived from @a pw.  A file that does not match @a pw, such as
+ * after a mistyped password, is ignored and left untouched, and failing to
+ * update the file does not fail the calculation.  Deriving the keys costs
+ * about as much as a chain of twenty thousand steps, so sequences below
+ * 32768 are calculated directly and the file is not used.
+ *
+ * The file makes the password cheaper to guess offline.  Whoever can read
+ * it can test a guess with 1000 PBKDF2 iterations, where an observed OTP
+ * takes at least as many chain steps as its sequence.  That is inherent,
+ * as the cache only pays off while the key costs less than the chain it
+ * skips, so only use it on request, with the file kept private.
+ */
+orthrus_error_t* orthrus_calculate_cached(orthrus_t *ort,
+                                          orthrus_response_t **reply,
+                                          const char *path,
+                                          apr_uint32_t alg,
+                                          apr_uint64_t sequence,
+                                          const char *seed,
+                                          const char *pw,
+                                          apr_size_t pwlen,
+                                          apr_pool_t *pool);
+
+/* The hex and six word forms are produced on first request and then
+ * kept in the response, so they live as long as the pool it was
+ * calculated in. */
 void orthrus_response_format_hex(orthrus_response_t *reply,
                                  const char **output);
 
 void orthrus_response_format_words(orthrus_response_t *reply,
                                    const char **output);
 
-  
+/* The raw 64 bit OTP; its big endian bytes are the RFC 2289 output.
+ * Comparing these avoids formatting altogether. */
+void orthrus_response_value(orthrus_response_t *reply, apr_uint64_t *output);
+
+
+/* An output format.  @a write puts @a value in this form into @a buf,
+ * unless that needs more than @a size bytes, and returns the number of
+ * bytes the form needs either way.  No NUL is added. */
+typedef struct orthrus_format_t {
+  const char *name;
+  apr_size_t (*write)(void *baton, apr_uint64_t value,
+                      char *buf, apr_size_t size);
+  void *baton;
+} orthrus_format_t;
+
+/* Makes @a format available by name in @a ort, replacing any format of
+ * the same name.  @a format is not copied and must outlive @a ort.
+ *
+ * Every context starts with "hex" ("XXXX XXXX XXXX XXXX"), "hex-lower",
+ * "hex-compact" (16 digits), "hex-compact-lower", "words" and "binary"
+ * (the eight RFC 2289 output bytes, for machine clients).
+ */
+orthrus_error_t* orthrus_format_register(orthrus_t *ort,
+                                         const orthrus_format_t *format);
+
+orthrus_error_t* orthrus_format_get(orthrus_t *ort,
+                                    const char *name,
+                                    const orthrus_format_t **format);
+
+/* Writes @a value to @a buf in @a format.  @a *len is the size of @a buf
+ * on entry and the length of the output on return.  The output is not NUL
+ * terminated.  Returns APR_ENOSPC, with @a *len set to the size needed, if
+ * @a buf is too small; pass a NULL @a buf to only query the size. */
+orthrus_error_t* orthrus_format_write(const orthrus_format_t *format,
+                                      apr_uint64_t value,
+                                      char *buf,
+                                      apr_size_t *len);
+
 /* User DB Interfaces. */
 orthrus_error_t* orthrus_userdb_open(orthrus_t *ort, const char *path);
 orthrus_error_t* orthrus_userdb_close(orthrus_t *ort);
@@ -65,10 +221,57 @@ orthrus_error_t* orthrus_userdb_verify(orthrus_t *ort,
                                        const char *username,
                                        const char *challenge,
                                        const char *reply);
+
+/* One login for orthrus_userdb_verify_batch. */
+typedef struct orthrus_verify_t {
+  const char *username;
+  const char *challenge;
+  const char *reply;
+  /* Set on return: ORTHRUS_SUCCESS if the login was accepted, otherwise
+   * what orthrus_userdb_verify would have returned.  The caller destroys
+   * it. */
+  orthrus_error_t *err;
+} orthrus_verify_t;
+
+/* Verifies @a count logins in order, as orthrus_userdb_verify would one
+ * after the other, but with one scan of the userdb for all of them and one
+ * rewrite for every accepted login.  Replies are hashed several at a time
+ * where the CPU allows.  The return value reports failures of the userdb
+ * itself; if recording the accepted logins fails, none is accepted. */
+orthrus_error_t* orthrus_userdb_verify_batch(orthrus_t *ort,
+                                             orthrus_verify_t *requests,
+                                             apr_size_t count);
+
 orthrus_error_t* orthrus_userdb_save(orthrus_t *ort,
                                      const char *username,
                                      const char *challenge,
                                      const char *reply);
+
+/* On disk formats of the userdb, see orthrus_userdb_convert. */
+#define ORTHRUS_USERDB_TEXT (0)
+#define ORTHRUS_USERDB_BINARY (1)
+#define ORTHRUS_USERDB_LOG (2)
+
+/* Longest username the binary format holds, in bytes. */
+#define ORTHRUS_USERDB_BINARY_NAME_MAX 80
+
+/* Rewrites the open userdb in @a format.  The text format has a line per
+ * user and is rewritten whole by every login.  The binary format is a hash
+ * table of fixed size records that a login updates in place, so a login
+ * costs the same however many users there are.  It keeps neither comments
+ * nor the dates of the text format, and holds seeds of up to 16 characters
+ * and usernames of up to ORTHRUS_USERDB_BINARY_NAME_MAX bytes.  The log
+ * format appends a small checksummed record per login and is left to
+ * grow until orthrus_userdb_compact.  orthrus_userdb_open detects each
+ * format. */
+orthrus_error_t* orthrus_userdb_convert(orthrus_t *ort, int format);
+
+/* Rewrites a log userdb without its superseded records once they
+ * outweigh the current ones, and does nothing otherwise or for the other
+ * formats.  This reads and writes the whole userdb under its lock, so it
+ * is meant for a maintenance job, such as from cron, rather than around
+ * logins. */
+orthrus_error_t* orthrus_userdb_compact(orthrus_t *ort);
   
 #ifdef __cplusplus
 }
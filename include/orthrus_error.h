@@ -102,6 +102,44 @@ orthrus_error_createf_impl(apr_status_t err,
                            const char *fmt,
                            ...);
 
+/**
+ * Shared, immutable errors for outcomes that are routine on a busy
+ * server, such as a wrong OTP or an unknown user, so that reporting them
+ * never allocates.  @c orthrus_error_destroy leaves them alone.
+ *
+ * They live in read only memory and are returned by every call site
+ * alike, so no field of one, @c pool included, may be written.  Their
+ * @c file is "(static)" and their @c line 0 rather than a call site.
+ */
+typedef enum orthrus_static_error_e {
+    ORTHRUS_EUSER_NOT_FOUND,
+    ORTHRUS_EINVALID_RESPONSE,
+    ORTHRUS_ESEED_CHANGED,
+    ORTHRUS_ESEQUENCE_CHANGED,
+    ORTHRUS_EWORD_LENGTH,
+    ORTHRUS_EWORD_COUNT,
+    ORTHRUS_EWORD_NOT_FOUND,
+    ORTHRUS_EWORD_PARITY,
+    ORTHRUS__NUM_STATIC_ERRORS
+} orthrus_static_error_e;
+
+/**
+ * The underlying table of @c orthrus_error_static.
+ *
+ * This is an implementation detail, and should not be directly used
+ * by users.
+ */
+extern const orthrus_error_t orthrus__static_errors[ORTHRUS__NUM_STATIC_ERRORS];
+
+/** Return the preallocated error @a id, an @c orthrus_static_error_e.
+ * The result is typed for returning as an error, but must not be written
+ * through. */
+#define orthrus_error_static(id) \
+    ((orthrus_error_t *) &orthrus__static_errors[(id)])
+
+/** Return non-zero if @a err is one of the preallocated errors. */
+int orthrus_error_is_static(const orthrus_error_t *err);
+
 /** Destroy @a err. */
 void orthrus_error_destroy(orthrus_error_t *err);
 
@@ -0,0 +1,62 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ORTHRUS_PRIVATE_ARENA_H_
+#define _ORTHRUS_PRIVATE_ARENA_H_
+
+#include "apr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bump allocator for the scratch memory of a single operation.  The first
+ * ORT_ARENA_INLINE_SIZE bytes come from the arena itself, so the common
+ * case never reaches malloc; larger requests spill into heap blocks that
+ * orthrus__arena_reset frees.  Nothing is freed individually.
+ */
+#define ORT_ARENA_INLINE_SIZE 2048
+#define ORT_ARENA_BLOCK_SIZE 8192
+
+typedef struct orthrus__arena_block_t orthrus__arena_block_t;
+
+typedef struct orthrus__arena_t {
+  char *cur;
+  char *end;
+  orthrus__arena_block_t *blocks;
+  union {
+    apr_uint64_t align;
+    void *ptr;
+    char data[ORT_ARENA_INLINE_SIZE];
+  } first;
+} orthrus__arena_t;
+
+void orthrus__arena_init(orthrus__arena_t *arena);
+
+/* Returns NULL only if a spill block can't be allocated. */
+void *orthrus__arena_alloc(orthrus__arena_t *arena, apr_size_t size);
+void *orthrus__arena_calloc(orthrus__arena_t *arena, apr_size_t size);
+char *orthrus__arena_strdup(orthrus__arena_t *arena, const char *str);
+
+/* Releases everything allocated since orthrus__arena_init or the last
+ * reset, and returns any spill blocks to the heap. */
+void orthrus__arena_reset(orthrus__arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif
@@ -18,20 +18,164 @@
 #define _ORTHRUS_PRIVATE_CONTEXT_H_
 
 #include "orthrus.h"
+#include "private/arena.h"
+#include "private/index.h"
 #include <apr_file_io.h>
+#include <apr_mmap.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Number of ORTHRUS_ALG_* identifiers, which are dense from zero. */
+#define ORTHRUS__NUM_ALGS 3
+
+typedef orthrus_error_t* (*orthrus__alg_fold_t)(const char *seed,
+                                                apr_size_t slen,
+                                                const char *pw,
+                                                apr_size_t pwlen,
+                                                orthrus_response_t *reply);
+
+typedef orthrus_error_t* (*orthrus__alg_cycle_t)(apr_uint64_t sequence,
+                                                 orthrus_response_t *reply);
+
+/* One implementation of an algorithm's fold and cycle steps. */
+typedef struct orthrus__kernel_t {
+  const char *name;
+  orthrus__alg_fold_t fold;
+  orthrus__alg_cycle_t cycle;
+} orthrus__kernel_t;
+
+/* Multi-buffer engine: advances @a lanes independent chain values, each
+ * in the same representation as orthrus_response_t.reply, by @a steps.
+ */
+typedef void (*orthrus__mb_chain_t)(apr_uint64_t *values, apr_uint64_t steps);
+
+#define ORT_MB_MAX_LANES 16
+
+typedef struct orthrus__mb_engine_t {
+  const char *name;
+  apr_size_t lanes;
+  orthrus__mb_chain_t chain;
+} orthrus__mb_engine_t;
+
+/* Advances values[i] by steps[i] for all @a count chains, packing as many
+ * chains into the engine's lanes as it has. */
+void orthrus__mb_chain(const orthrus__mb_engine_t *engine,
+                       apr_uint64_t *values,
+                       const apr_uint64_t *steps,
+                       apr_size_t count);
+
+#define ORT_MAX_FORMATS 32
+
+/* See include/private/userdb.h and src/userdb_log.c. */
+typedef struct orthrus__userdb_backend_t orthrus__userdb_backend_t;
+typedef struct orthrus__log_t orthrus__log_t;
+
 struct orthrus_t {
   apr_pool_t *pool;
+  /* Holds the open userdb's files and paths, cleared on close. */
+  apr_pool_t *dbpool;
+  /* For the APR objects of a single userdb update, cleared after it. */
+  apr_pool_t *tmppool;
+  /* Holds userdb and map, which are replaced whenever the file at path
+   * changes, see userdb_refresh. */
+  apr_pool_t *mappool;
   apr_file_t *userdb;
+  apr_mmap_t *map;
+  apr_finfo_t dbinfo;
+  /* The userdb's <path>.idx, mapped into mappool; slots is NULL when
+   * there is no current one. */
+  orthrus__index_t index;
+  /* How the file at path is stored, detected by userdb_refresh. */
+  const orthrus__userdb_backend_t *backend;
+  /* Latest record of each user of a log userdb, in mappool. */
+  orthrus__log_t *log;
   apr_file_t *lock;
   const char *path;
   const char *lockpath;
+  const char *tmppath;
+  const char *idxpath;
+  /* Buffers for streaming through the userdb, see src/userdb.c. */
+  char *readbuf;
+  char *writebuf;
+  /* Kernels selected at orthrus_create, indexed by ORTHRUS_ALG_*. */
+  const orthrus__kernel_t *kernels[ORTHRUS__NUM_ALGS];
+  /* Multi-buffer engines for batches, NULL to run chains one at a time. */
+  const orthrus__mb_engine_t *engines[ORTHRUS__NUM_ALGS];
+  /* Output formats by name, see orthrus_format_register. */
+  const orthrus_format_t *formats[ORT_MAX_FORMATS];
+  apr_size_t nformats;
+  /* Scratch memory of the operation in progress, reset when it returns. */
+  orthrus__arena_t scratch;
 };
 
+/* x86 kernels are compiled with per-function target attributes, so the
+ * library itself does not need to be built with -msse4 and friends.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ORT_HAVE_X86_KERNELS 1
+#define ORT_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#define ORT_CPU_SSSE3   (1 << 0)
+#define ORT_CPU_SSE41   (1 << 1)
+#define ORT_CPU_SHA     (1 << 2)
+#define ORT_CPU_AVX2    (1 << 3)
+#define ORT_CPU_AVX512F (1 << 4)
+#define ORT_CPU_SSE2    (1 << 5)
+
+/* Returns the ORT_CPU_* features usable by this process. */
+apr_uint32_t orthrus__cpu_features(void);
+
+extern const orthrus__kernel_t orthrus__md4_portable;
+extern const orthrus__kernel_t orthrus__md5_portable;
+extern const orthrus__kernel_t orthrus__sha1_portable;
+#ifdef ORT_HAVE_X86_KERNELS
+extern const orthrus__kernel_t orthrus__sha1_shani;
+extern const orthrus__mb_engine_t orthrus__md4_mb_sse2;
+extern const orthrus__mb_engine_t orthrus__md4_mb_avx2;
+extern const orthrus__mb_engine_t orthrus__md4_mb_avx512;
+extern const orthrus__mb_engine_t orthrus__md5_mb_sse2;
+extern const orthrus__mb_engine_t orthrus__md5_mb_avx2;
+extern const orthrus__mb_engine_t orthrus__md5_mb_avx512;
+extern const orthrus__mb_engine_t orthrus__sha1_mb_sse2;
+extern const orthrus__mb_engine_t orthrus__sha1_mb_avx2;
+extern const orthrus__mb_engine_t orthrus__sha1_mb_avx512;
+#endif
+
+/* RFC 2289 limits seeds to 16 characters. */
+#define ORT_SEED_MAX 16
+
+/* Resolves the kernel for @a alg and validates and lower cases the seed
+ * into @a seed, which must have room for ORT_SEED_MAX + 1 bytes, as every
+ * calculation entry point must. */
+orthrus_error_t* orthrus__prepare_calculation(orthrus_t *ort,
+                                              apr_uint32_t alg,
+                                              const char *in_seed,
+                                              const orthrus__kernel_t **kernel,
+                                              char *seed,
+                                              apr_size_t *slen);
+
+/* Byte swapping and rotation used by the hash chain kernels. */
+#if defined(__GNUC__)
+#define ORT_BSWAP32(x) __builtin_bswap32(x)
+#define ORT_BSWAP64(x) __builtin_bswap64(x)
+#else
+static APR_INLINE apr_uint32_t ORT_BSWAP32(apr_uint32_t x)
+{
+  return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+static APR_INLINE apr_uint64_t ORT_BSWAP64(apr_uint64_t x)
+{
+  return ((apr_uint64_t)ORT_BSWAP32((apr_uint32_t)x) << 32) |
+         ORT_BSWAP32((apr_uint32_t)(x >> 32));
+}
+#endif
+
+#define ORT_ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
 
 orthrus_error_t* orthrus__alg_md4_fold(const char *seed,
                                        apr_size_t slen,
@@ -60,16 +204,37 @@ orthrus_error_t* orthrus__alg_sha1_fold(const char *seed,
 orthrus_error_t* orthrus__alg_sha1_cycle(apr_uint64_t sequence, 
                                         orthrus_response_t *reply);
 
+/* "XXXX XXXX XXXX XXXX", and six words of at most four letters. */
+#define ORT_HEX_LEN (8 * 2 + 3)
+#define ORT_WORDS_MAX_LEN (6 * 4 + 5)
+
+/* Write the hex or six word form of @a value to @a out, without a
+ * terminating NUL, and return the number of bytes written.  @a out must
+ * have room for ORT_HEX_LEN or ORT_WORDS_MAX_LEN bytes respectively. */
+apr_size_t orthrus__hex_write(apr_uint64_t value, char *out);
+apr_size_t orthrus__words_write(apr_uint64_t value, char *out);
+
+/* The 16 hex digits of @a value without separators; returns 16. */
+apr_size_t orthrus__hex_write_plain(apr_uint64_t value, char *out);
+
+/* Registers the built in output formats with a new context. */
+void orthrus__format_init(orthrus_t *ort);
+
 void orthrus__format_hex(orthrus_response_t *reply, apr_pool_t *pool);
 void orthrus__decode_hex(const char *input, apr_uint64_t *output);
+void orthrus__decode_hex_len(const char *input, apr_size_t len,
+                             apr_uint64_t *output);
 void orthrus__format_words(orthrus_response_t *reply, apr_pool_t *pool);
 orthrus_error_t* orthrus__decode_words(const char *words, apr_uint64_t *out);
 
+/* hex and words are filled in on first use and empty until then.
+ * Code that changes reply after handing the response out must clear them.
+ */
 struct orthrus_response_t {
   apr_pool_t *pool;
   apr_uint64_t reply;
   const char hex[(8 * 2) + 4 + 1];
-  const char *words;
+  const char words[ORT_WORDS_MAX_LEN + 1];
 };
 
 #ifdef __cplusplus
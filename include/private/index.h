@@ -0,0 +1,102 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ORTHRUS_PRIVATE_INDEX_H_
+#define _ORTHRUS_PRIVATE_INDEX_H_
+
+#include "apr.h"
+#include "apr_file_info.h"
+#include "apr_mmap.h"
+#include "private/arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Open addressing hash of username to the byte offset of its record, kept
+ * beside the userdb as <path>.idx.  Each slot is one 64 bit word, zero
+ * when empty, else (tag << 40) | (offset + 1) with the tag taken from the
+ * top of the username's hash, so a lookup is a short linear probe that
+ * only goes to the userdb for likely matches.  The file is stamped with
+ * the identity, size and mtime of the userdb it indexes and is ignored
+ * once they stop matching.
+ */
+typedef struct orthrus__index_t {
+  apr_uint64_t *slots;
+  apr_size_t nslots;
+  apr_size_t count;
+  /* Hash and offset pairs added since orthrus__index_init, which
+   * orthrus__index_finish turns into slots. */
+  apr_uint64_t *pending;
+  apr_size_t capacity;
+  /* Set when a record was beyond the reach of a slot; never saved. */
+  int overflow;
+} orthrus__index_t;
+
+typedef struct orthrus__index_iter_t {
+  apr_uint64_t tag;
+  apr_size_t pos;
+  apr_size_t left;
+} orthrus__index_iter_t;
+
+/* FNV-1a hash of a username, as the index and the binary userdb use. */
+apr_uint64_t orthrus__index_hash(const char *name, apr_size_t len);
+
+/* Starts an empty index with room for about @a hint users. */
+apr_status_t orthrus__index_init(orthrus__index_t *idx,
+                                 orthrus__arena_t *arena,
+                                 apr_size_t hint);
+
+/* Adds the record of @a name at @a offset. */
+apr_status_t orthrus__index_add(orthrus__index_t *idx,
+                                orthrus__arena_t *arena,
+                                const char *name,
+                                apr_size_t len,
+                                apr_off_t offset);
+
+/* Builds the slots once every record has been added. */
+apr_status_t orthrus__index_finish(orthrus__index_t *idx,
+                                   orthrus__arena_t *arena);
+
+/* Walks the offsets of the records that may be @a name's, in no
+ * particular order; callers check the username at each. */
+void orthrus__index_find(const orthrus__index_t *idx,
+                         const char *name,
+                         apr_size_t len,
+                         orthrus__index_iter_t *it);
+int orthrus__index_next(const orthrus__index_t *idx,
+                        orthrus__index_iter_t *it,
+                        apr_off_t *offset);
+
+/* Writes @a idx to @a path, via @a tmppath, stamped with @a dbinfo. */
+apr_status_t orthrus__index_save(const orthrus__index_t *idx,
+                                 const char *path,
+                                 const char *tmppath,
+                                 const apr_finfo_t *dbinfo,
+                                 apr_pool_t *pool);
+
+/* Maps the index at @a path into @a pool.  Fails unless it is well formed
+ * and stamped with @a dbinfo. */
+apr_status_t orthrus__index_load(orthrus__index_t *idx,
+                                 const char *path,
+                                 const apr_finfo_t *dbinfo,
+                                 apr_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif
@@ -0,0 +1,115 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ORTHRUS_PRIVATE_USERDB_H_
+#define _ORTHRUS_PRIVATE_USERDB_H_
+
+#include "orthrus.h"
+#include "private/context.h"
+#include "apr_hash.h"
+#include "apr_time.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Read-ahead and write-behind per userdb pass, in bytes; the size of
+ * ort->writebuf. */
+#define ORT_USERDB_BUFFER_SIZE (64 * 1024)
+
+/* Batches the writes of a userdb rewrite. */
+typedef struct orthrus__userdb_writer_t {
+  apr_file_t *file;
+  /* ort->writebuf */
+  char *buf;
+  apr_size_t len;
+  /* Bytes written so far, buffered or not. */
+  apr_off_t off;
+} orthrus__userdb_writer_t;
+
+apr_status_t orthrus__userdb_writer_write(orthrus__userdb_writer_t *w,
+                                          const void *data, apr_size_t len);
+apr_status_t orthrus__userdb_writer_flush(orthrus__userdb_writer_t *w);
+
+typedef struct orthrus_challenge_t {
+  apr_uint32_t sequence;
+  /* Not NUL terminated when it points into the userdb mapping. */
+  const char *seed;
+  apr_size_t slen;
+} orthrus_challenge_t;
+
+typedef struct orthrus_user_t {
+  const char *username;
+  /* seed is NULL until the user's record has been found. */
+  orthrus_challenge_t ch;
+  apr_uint64_t lastreply;
+  /* Time of the last login or save, zero where the format doesn't say. */
+  apr_time_t lastuse;
+  /* Set when the user must be written back by the backend's update. */
+  int dirty;
+} orthrus_user_t;
+
+typedef orthrus_error_t* (*orthrus__userdb_each_t)(void *baton,
+                                                   orthrus_user_t *user);
+
+/* One on disk format of the userdb.  ort->backend is picked from the
+ * start of the file each time it is (re)opened.
+ */
+struct orthrus__userdb_backend_t {
+  const char *name;
+  /* ORTHRUS_USERDB_* */
+  int format;
+  /* The first 8 bytes of every file in this format, NULL for text. */
+  const char *magic;
+  /* Fills in the first record of each user in @a users, a hash of
+   * username to orthrus_user_t.  Users without one keep a NULL seed. */
+  orthrus_error_t* (*get_users)(orthrus_t *ort, apr_hash_t *users);
+  /* Records every dirty user in @a users, found or not. */
+  orthrus_error_t* (*update)(orthrus_t *ort, apr_hash_t *users);
+  /* Calls @a cb with the first record of every user, in file order.
+   * Users handed out live until the operation ends. */
+  orthrus_error_t* (*each)(orthrus_t *ort, orthrus__userdb_each_t cb,
+                           void *baton);
+  /* Writes a complete userdb of @a users to @a file. */
+  orthrus_error_t* (*write)(orthrus_t *ort, apr_file_t *file,
+                            orthrus_user_t **users, apr_size_t count);
+};
+
+extern const orthrus__userdb_backend_t orthrus__userdb_text;
+extern const orthrus__userdb_backend_t orthrus__userdb_binary;
+extern const orthrus__userdb_backend_t orthrus__userdb_log;
+
+/* Magic numbers of the other formats; their NULs can't start a text
+ * userdb. */
+#define ORT_USERDB_BINARY_MAGIC "\211ORTUDB"
+#define ORT_USERDB_LOG_MAGIC "\211ORTLOG"
+
+/* Rewrites the open log userdb without its superseded records, if they
+ * outweigh the current ones. */
+orthrus_error_t* orthrus__userdb_log_compact(orthrus_t *ort);
+
+/* Rewrites the whole userdb in @a backend's format, with the dirty users
+ * of @a users, if any, replacing their records or added after the rest,
+ * and renames it into place. */
+orthrus_error_t* orthrus__userdb_rewrite(orthrus_t *ort,
+                                         const orthrus__userdb_backend_t *backend,
+                                         apr_hash_t *users);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif
@@ -0,0 +1,139 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software#
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Generates a minimal perfect hash of the RFC 2289 dictionary in src/words.c.
+#
+# A word of up to four letters is packed five bits per letter, first letter
+# lowest, into a 20 bit key; (c & 0x1f) is the same for either case.  The
+# top BUCKET_BITS of mix(key) pick a bucket, and the bucket's displacement
+# d gives the slot, mix(key ^ d) & 2047.  Each of the 2048 slots holds
+# (key << 11) | index, so a lookup is two loads and one compare.
+
+import re
+
+BUCKET_BITS = 10
+SLOTS = 2048
+M32 = 0xffffffff
+
+def mix(k):
+  k ^= k >> 16
+  k = (k * 0x7feb352d) & M32
+  k ^= k >> 15
+  k = (k * 0x846ca68b) & M32
+  k ^= k >> 16
+  return k
+
+def pack(word):
+  k = 0
+  for i, c in enumerate(word):
+    k |= (ord(c) & 0x1f) << (5 * i)
+  return k
+
+def read_dict(text):
+  m = re.search(r'rfc_2289_dict\[\](?:\[\d+\])?\s*=\s*\{(.*?)\};', text, re.S)
+  words = re.findall(r'"([A-Z]{1,4})"', m.group(1))
+  if len(words) != SLOTS:
+    raise ValueError("expected %d words, found %d" % (SLOTS, len(words)))
+  return words
+
+def build(words):
+  nbuckets = 1 << BUCKET_BITS
+  buckets = [[] for i in range(nbuckets)]
+  for index, word in enumerate(words):
+    key = pack(word)
+    buckets[mix(key) >> (32 - BUCKET_BITS)].append((key, index))
+
+  slots = [None] * SLOTS
+  disp = [0] * nbuckets
+
+  # Largest buckets first, while most slots are still free.
+  for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+    if not buckets[b]:
+      continue
+    for d in range(1 << 16):
+      pos = [mix(key ^ d) & (SLOTS - 1) for key, index in buckets[b]]
+      if len(set(pos)) == len(pos) and all(slots[p] is None for p in pos):
+        for p, (key, index) in zip(pos, buckets[b]):
+          slots[p] = (key << 11) | index
+        disp[b] = d
+        break
+    else:
+      raise ValueError("no displacement found for bucket %d" % b)
+
+  return disp, slots
+
+def c_array(values, fmt, per_line):
+  lines = []
+  for i in range(0, len(values), per_line):
+    lines.append("  " + ", ".join(fmt % v for v in values[i:i + per_line]) + ",")
+  return "\n".join(lines)
+
+def render(words):
+  disp, slots = build(words)
+  return """/* Generated from src/words.c by site_scons/site_tools/wordhash.py.
+ * Do not edit. */
+
+#ifndef _ORTHRUS_PRIVATE_WORDHASH_H_
+#define _ORTHRUS_PRIVATE_WORDHASH_H_
+
+#define ORT_WORDHASH_BUCKET_BITS %d
+
+static APR_INLINE apr_uint32_t orthrus__wordhash_mix(apr_uint32_t k)
+{
+  k ^= k >> 16;
+  k *= 0x7feb352d;
+  k ^= k >> 15;
+  k *= 0x846ca68b;
+  k ^= k >> 16;
+  return k;
+}
+
+static const apr_uint16_t orthrus__wordhash_disp[%d] = {
+%s
+};
+
+static const apr_uint32_t orthrus__wordhash_slots[%d] = {
+%s
+};
+
+#endif
+""" % (BUCKET_BITS,
+       len(disp), c_array(disp, "%5d", 10),
+       len(slots), c_array(slots, "0x%08x", 6))
+
+def write_header(source, target):
+  fp = open(source, 'r')
+  words = read_dict(fp.read())
+  fp.close()
+  fp = open(target, 'w')
+  fp.write(render(words))
+  fp.close()
+
+def wordhash(target, source, env):
+  write_header(str(source[0]), str(target[0]))
+
+def wordhash_string(target, source, env):
+  return "wordhash(%s)" % (str(target[0]))
+
+def generate(env):
+  import SCons.Action
+  env.Append(BUILDERS = {
+    'WordHash': env.Builder(action = SCons.Action.Action(wordhash, wordhash_string))
+    })
+
+def exists(env):
+  return True
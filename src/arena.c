@@ -0,0 +1,96 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+#define ARENA_ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(apr_size_t)(ARENA_ALIGN - 1))
+
+/* Spill blocks keep their data right after the header. */
+struct orthrus__arena_block_t {
+  orthrus__arena_block_t *next;
+  apr_uint64_t align;
+};
+
+void orthrus__arena_init(orthrus__arena_t *arena)
+{
+  arena->cur = arena->first.data;
+  arena->end = arena->first.data + sizeof(arena->first.data);
+  arena->blocks = NULL;
+}
+
+void *orthrus__arena_alloc(orthrus__arena_t *arena, apr_size_t size)
+{
+  orthrus__arena_block_t *b;
+  apr_size_t bsize;
+  char *p;
+
+  size = ARENA_ALIGN_UP(size);
+
+  if ((apr_size_t)(arena->end - arena->cur) < size) {
+    bsize = size > ORT_ARENA_BLOCK_SIZE ? size : ORT_ARENA_BLOCK_SIZE;
+    b = malloc(sizeof(*b) + bsize);
+    if (b == NULL) {
+      return NULL;
+    }
+    b->next = arena->blocks;
+    arena->blocks = b;
+    arena->cur = (char *)(b + 1);
+    arena->end = arena->cur + bsize;
+  }
+
+  p = arena->cur;
+  arena->cur += size;
+
+  return p;
+}
+
+void *orthrus__arena_calloc(orthrus__arena_t *arena, apr_size_t size)
+{
+  void *p = orthrus__arena_alloc(arena, size);
+
+  if (p) {
+    memset(p, 0, size);
+  }
+
+  return p;
+}
+
+char *orthrus__arena_strdup(orthrus__arena_t *arena, const char *str)
+{
+  apr_size_t len = strlen(str) + 1;
+  char *p = orthrus__arena_alloc(arena, len);
+
+  if (p) {
+    memcpy(p, str, len);
+  }
+
+  return p;
+}
+
+void orthrus__arena_reset(orthrus__arena_t *arena)
+{
+  orthrus__arena_block_t *b, *next;
+
+  for (b = arena->blocks; b != NULL; b = next) {
+    next = b->next;
+    free(b);
+  }
+
+  orthrus__arena_init(arena);
+}
@@ -0,0 +1,471 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "orthrus.h"
+#include "private/context.h"
+#include "apr_general.h"
+#include "apr_strings.h"
+#include "apr_sha1.h"
+
+/* Checkpoint files.
+ *
+ * A checkpoint file holds the chain value at every ORT_CKPT_INTERVAL'th
+ * sequence number of one (algorithm, seed, password) chain, so a
+ * calculation only has to hash forward from the checkpoint at or below
+ * its sequence.  Chain values let anyone compute every OTP above them,
+ * which are exactly the OTPs still to be used, so they are encrypted.
+ *
+ * Layout, integers big endian:
+ *
+ *   "ORTCKPT1"
+ *   salt[16]
+ *   u32 alg, u32 iterations, u32 interval, u32 count
+ *   u8 slen, seed[slen]
+ *   count * 8 bytes of encrypted values for interval, 2 * interval, ...
+ *   HMAC-SHA1 of everything above
+ *
+ * PBKDF2-HMAC-SHA1(password, salt || seed) gives an encryption key and a
+ * MAC key.  Value i is xored with HMAC-SHA1(enc_key, salt || u32 i).  The
+ * value at a given index never changes for a given key, so the salt is
+ * kept when the file is extended and only new values are encrypted.
+ *
+ * Deriving the keys costs more than hashing a short chain outright, so
+ * chains below ORT_CKPT_MIN_SEQUENCE are calculated directly and never
+ * touch the file.
+ */
+
+#define ORT_CKPT_MAGIC "ORTCKPT1"
+#define ORT_CKPT_MAGIC_LEN 8
+#define ORT_CKPT_SALT_LEN 16
+#define ORT_CKPT_HEADER_LEN (ORT_CKPT_MAGIC_LEN + ORT_CKPT_SALT_LEN + 16 + 1)
+#define ORT_CKPT_MAC_LEN APR_SHA1_DIGESTSIZE
+
+/* Cheaper than the chain steps a checkpoint saves, or it would not save
+ * anything, and so cheaper for a password guesser than an observed OTP;
+ * see orthrus_calculate_cached. */
+#define ORT_CKPT_ITERATIONS 1000
+#define ORT_CKPT_INTERVAL 64
+
+/* The key derivation takes about as long as 17000 steps of the fastest
+ * kernel, SHA-NI SHA-1; this leaves a margin for slower apr_sha1 builds. */
+#define ORT_CKPT_MIN_SEQUENCE 32768
+
+/* Caps the file at 512KB, or sequence 4M at the default interval. */
+#define ORT_CKPT_MAX_COUNT 65536
+
+typedef struct ckpt_hmac_t {
+  apr_sha1_ctx_t inner;
+  apr_sha1_ctx_t outer;
+} ckpt_hmac_t;
+
+typedef struct ckpt_t {
+  unsigned char salt[ORT_CKPT_SALT_LEN];
+  apr_uint32_t iterations;
+  apr_uint32_t interval;
+  apr_uint32_t count;
+  /* Encrypted, as stored in the file. */
+  apr_uint64_t *values;
+  ckpt_hmac_t enc;
+  ckpt_hmac_t mac;
+} ckpt_t;
+
+static void store_be32(unsigned char *p, apr_uint32_t v)
+{
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static apr_uint32_t load_be32(const unsigned char *p)
+{
+  return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16) |
+         ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
+static void hmac_key(ckpt_hmac_t *h, const unsigned char *key, apr_size_t klen)
+{
+  unsigned char pad[64];
+  unsigned char digest[APR_SHA1_DIGESTSIZE];
+  apr_size_t i;
+
+  if (klen > sizeof(pad)) {
+    apr_sha1_init(&h->inner);
+    apr_sha1_update_binary(&h->inner, key, klen);
+    apr_sha1_final(digest, &h->inner);
+    key = digest;
+    klen = sizeof(digest);
+  }
+
+  memset(pad, 0x36, sizeof(pad));
+  for (i = 0; i < klen; i++) {
+    pad[i] ^= key[i];
+  }
+  apr_sha1_init(&h->inner);
+  apr_sha1_update_binary(&h->inner, pad, sizeof(pad));
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (i = 0; i < klen; i++) {
+    pad[i] ^= key[i];
+  }
+  apr_sha1_init(&h->outer);
+  apr_sha1_update_binary(&h->outer, pad, sizeof(pad));
+
+  memset(pad, 0, sizeof(pad));
+  memset(digest, 0, sizeof(digest));
+}
+
+/* HMAC of the concatenation of @a a and @a b, either of which may be empty. */
+static void hmac(const ckpt_hmac_t *h,
+                 const unsigned char *a, apr_size_t alen,
+                 const unsigned char *b, apr_size_t blen,
+                 unsigned char out[APR_SHA1_DIGESTSIZE])
+{
+  apr_sha1_ctx_t ctx = h->inner;
+
+  apr_sha1_update_binary(&ctx, a, alen);
+  apr_sha1_update_binary(&ctx, b, blen);
+  apr_sha1_final(out, &ctx);
+
+  ctx = h->outer;
+  apr_sha1_update_binary(&ctx, out, APR_SHA1_DIGESTSIZE);
+  apr_sha1_final(out, &ctx);
+}
+
+/* Derives the two keys with PBKDF2, one output block for each. */
+static void ckpt_derive(ckpt_t *ck, const char *seed, apr_size_t slen,
+                        const char *pw, apr_size_t pwlen)
+{
+  ckpt_hmac_t prf;
+  unsigned char msg[ORT_CKPT_SALT_LEN + 16 + 4];
+  unsigned char u[APR_SHA1_DIGESTSIZE];
+  unsigned char t[APR_SHA1_DIGESTSIZE];
+  apr_uint32_t block, iter;
+  int i;
+
+  hmac_key(&prf, (const unsigned char *)pw, pwlen);
+
+  memcpy(msg, ck->salt, ORT_CKPT_SALT_LEN);
+  memcpy(msg + ORT_CKPT_SALT_LEN, seed, slen);
+
+  for (block = 1; block <= 2; block++) {
+    store_be32(msg + ORT_CKPT_SALT_LEN + slen, block);
+    hmac(&prf, msg, ORT_CKPT_SALT_LEN + slen + 4, NULL, 0, u);
+    memcpy(t, u, sizeof(t));
+
+    for (iter = 1; iter < ck->iterations; iter++) {
+      hmac(&prf, u, sizeof(u), NULL, 0, u);
+      for (i = 0; i < sizeof(t); i++) {
+        t[i] ^= u[i];
+      }
+    }
+
+    hmac_key(block == 1 ? &ck->enc : &ck->mac, t, sizeof(t));
+  }
+
+  memset(&prf, 0, sizeof(prf));
+  memset(u, 0, sizeof(u));
+  memset(t, 0, sizeof(t));
+}
+
+static apr_uint64_t ckpt_keystream(const ckpt_t *ck, apr_uint32_t index)
+{
+  unsigned char ctr[4];
+  unsigned char out[APR_SHA1_DIGESTSIZE];
+  apr_uint64_t k = 0;
+  int i;
+
+  store_be32(ctr, index);
+  hmac(&ck->enc, ck->salt, sizeof(ck->salt), ctr, sizeof(ctr), out);
+
+  for (i = 0; i < 8; i++) {
+    k = (k << 8) | out[i];
+  }
+
+  return k;
+}
+
+static apr_size_t ckpt_header(const ckpt_t *ck, apr_uint32_t alg,
+                              const char *seed, apr_size_t slen,
+                              unsigned char *buf)
+{
+  unsigned char *p = buf;
+
+  memcpy(p, ORT_CKPT_MAGIC, ORT_CKPT_MAGIC_LEN);
+  p += ORT_CKPT_MAGIC_LEN;
+  memcpy(p, ck->salt, ORT_CKPT_SALT_LEN);
+  p += ORT_CKPT_SALT_LEN;
+  store_be32(p, alg);
+  store_be32(p + 4, ck->iterations);
+  store_be32(p + 8, ck->interval);
+  store_be32(p + 12, ck->count);
+  p += 16;
+  *p++ = (unsigned char)slen;
+  memcpy(p, seed, slen);
+
+  return ORT_CKPT_HEADER_LEN + slen;
+}
+
+/* Loads @a path into @a ck.  Returns APR_ENOENT if there is no file yet,
+ * and APR_EMISMATCH if it belongs to another chain or fails the MAC, which
+ * is also what a mistyped password looks like.
+ */
+static apr_status_t ckpt_load(ckpt_t *ck, const char *path, apr_uint32_t alg,
+                              const char *seed, apr_size_t slen,
+                              const char *pw, apr_size_t pwlen,
+                              apr_pool_t *pool)
+{
+  apr_status_t rv;
+  apr_file_t *fp;
+  apr_finfo_t finfo;
+  unsigned char *buf, *p;
+  unsigned char header[ORT_CKPT_HEADER_LEN + 16];
+  unsigned char mac[ORT_CKPT_MAC_LEN];
+  apr_size_t len, hlen, i;
+
+  rv = apr_file_open(&fp, path, APR_READ|APR_BINARY, APR_OS_DEFAULT, pool);
+  if (rv) {
+    return rv;
+  }
+
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fp);
+  if (rv) {
+    apr_file_close(fp);
+    return rv;
+  }
+
+  hlen = ORT_CKPT_HEADER_LEN + slen;
+  if (finfo.size < (apr_off_t)(hlen + ORT_CKPT_MAC_LEN) ||
+      finfo.size > (apr_off_t)(hlen + ORT_CKPT_MAX_COUNT * 8 +
+                               ORT_CKPT_MAC_LEN)) {
+    apr_file_close(fp);
+    return APR_EMISMATCH;
+  }
+
+  len = (apr_size_t)finfo.size;
+  buf = apr_palloc(pool, len);
+  rv = apr_file_read_full(fp, buf, len, NULL);
+  apr_file_close(fp);
+  if (rv) {
+    return rv;
+  }
+
+  ck->iterations = load_be32(buf + ORT_CKPT_MAGIC_LEN + ORT_CKPT_SALT_LEN + 4);
+  ck->interval = load_be32(buf + ORT_CKPT_MAGIC_LEN + ORT_CKPT_SALT_LEN + 8);
+  ck->count = load_be32(buf + ORT_CKPT_MAGIC_LEN + ORT_CKPT_SALT_LEN + 12);
+  memcpy(ck->salt, buf + ORT_CKPT_MAGIC_LEN, ORT_CKPT_SALT_LEN);
+
+  /* Rebuilding the header from what we expect checks magic, alg and seed. */
+  ckpt_header(ck, alg, seed, slen, header);
+  if (memcmp(buf, header, hlen) != 0 ||
+      ck->iterations == 0 || ck->iterations > 10 * ORT_CKPT_ITERATIONS ||
+      ck->interval == 0 || ck->count > ORT_CKPT_MAX_COUNT ||
+      len != hlen + (apr_size_t)ck->count * 8 + ORT_CKPT_MAC_LEN) {
+    return APR_EMISMATCH;
+  }
+
+  ckpt_derive(ck, seed, slen, pw, pwlen);
+
+  hmac(&ck->mac, buf, len - ORT_CKPT_MAC_LEN, NULL, 0, mac);
+  if (memcmp(mac, buf + len - ORT_CKPT_MAC_LEN, ORT_CKPT_MAC_LEN) != 0) {
+    return APR_EMISMATCH;
+  }
+
+  ck->values = apr_palloc(pool, ck->count * sizeof(apr_uint64_t));
+
+  p = buf + hlen;
+  for (i = 0; i < ck->count; i++, p += 8) {
+    ck->values[i] = ((apr_uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+  }
+
+  return APR_SUCCESS;
+}
+
+static orthrus_error_t* ckpt_save(const ckpt_t *ck, const char *path,
+                                  apr_uint32_t alg,
+                                  const char *seed, apr_size_t slen,
+                                  apr_pool_t *pool)
+{
+  apr_status_t rv;
+  apr_file_t *fp;
+  const char *tmppath = apr_pstrcat(pool, path, ".tmp", NULL);
+  apr_size_t hlen = ORT_CKPT_HEADER_LEN + slen;
+  apr_size_t len = hlen + (apr_size_t)ck->count * 8 + ORT_CKPT_MAC_LEN;
+  unsigned char *buf = apr_palloc(pool, len);
+  unsigned char *p;
+  apr_size_t i;
+
+  ckpt_header(ck, alg, seed, slen, buf);
+
+  p = buf + hlen;
+  for (i = 0; i < ck->count; i++, p += 8) {
+    store_be32(p, (apr_uint32_t)(ck->values[i] >> 32));
+    store_be32(p + 4, (apr_uint32_t)ck->values[i]);
+  }
+
+  hmac(&ck->mac, buf, hlen + (apr_size_t)ck->count * 8, NULL, 0, p);
+
+  rv = apr_file_open(&fp, tmppath,
+                     APR_WRITE|APR_CREATE|APR_TRUNCATE|APR_BINARY,
+                     APR_UREAD|APR_UWRITE, pool);
+  if (rv) {
+    return orthrus_error_createf(rv, "Unable to open %s", tmppath);
+  }
+
+  rv = apr_file_write_full(fp, buf, len, NULL);
+  apr_file_close(fp);
+  if (rv) {
+    apr_file_remove(tmppath, pool);
+    return orthrus_error_createf(rv, "Unable to write %s", tmppath);
+  }
+
+  rv = apr_file_rename(tmppath, path, pool);
+  if (rv) {
+    apr_file_remove(tmppath, pool);
+    return orthrus_error_createf(rv, "Unable to rename %s to %s",
+                                 tmppath, path);
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+orthrus_error_t* orthrus_calculate_cached(orthrus_t *ort,
+                                          orthrus_response_t **out_reply,
+                                          const char *path,
+                                          apr_uint32_t alg,
+                                          apr_uint64_t sequence,
+                                          const char *in_seed,
+                                          const char *pw,
+                                          apr_size_t pwlen,
+                                          apr_pool_t *pool)
+{
+  const orthrus__kernel_t *kernel;
+  orthrus_error_t* err;
+  apr_status_t rv;
+  apr_size_t slen;
+  char seed[ORT_SEED_MAX + 1];
+  orthrus_response_t *reply;
+  ckpt_t ck;
+  apr_uint64_t pos, want, cap;
+  int dirty = 0;
+
+  *out_reply = NULL;
+
+  if (sequence < ORT_CKPT_MIN_SEQUENCE) {
+    return orthrus_calculate(ort, out_reply, alg, sequence, in_seed,
+                             pw, pwlen, pool);
+  }
+
+  err = orthrus__prepare_calculation(ort, alg, in_seed,
+                                     &kernel, seed, &slen);
+  if (err) {
+    return err;
+  }
+
+  memset(&ck, 0, sizeof(ck));
+
+  rv = ckpt_load(&ck, path, alg, seed, slen, pw, pwlen, pool);
+  if (rv == APR_SUCCESS) {
+    /* Already loaded. */
+  }
+  else if (APR_STATUS_IS_ENOENT(rv)) {
+    ck.iterations = ORT_CKPT_ITERATIONS;
+    ck.interval = ORT_CKPT_INTERVAL;
+    ck.count = 0;
+    rv = apr_generate_random_bytes(ck.salt, sizeof(ck.salt));
+    if (rv) {
+      return orthrus_error_create(rv, "Unable to generate checkpoint salt");
+    }
+    ckpt_derive(&ck, seed, slen, pw, pwlen);
+  }
+  else {
+    /* Never overwrite a file we can't read, it may only be a typo. */
+    ck.interval = ORT_CKPT_INTERVAL;
+    ck.count = 0;
+    path = NULL;
+  }
+
+  /* Room for every checkpoint at or below @a sequence. */
+  cap = sequence / ck.interval;
+  if (cap > ORT_CKPT_MAX_COUNT) {
+    cap = ORT_CKPT_MAX_COUNT;
+  }
+  if (path == NULL) {
+    cap = 0;
+  }
+  if (cap > ck.count) {
+    apr_uint64_t *values = apr_palloc(pool, cap * sizeof(apr_uint64_t));
+    if (ck.count) {
+      memcpy(values, ck.values, ck.count * sizeof(apr_uint64_t));
+    }
+    ck.values = values;
+  }
+
+  reply = apr_pcalloc(pool, sizeof(orthrus_response_t));
+  reply->pool = pool;
+
+  want = sequence / ck.interval;
+  if (want > ck.count) {
+    want = ck.count;
+  }
+
+  if (want == 0) {
+    err = kernel->fold(seed, slen, pw, pwlen, reply);
+    if (err) {
+      return err;
+    }
+    pos = 0;
+  }
+  else {
+    reply->reply = ck.values[want - 1] ^ ckpt_keystream(&ck, want - 1);
+    pos = want * ck.interval;
+  }
+
+  while (sequence - pos >= ck.interval) {
+    err = kernel->cycle(ck.interval, reply);
+    if (err) {
+      return err;
+    }
+    pos += ck.interval;
+
+    if (pos / ck.interval > ck.count && ck.count < cap) {
+      ck.values[ck.count] = reply->reply ^ ckpt_keystream(&ck, ck.count);
+      ck.count++;
+      dirty = 1;
+    }
+  }
+
+  err = kernel->cycle(sequence - pos, reply);
+  if (err) {
+    return err;
+  }
+
+  /* The cache only saves time, failing to update it is not fatal. */
+  if (dirty && path != NULL) {
+    err = ckpt_save(&ck, path, alg, seed, slen, pool);
+    if (err) {
+      orthrus_error_destroy(err);
+    }
+  }
+
+  memset(&ck.enc, 0, sizeof(ck.enc));
+  memset(&ck.mac, 0, sizeof(ck.mac));
+
+  *out_reply = reply;
+
+  return ORTHRUS_SUCCESS;
+}
@@ -17,33 +17,322 @@
 #include "orthrus.h"
 #include "private/context.h"
 #include "apr_strings.h"
+#include "apr_env.h"
 #include <ctype.h> /* for tolower */
 
-/* This really really should be using ap_providers, BUT those are part of
- * httpd, not APR, lame.
+/* Candidate implementations of an algorithm, best first.  An entry is
+ * only used when the CPU has every ORT_CPU_* bit in @a features and it
+ * passes the self-test below.
  */
-typedef orthrus_error_t* (*alg_fold_t)(const char *seed,
-                          apr_size_t slen,
-                          const char *pw,
-                          apr_size_t pwlen,
-                          orthrus_response_t *reply);
+typedef struct kernel_choice_t {
+  const orthrus__kernel_t *kernel;
+  apr_uint32_t features;
+} kernel_choice_t;
 
-typedef orthrus_error_t* (*alg_cycle_t)(apr_uint64_t sequence,
-                                       orthrus_response_t *reply);
+typedef struct engine_choice_t {
+  const orthrus__mb_engine_t *engine;
+  apr_uint32_t features;
+} engine_choice_t;
 
+static const kernel_choice_t md4_kernels[] = {
+  {&orthrus__md4_portable, 0},
+  {NULL, 0}
+};
+
+static const kernel_choice_t md5_kernels[] = {
+  {&orthrus__md5_portable, 0},
+  {NULL, 0}
+};
+
+static const kernel_choice_t sha1_kernels[] = {
+#ifdef ORT_HAVE_X86_KERNELS
+  {&orthrus__sha1_shani, ORT_CPU_SHA | ORT_CPU_SSE41},
+#endif
+  {&orthrus__sha1_portable, 0},
+  {NULL, 0}
+};
+
+static const engine_choice_t md4_engines[] = {
+#ifdef ORT_HAVE_X86_KERNELS
+  {&orthrus__md4_mb_avx512, ORT_CPU_AVX512F},
+  {&orthrus__md4_mb_avx2, ORT_CPU_AVX2},
+  {&orthrus__md4_mb_sse2, ORT_CPU_SSE2},
+#endif
+  {NULL, 0}
+};
+
+static const engine_choice_t md5_engines[] = {
+#ifdef ORT_HAVE_X86_KERNELS
+  {&orthrus__md5_mb_avx512, ORT_CPU_AVX512F},
+  {&orthrus__md5_mb_avx2, ORT_CPU_AVX2},
+  {&orthrus__md5_mb_sse2, ORT_CPU_SSE2},
+#endif
+  {NULL, 0}
+};
+
+static const engine_choice_t sha1_engines[] = {
+#ifdef ORT_HAVE_X86_KERNELS
+  {&orthrus__sha1_mb_avx512, ORT_CPU_AVX512F},
+  {&orthrus__sha1_mb_avx2, ORT_CPU_AVX2},
+  {&orthrus__sha1_mb_sse2, ORT_CPU_SSE2},
+#endif
+  {NULL, 0}
+};
+
+/* This really really should be using ap_providers, BUT those are part of
+ * httpd, not APR, lame.
+ */
 typedef struct alg_impl_t {
   int id;
   const char *name;
-  alg_fold_t fold;
-  alg_cycle_t cycle;
+  const kernel_choice_t *kernels;
+  const engine_choice_t *engines;
 } alg_impl_t;
 
 static alg_impl_t orthrus_algs[] = {
-  {ORTHRUS_ALG_MD4, "md4", orthrus__alg_md4_fold, orthrus__alg_md4_cycle},
-  {ORTHRUS_ALG_MD5, "md5", orthrus__alg_md5_fold, orthrus__alg_md5_cycle},
-  {ORTHRUS_ALG_SHA1, "sha1", orthrus__alg_sha1_fold, orthrus__alg_sha1_cycle},
+  {ORTHRUS_ALG_MD4, "md4", md4_kernels, md4_engines},
+  {ORTHRUS_ALG_MD5, "md5", md5_kernels, md5_engines},
+  {ORTHRUS_ALG_SHA1, "sha1", sha1_kernels, sha1_engines},
 };
 
+typedef struct selftest_t {
+  int alg;
+  const char *pw;
+  const char *seed;
+  apr_uint64_t sequence;
+  apr_uint64_t reply;
+} selftest_t;
+
+/* RFC 2289, Appendix C, with the seeds already lower cased. */
+static const selftest_t selftests[] = {
+  {ORTHRUS_ALG_MD4, "This is a test.", "test", 0, APR_UINT64_C(0xD1854218EBBB0B51)},
+  {ORTHRUS_ALG_MD4, "This is a test.", "test", 1, APR_UINT64_C(0x63473EF01CD0B444)},
+  {ORTHRUS_ALG_MD4, "This is a test.", "test", 99, APR_UINT64_C(0xC5E612776E6C237A)},
+  {ORTHRUS_ALG_MD4, "AbCdEfGhIjK", "alpha1", 0, APR_UINT64_C(0x50076F47EB1ADE4E)},
+  {ORTHRUS_ALG_MD4, "AbCdEfGhIjK", "alpha1", 1, APR_UINT64_C(0x65D20D1949B5F7AB)},
+  {ORTHRUS_ALG_MD4, "AbCdEfGhIjK", "alpha1", 99, APR_UINT64_C(0xD150C82CCE6F62D1)},
+  {ORTHRUS_ALG_MD4, "OTP's are good", "correct", 0, APR_UINT64_C(0x849C79D4F6F55388)},
+  {ORTHRUS_ALG_MD4, "OTP's are good", "correct", 1, APR_UINT64_C(0x8C0992FB250847B1)},
+  {ORTHRUS_ALG_MD4, "OTP's are good", "correct", 99, APR_UINT64_C(0x3F3BF4B4145FD74B)},
+
+  {ORTHRUS_ALG_MD5, "This is a test.", "test", 0, APR_UINT64_C(0x9E876134D90499DD)},
+  {ORTHRUS_ALG_MD5, "This is a test.", "test", 1, APR_UINT64_C(0x7965E05436F5029F)},
+  {ORTHRUS_ALG_MD5, "This is a test.", "test", 99, APR_UINT64_C(0x50FE1962C4965880)},
+  {ORTHRUS_ALG_MD5, "AbCdEfGhIjK", "alpha1", 0, APR_UINT64_C(0x87066DD9644BF206)},
+  {ORTHRUS_ALG_MD5, "AbCdEfGhIjK", "alpha1", 1, APR_UINT64_C(0x7CD34C1040ADD14B)},
+  {ORTHRUS_ALG_MD5, "AbCdEfGhIjK", "alpha1", 99, APR_UINT64_C(0x5AA37A81F212146C)},
+  {ORTHRUS_ALG_MD5, "OTP's are good", "correct", 0, APR_UINT64_C(0xF205753943DE4CF9)},
+  {ORTHRUS_ALG_MD5, "OTP's are good", "correct", 1, APR_UINT64_C(0xDDCDAC956F234937)},
+  {ORTHRUS_ALG_MD5, "OTP's are good", "correct", 99, APR_UINT64_C(0xB203E28FA525BE47)},
+
+  {ORTHRUS_ALG_SHA1, "This is a test.", "test", 0, APR_UINT64_C(0xBB9E6AE1979D8FF4)},
+  {ORTHRUS_ALG_SHA1, "This is a test.", "test", 1, APR_UINT64_C(0x63D936639734385B)},
+  {ORTHRUS_ALG_SHA1, "This is a test.", "test", 99, APR_UINT64_C(0x87FEC7768B73CCF9)},
+  {ORTHRUS_ALG_SHA1, "AbCdEfGhIjK", "alpha1", 0, APR_UINT64_C(0xAD85F658EBE383C9)},
+  {ORTHRUS_ALG_SHA1, "AbCdEfGhIjK", "alpha1", 1, APR_UINT64_C(0xD07CE229B5CF119B)},
+  {ORTHRUS_ALG_SHA1, "AbCdEfGhIjK", "alpha1", 99, APR_UINT64_C(0x27BC71035AAF3DC6)},
+  {ORTHRUS_ALG_SHA1, "OTP's are good", "correct", 0, APR_UINT64_C(0xD51F3E99BF8E6F0B)},
+  {ORTHRUS_ALG_SHA1, "OTP's are good", "correct", 1, APR_UINT64_C(0x82AEB52D943774E4)},
+  {ORTHRUS_ALG_SHA1, "OTP's are good", "correct", 99, APR_UINT64_C(0x4F296A74FE1567EC)},
+};
+
+#define NUM_SELFTESTS (sizeof(selftests) / sizeof(selftests[0]))
+
+static int kernel_selftest(int alg, const orthrus__kernel_t *kernel,
+                           apr_pool_t *pool)
+{
+  apr_size_t i;
+  orthrus_response_t reply;
+
+  for (i = 0; i < NUM_SELFTESTS; i++) {
+    const selftest_t *t = &selftests[i];
+
+    if (t->alg != alg) {
+      continue;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.pool = pool;
+
+    if (kernel->fold(t->seed, strlen(t->seed), t->pw, strlen(t->pw), &reply) ||
+        kernel->cycle(t->sequence, &reply) ||
+        reply.reply != t->reply) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Runs every vector of @a alg through @a engine at once, starting from the
+ * folds of the already selected @a kernel. */
+static int engine_selftest(int alg, const orthrus__mb_engine_t *engine,
+                           const orthrus__kernel_t *kernel, apr_pool_t *pool)
+{
+  apr_uint64_t values[NUM_SELFTESTS];
+  apr_uint64_t steps[NUM_SELFTESTS];
+  apr_size_t index[NUM_SELFTESTS];
+  apr_size_t i, n = 0;
+  orthrus_response_t reply;
+
+  for (i = 0; i < NUM_SELFTESTS; i++) {
+    const selftest_t *t = &selftests[i];
+
+    if (t->alg != alg) {
+      continue;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.pool = pool;
+
+    if (kernel->fold(t->seed, strlen(t->seed), t->pw, strlen(t->pw), &reply)) {
+      return 0;
+    }
+
+    index[n] = i;
+    values[n] = reply.reply;
+    steps[n] = t->sequence;
+    n++;
+  }
+
+  orthrus__mb_chain(engine, values, steps, n);
+
+  for (i = 0; i < n; i++) {
+    if (values[i] != selftests[index[i]].reply) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* ORTHRUS_KERNEL and ORTHRUS_ENGINE take a comma separated list of either
+ * a bare name, applying to every algorithm, or alg=name, e.g.
+ * "ORTHRUS_KERNEL=portable" or "ORTHRUS_ENGINE=sha1=avx2,md5=none".
+ */
+static const char *env_override(const char *var, const char *alg,
+                                apr_pool_t *pool)
+{
+  char *value, *tok, *last;
+  const char *any = NULL;
+
+  if (apr_env_get(&value, var, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+
+  for (tok = apr_strtok(value, ",", &last); tok != NULL;
+       tok = apr_strtok(NULL, ",", &last)) {
+    char *eq = strchr(tok, '=');
+
+    if (eq == NULL) {
+      any = tok;
+    }
+    else {
+      *eq = '\0';
+      if (strcmp(tok, alg) == 0) {
+        return eq + 1;
+      }
+    }
+  }
+
+  return any;
+}
+
+static const orthrus__kernel_t *select_kernel(const alg_impl_t *impl,
+                                              apr_uint32_t features,
+                                              apr_pool_t *pool)
+{
+  const kernel_choice_t *c;
+  const char *want = env_override("ORTHRUS_KERNEL", impl->name, pool);
+
+  /* An override the CPU can't run, or that fails, falls back below. */
+  if (want != NULL) {
+    for (c = impl->kernels; c->kernel != NULL; c++) {
+      if (strcmp(c->kernel->name, want) == 0 &&
+          (c->features & features) == c->features &&
+          kernel_selftest(impl->id, c->kernel, pool)) {
+        return c->kernel;
+      }
+    }
+  }
+
+  for (c = impl->kernels; c->kernel != NULL; c++) {
+    if ((c->features & features) == c->features &&
+        kernel_selftest(impl->id, c->kernel, pool)) {
+      return c->kernel;
+    }
+  }
+
+  return NULL;
+}
+
+static const orthrus__mb_engine_t *select_engine(const alg_impl_t *impl,
+                                                 const orthrus__kernel_t *kernel,
+                                                 apr_uint32_t features,
+                                                 apr_pool_t *pool)
+{
+  const engine_choice_t *c;
+  const char *want = env_override("ORTHRUS_ENGINE", impl->name, pool);
+
+  if (kernel == NULL) {
+    return NULL;
+  }
+
+  if (want != NULL) {
+    if (strcmp(want, "none") == 0) {
+      return NULL;
+    }
+    for (c = impl->engines; c->engine != NULL; c++) {
+      if (strcmp(c->engine->name, want) == 0 &&
+          (c->features & features) == c->features &&
+          engine_selftest(impl->id, c->engine, kernel, pool)) {
+        return c->engine;
+      }
+    }
+  }
+
+  for (c = impl->engines; c->engine != NULL; c++) {
+    if ((c->features & features) == c->features &&
+        engine_selftest(impl->id, c->engine, kernel, pool)) {
+      return c->engine;
+    }
+  }
+
+  return NULL;
+}
+
+/* Picks the fastest implementation of each algorithm that this CPU runs
+ * and that reproduces the RFC vectors.  An algorithm whose every kernel
+ * fails is left NULL, so calculations with it report APR_ENOTIMPL.
+ */
+static void select_kernels(orthrus_t *ort)
+{
+  apr_size_t i;
+  apr_uint32_t features = orthrus__cpu_features();
+  apr_pool_t *tpool;
+
+  apr_pool_create(&tpool, ort->pool);
+
+  for (i = 0; i < sizeof(orthrus_algs) / sizeof(orthrus_algs[0]); i++) {
+    const alg_impl_t *impl = &orthrus_algs[i];
+
+    ort->kernels[impl->id] = select_kernel(impl, features, tpool);
+    ort->engines[impl->id] = select_engine(impl, ort->kernels[impl->id],
+                                           features, tpool);
+  }
+
+  apr_pool_destroy(tpool);
+}
+
+static apr_status_t orthrus_cleanup(void *data)
+{
+  orthrus_t *ort = data;
+
+  orthrus__arena_reset(&ort->scratch);
+
+  return APR_SUCCESS;
+}
+
 orthrus_error_t* orthrus_create(apr_pool_t *pool, orthrus_t **out_ort)
 {
   orthrus_t *ort;
@@ -54,52 +343,64 @@ orthrus_error_t* orthrus_create(apr_pool_t *pool, orthrus_t **out_ort)
   
   ort->pool = p;
 
+  orthrus__arena_init(&ort->scratch);
+  apr_pool_cleanup_register(p, ort, orthrus_cleanup, apr_pool_cleanup_null);
+
+  select_kernels(ort);
+  orthrus__format_init(ort);
+
   *out_ort = ort;
 
   return ORTHRUS_SUCCESS;
 }
 
-static char *strtolower(char *input)
+orthrus_error_t* orthrus_kernel_name(orthrus_t *ort,
+                                     apr_uint32_t alg,
+                                     const char **name)
 {
-  char *p = input;
-  while (*p != '\0') {
-    *p = tolower(*p);
-    p++;
+  if (alg >= ORTHRUS__NUM_ALGS || ort->kernels[alg] == NULL) {
+    return orthrus_error_createf(APR_ENOTIMPL, "unknown algorithm %u", alg);
   }
-  return input;
+
+  *name = ort->kernels[alg]->name;
+
+  return ORTHRUS_SUCCESS;
 }
 
-orthrus_error_t* orthrus_calculate(orthrus_t *ort,
-                                   orthrus_response_t **out_reply,
-                                   apr_uint32_t alg,
-                                   apr_uint64_t sequence,
-                                   const char *in_seed,
-                                   const char *pw,
-                                   apr_size_t pwlen,
-                                   apr_pool_t *pool)
+orthrus_error_t* orthrus_engine_name(orthrus_t *ort,
+                                     apr_uint32_t alg,
+                                     const char **name)
 {
-  int i;
-  alg_impl_t *algimpl = NULL;
-  orthrus_error_t* err;
-  apr_size_t slen;
-  char *seed;
-  orthrus_response_t *reply;
+  if (alg >= ORTHRUS__NUM_ALGS || ort->kernels[alg] == NULL) {
+    return orthrus_error_createf(APR_ENOTIMPL, "unknown algorithm %u", alg);
+  }
 
-  *out_reply = NULL;
+  *name = ort->engines[alg] ? ort->engines[alg]->name : "none";
+
+  return ORTHRUS_SUCCESS;
+}
+
+orthrus_error_t* orthrus__prepare_calculation(orthrus_t *ort,
+                                              apr_uint32_t alg,
+                                              const char *in_seed,
+                                              const orthrus__kernel_t **kernel,
+                                              char *seed,
+                                              apr_size_t *slen)
+{
+  apr_size_t i;
+
+  *kernel = NULL;
 
   /* RFC 2289 Section 5.0:
    * All conforming implementations of both server and generators MUST support
    * MD5.  They SHOULD support SHA and MAY also support MD4.
    */
 
-  for (i = 0; i < sizeof(orthrus_algs) / sizeof(orthrus_algs[0]); i++) {
-    if (alg == orthrus_algs[i].id) {
-      algimpl = &orthrus_algs[i];
-      break;
-    }
+  if (alg < ORTHRUS__NUM_ALGS) {
+    *kernel = ort->kernels[alg];
   }
 
-  if (algimpl == NULL) {
+  if (*kernel == NULL) {
     return orthrus_error_create(APR_ENOTIMPL,  "md4 and md5 are the only supported algorithms at this time.");
   }
   
@@ -107,7 +408,11 @@ orthrus_error_t* orthrus_calculate(orthrus_t *ort,
    * The seed MUST be case insensitive and MUST be internally converted to
    * lower case before it is processed.
    */
-  seed = strtolower(apr_pstrdup(pool, in_seed));
+  for (i = 0; i <= ORT_SEED_MAX && in_seed[i] != '\0'; i++) {
+    if (i < ORT_SEED_MAX) {
+      seed[i] = tolower((unsigned char)in_seed[i]);
+    }
+  }
 
   /* TODO: Figure out what characters are actualy used, is [a-z0-9] actually 
    * enough ? */
@@ -115,35 +420,319 @@ orthrus_error_t* orthrus_calculate(orthrus_t *ort,
    * The seed MUST consist of purely alphanumeric characters and MUST be
    * of one to 16 characters in length.
    */
-  slen = strlen(seed);
-  if (slen < 1 || slen > 16) {
+  if (i < 1 || i > ORT_SEED_MAX) {
+    *slen = strlen(in_seed);
     return orthrus_error_createf(APR_BADARG, "Seed of length %"
                                  APR_SIZE_T_FMT" was given. Seed must be "
-                                 "between 1 and 16 characters", slen);
+                                 "between 1 and 16 characters", *slen);
+  }
+
+  seed[i] = '\0';
+  *slen = i;
+
+  return ORTHRUS_SUCCESS;
+}
+
+orthrus_error_t* orthrus_calculate(orthrus_t *ort,
+                                   orthrus_response_t **out_reply,
+                                   apr_uint32_t alg,
+                                   apr_uint64_t sequence,
+                                   const char *in_seed,
+                                   const char *pw,
+                                   apr_size_t pwlen,
+                                   apr_pool_t *pool)
+{
+  const orthrus__kernel_t *kernel;
+  orthrus_error_t* err;
+  apr_size_t slen;
+  char seed[ORT_SEED_MAX + 1];
+  orthrus_response_t *reply;
+
+  *out_reply = NULL;
+
+  err = orthrus__prepare_calculation(ort, alg, in_seed,
+                                     &kernel, seed, &slen);
+  if (err) {
+    return err;
   }
 
-  
   reply = apr_pcalloc(pool, sizeof(orthrus_response_t));
 
   reply->pool = pool;
   
-  err = algimpl->fold(seed, slen, pw, pwlen, reply);
+  err = kernel->fold(seed, slen, pw, pwlen, reply);
 
   if (err) {
     return err;
   }
 
-  err = algimpl->cycle(sequence, reply);
+  err = kernel->cycle(sequence, reply);
   if (err) {
     return err;
   }
 
-  orthrus__format_hex(reply, pool);
-  orthrus__format_words(reply, pool);
-  
   *out_reply = reply;
 
   return ORTHRUS_SUCCESS;
 }
 
+/* orthrus_otp_t is public, so its sizes are spelled out; keep them honest. */
+typedef char orthrus__otp_hex_size_check
+  [ORTHRUS_OTP_HEX_SIZE == ORT_HEX_LEN + 1 ? 1 : -1];
+typedef char orthrus__otp_words_size_check
+  [ORTHRUS_OTP_WORDS_SIZE == ORT_WORDS_MAX_LEN + 1 ? 1 : -1];
+
+orthrus_error_t* orthrus_calculate_into(orthrus_t *ort,
+                                        orthrus_otp_t *otp,
+                                        apr_uint32_t alg,
+                                        apr_uint64_t sequence,
+                                        const char *in_seed,
+                                        const char *pw,
+                                        apr_size_t pwlen)
+{
+  const orthrus__kernel_t *kernel;
+  orthrus_error_t* err;
+  apr_size_t slen;
+  char seed[ORT_SEED_MAX + 1];
+  orthrus_response_t reply;
+
+  memset(otp, 0, sizeof(*otp));
+
+  err = orthrus__prepare_calculation(ort, alg, in_seed,
+                                     &kernel, seed, &slen);
+  if (err) {
+    return err;
+  }
 
+  /* The kernels only touch reply->reply, so a stack response will do. */
+  reply.pool = NULL;
+
+  err = kernel->fold(seed, slen, pw, pwlen, &reply);
+  if (err) {
+    return err;
+  }
+
+  err = kernel->cycle(sequence, &reply);
+  if (err) {
+    return err;
+  }
+
+  otp->value = reply.reply;
+  otp->hex[orthrus__hex_write(reply.reply, otp->hex)] = '\0';
+  otp->words[orthrus__words_write(reply.reply, otp->words)] = '\0';
+
+  return ORTHRUS_SUCCESS;
+}
+
+void orthrus_response_value(orthrus_response_t *reply, apr_uint64_t *output)
+{
+  *output = reply->reply;
+}
+
+orthrus_error_t* orthrus_calculate_batch(orthrus_t *ort,
+                                         orthrus_response_t **replies,
+                                         const orthrus_request_t *requests,
+                                         apr_size_t count,
+                                         apr_pool_t *pool)
+{
+  apr_size_t i, n;
+  apr_uint32_t alg;
+  orthrus_error_t* err;
+  apr_uint64_t *values = apr_palloc(pool, count * sizeof(*values));
+  apr_uint64_t *steps = apr_palloc(pool, count * sizeof(*steps));
+  apr_size_t *index = apr_palloc(pool, count * sizeof(*index));
+
+  for (i = 0; i < count; i++) {
+    replies[i] = NULL;
+  }
+
+  /* Folding is a single variable length hash per request, do it up front. */
+  for (i = 0; i < count; i++) {
+    const orthrus_request_t *req = &requests[i];
+    const orthrus__kernel_t *kernel;
+    apr_size_t slen;
+    char seed[ORT_SEED_MAX + 1];
+    orthrus_response_t *reply;
+
+    err = orthrus__prepare_calculation(ort, req->alg, req->seed,
+                                       &kernel, seed, &slen);
+    if (err) {
+      return err;
+    }
+
+    reply = apr_pcalloc(pool, sizeof(orthrus_response_t));
+    reply->pool = pool;
+
+    err = kernel->fold(seed, slen, req->pw, req->pwlen, reply);
+    if (err) {
+      return err;
+    }
+
+    if (ort->engines[req->alg] == NULL) {
+      err = kernel->cycle(req->sequence, reply);
+      if (err) {
+        return err;
+      }
+    }
+
+    replies[i] = reply;
+  }
+
+  /* Then run the chains of each algorithm side by side. */
+  for (alg = 0; alg < ORTHRUS__NUM_ALGS; alg++) {
+    if (ort->engines[alg] == NULL) {
+      continue;
+    }
+
+    for (i = 0, n = 0; i < count; i++) {
+      if (requests[i].alg == alg) {
+        index[n] = i;
+        values[n] = replies[i]->reply;
+        steps[n] = requests[i].sequence;
+        n++;
+      }
+    }
+
+    orthrus__mb_chain(ort->engines[alg], values, steps, n);
+
+    for (i = 0; i < n; i++) {
+      replies[index[i]]->reply = values[i];
+    }
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+typedef struct range_ctx_t {
+  const orthrus__kernel_t *kernel;
+  int flags;
+  char *buf;
+  apr_size_t len;
+  apr_size_t used;
+} range_ctx_t;
+
+static orthrus_error_t* range_write(range_ctx_t *rc,
+                                    apr_uint64_t sequence,
+                                    apr_uint64_t value)
+{
+  char line[ORTHRUS_RANGE_LINE_MAX];
+  apr_size_t n;
+
+  n = apr_snprintf(line, sizeof(line), "%" APR_UINT64_T_FMT ":", sequence);
+
+  if (rc->flags & ORTHRUS_RANGE_HEX) {
+    line[n++] = ' ';
+    n += orthrus__hex_write(value, line + n);
+  }
+
+  if (rc->flags & ORTHRUS_RANGE_WORDS) {
+    line[n++] = ' ';
+    n += orthrus__words_write(value, line + n);
+  }
+
+  line[n++] = '\n';
+
+  if (n > rc->len - rc->used) {
+    return orthrus_error_createf(APR_ENOSPC, "Range buffer of %"
+                                 APR_SIZE_T_FMT" bytes is too small",
+                                 rc->len);
+  }
+
+  memcpy(rc->buf + rc->used, line, n);
+  rc->used += n;
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Writes the OTPs for sequences @a hi down to @a lo, given the chain value
+ * @a at for @a lo.  Each level bisects the span and only keeps one value
+ * per level live, so the cost is O(log n) values and O(n log n) steps.
+ */
+static orthrus_error_t* range_emit(range_ctx_t *rc,
+                                   const orthrus_response_t *at,
+                                   apr_uint64_t lo,
+                                   apr_uint64_t hi)
+{
+  orthrus_error_t* err;
+
+  while (lo < hi) {
+    apr_uint64_t mid = lo + (hi - lo + 1) / 2;
+    orthrus_response_t upper = *at;
+
+    err = rc->kernel->cycle(mid - lo, &upper);
+    if (err) {
+      return err;
+    }
+
+    err = range_emit(rc, &upper, mid, hi);
+    if (err) {
+      return err;
+    }
+
+    hi = mid - 1;
+  }
+
+  return range_write(rc, lo, at->reply);
+}
+
+orthrus_error_t* orthrus_calculate_range(orthrus_t *ort,
+                                         char *buf,
+                                         apr_size_t *len,
+                                         int flags,
+                                         apr_uint32_t alg,
+                                         apr_uint64_t sequence,
+                                         apr_uint64_t count,
+                                         const char *in_seed,
+                                         const char *pw,
+                                         apr_size_t pwlen,
+                                         apr_pool_t *pool)
+{
+  orthrus_error_t* err;
+  apr_size_t slen;
+  char seed[ORT_SEED_MAX + 1];
+  orthrus_response_t start;
+  range_ctx_t rc;
+
+  rc.buf = buf;
+  rc.len = *len;
+  rc.used = 0;
+  rc.flags = flags;
+
+  *len = 0;
+
+  if (count == 0) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  if (count - 1 > sequence) {
+    return orthrus_error_createf(APR_BADARG, "Range of %" APR_UINT64_T_FMT
+                                 " OTPs starting at sequence %"
+                                 APR_UINT64_T_FMT" goes below zero",
+                                 count, sequence);
+  }
+
+  err = orthrus__prepare_calculation(ort, alg, in_seed,
+                                     &rc.kernel, seed, &slen);
+  if (err) {
+    return err;
+  }
+
+  memset(&start, 0, sizeof(start));
+  start.pool = pool;
+
+  err = rc.kernel->fold(seed, slen, pw, pwlen, &start);
+  if (err) {
+    return err;
+  }
+
+  err = rc.kernel->cycle(sequence - (count - 1), &start);
+  if (err) {
+    return err;
+  }
+
+  err = range_emit(&rc, &start, sequence - (count - 1), sequence);
+
+  *len = rc.used;
+
+  return err;
+}
@@ -0,0 +1,100 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "orthrus.h"
+#include "private/context.h"
+
+#ifdef ORT_HAVE_X86_KERNELS
+#include <cpuid.h>
+
+/* CPUID.1:EDX */
+#define CPUID1_EDX_SSE2    (1 << 26)
+
+/* CPUID.1:ECX */
+#define CPUID1_ECX_SSSE3   (1 << 9)
+#define CPUID1_ECX_SSE41   (1 << 19)
+#define CPUID1_ECX_OSXSAVE (1 << 27)
+#define CPUID1_ECX_AVX     (1 << 28)
+
+/* CPUID.(7,0):EBX */
+#define CPUID7_EBX_AVX2    (1 << 5)
+#define CPUID7_EBX_AVX512F (1 << 16)
+#define CPUID7_EBX_SHA     (1 << 29)
+
+/* XCR0 state components the OS must save for AVX and AVX-512. */
+#define XCR0_YMM 0x06
+#define XCR0_ZMM 0xe6
+
+static apr_uint64_t xgetbv0(void)
+{
+  apr_uint32_t lo, hi;
+  __asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+  return ((apr_uint64_t)hi << 32) | lo;
+}
+
+apr_uint32_t orthrus__cpu_features(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int ecx1;
+  apr_uint64_t xcr0 = 0;
+  apr_uint32_t features = 0;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx)) {
+    return 0;
+  }
+
+  if (edx & CPUID1_EDX_SSE2) {
+    features |= ORT_CPU_SSE2;
+  }
+  if (ecx1 & CPUID1_ECX_SSSE3) {
+    features |= ORT_CPU_SSSE3;
+  }
+  if (ecx1 & CPUID1_ECX_SSE41) {
+    features |= ORT_CPU_SSE41;
+  }
+  if (ecx1 & CPUID1_ECX_OSXSAVE) {
+    xcr0 = xgetbv0();
+  }
+
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return features;
+  }
+
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+  if (ebx & CPUID7_EBX_SHA) {
+    features |= ORT_CPU_SHA;
+  }
+  if ((ecx1 & CPUID1_ECX_AVX) && (xcr0 & XCR0_YMM) == XCR0_YMM) {
+    if (ebx & CPUID7_EBX_AVX2) {
+      features |= ORT_CPU_AVX2;
+    }
+    if ((ebx & CPUID7_EBX_AVX512F) && (xcr0 & XCR0_ZMM) == XCR0_ZMM) {
+      features |= ORT_CPU_AVX512F;
+    }
+  }
+
+  return features;
+}
+
+#else
+
+apr_uint32_t orthrus__cpu_features(void)
+{
+  return 0;
+}
+
+#endif
@@ -25,6 +25,31 @@
 #include "orthrus_error.h"
 #include "apr_strings.h"
 
+/* No call site to record, see orthrus_error_static. */
+#define STATIC_ERROR(err, msg) {err, msg, 0, "(static)", NULL}
+
+/* Indexed by orthrus_static_error_e. */
+const orthrus_error_t orthrus__static_errors[ORTHRUS__NUM_STATIC_ERRORS] = {
+    STATIC_ERROR(APR_NOTFOUND, "user not found"),
+    STATIC_ERROR(APR_EGENERAL, "invalid response."),
+    STATIC_ERROR(APR_EGENERAL, "seed changed between challenge and verification."),
+    STATIC_ERROR(APR_EGENERAL, "sequence changed between challenge and verification."),
+    STATIC_ERROR(APR_EGENERAL, "Word length out of range"),
+    STATIC_ERROR(APR_EGENERAL, "Didn't see precisely 6 words"),
+    STATIC_ERROR(APR_EGENERAL, "Word not found in table"),
+    STATIC_ERROR(APR_EGENERAL, "Parity error"),
+};
+
+int
+orthrus_error_is_static(const orthrus_error_t *err)
+{
+    return err >= &orthrus__static_errors[0] &&
+           err < &orthrus__static_errors[ORTHRUS__NUM_STATIC_ERRORS];
+}
+
+/* The message is kept in the same allocation as the error, and @a file is
+ * always a string literal from __FILE__, so only the pointer is kept.
+ */
 orthrus_error_t*
 orthrus_error_create_impl(apr_status_t err,
                           const char *msg,
@@ -32,13 +57,15 @@ orthrus_error_create_impl(apr_status_t err,
                           const char *file)
 {
     orthrus_error_t *e;
+    apr_size_t s = strlen(msg);
     
-    e = malloc(sizeof(*e));
+    e = malloc(sizeof(*e) + s + 1);
 
     e->err = err;
-    e->msg = strdup(msg);
+    e->msg = memcpy(e + 1, msg, s + 1);
     e->line = line;
-    e->file = strdup(file);
+    e->file = file;
+    e->pool = NULL;
     
     return e;
 }
@@ -54,26 +81,21 @@ orthrus_error_createf_impl(apr_status_t err,
     va_list ap, aq;
     apr_size_t s;
 
-    e = malloc(sizeof(*e));
-
-    e->err = err;
-
     va_start(ap, fmt);
     va_copy(aq, ap);
 
-#ifdef HAVE_VASPRINTF
-    vasprintf((char **)&e->msg, fmt, ap);
-#else
     s = apr_vsnprintf(NULL, 0, fmt, ap);
-    e->msg = malloc(s + 1);
-    apr_vsnprintf((char *)e->msg, s + 1, fmt, aq);
-#endif
+    e = malloc(sizeof(*e) + s + 1);
+    apr_vsnprintf((char *)(e + 1), s + 1, fmt, aq);
 
     va_end(ap);
     va_end(aq);
 
+    e->err = err;
+    e->msg = (const char *)(e + 1);
     e->line = line;
-    e->file = strdup(file);
+    e->file = file;
+    e->pool = NULL;
 
     return e;
 }
@@ -81,9 +103,7 @@ orthrus_error_createf_impl(apr_status_t err,
 void
 orthrus_error_destroy(orthrus_error_t *err)
 {
-    if (err) {
-        free((void *) err->msg);
-        free((void *) err->file);
+    if (err && !orthrus_error_is_static(err)) {
         free(err);
     }
 }
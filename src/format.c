@@ -0,0 +1,186 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "orthrus.h"
+#include "private/context.h"
+
+/* Built in output formats.  Each writes straight into the caller's buffer
+ * when the result fits, and otherwise only reports its length.
+ */
+
+/* Hex digits and the separating space all have 0x20 set except A-F. */
+static void hex_lower(char *buf, apr_size_t len)
+{
+  apr_size_t i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] |= 0x20;
+  }
+}
+
+static apr_size_t write_hex(apr_uint64_t value, char *buf, apr_size_t size,
+                            int grouped, int lower)
+{
+  apr_size_t len = grouped ? ORT_HEX_LEN : 16;
+
+  if (size >= len) {
+    if (grouped) {
+      orthrus__hex_write(value, buf);
+    }
+    else {
+      orthrus__hex_write_plain(value, buf);
+    }
+    if (lower) {
+      hex_lower(buf, len);
+    }
+  }
+  return len;
+}
+
+static apr_size_t format_hex(void *baton, apr_uint64_t value,
+                             char *buf, apr_size_t size)
+{
+  return write_hex(value, buf, size, 1, 0);
+}
+
+static apr_size_t format_hex_lower(void *baton, apr_uint64_t value,
+                                   char *buf, apr_size_t size)
+{
+  return write_hex(value, buf, size, 1, 1);
+}
+
+static apr_size_t format_hex_compact(void *baton, apr_uint64_t value,
+                                     char *buf, apr_size_t size)
+{
+  return write_hex(value, buf, size, 0, 0);
+}
+
+static apr_size_t format_hex_compact_lower(void *baton, apr_uint64_t value,
+                                           char *buf, apr_size_t size)
+{
+  return write_hex(value, buf, size, 0, 1);
+}
+
+static apr_size_t format_words(void *baton, apr_uint64_t value,
+                               char *buf, apr_size_t size)
+{
+  char words[ORT_WORDS_MAX_LEN];
+  apr_size_t len;
+
+  if (size >= ORT_WORDS_MAX_LEN) {
+    return orthrus__words_write(value, buf);
+  }
+
+  len = orthrus__words_write(value, words);
+  if (size >= len) {
+    memcpy(buf, words, len);
+  }
+  return len;
+}
+
+/* The eight RFC 2289 output bytes, for machine clients. */
+static apr_size_t format_binary(void *baton, apr_uint64_t value,
+                                char *buf, apr_size_t size)
+{
+  int i;
+
+  if (size >= 8) {
+    for (i = 0; i < 8; i++) {
+      buf[i] = (char)(value >> (56 - 8 * i));
+    }
+  }
+  return 8;
+}
+
+static const orthrus_format_t builtin_formats[] = {
+  {"hex", format_hex, NULL},
+  {"hex-lower", format_hex_lower, NULL},
+  {"hex-compact", format_hex_compact, NULL},
+  {"hex-compact-lower", format_hex_compact_lower, NULL},
+  {"words", format_words, NULL},
+  {"binary", format_binary, NULL},
+};
+
+void orthrus__format_init(orthrus_t *ort)
+{
+  apr_size_t i;
+
+  for (i = 0; i < sizeof(builtin_formats) / sizeof(builtin_formats[0]); i++) {
+    ort->formats[ort->nformats++] = &builtin_formats[i];
+  }
+}
+
+orthrus_error_t* orthrus_format_register(orthrus_t *ort,
+                                         const orthrus_format_t *format)
+{
+  apr_size_t i;
+
+  for (i = 0; i < ort->nformats; i++) {
+    if (strcmp(ort->formats[i]->name, format->name) == 0) {
+      ort->formats[i] = format;
+      return ORTHRUS_SUCCESS;
+    }
+  }
+
+  if (ort->nformats == ORT_MAX_FORMATS) {
+    return orthrus_error_createf(APR_ENOSPC, "Can't register format %s, "
+                                 "%d formats are already registered",
+                                 format->name, ORT_MAX_FORMATS);
+  }
+
+  ort->formats[ort->nformats++] = format;
+
+  return ORTHRUS_SUCCESS;
+}
+
+orthrus_error_t* orthrus_format_get(orthrus_t *ort,
+                                    const char *name,
+                                    const orthrus_format_t **format)
+{
+  apr_size_t i;
+
+  for (i = 0; i < ort->nformats; i++) {
+    if (strcmp(ort->formats[i]->name, name) == 0) {
+      *format = ort->formats[i];
+      return ORTHRUS_SUCCESS;
+    }
+  }
+
+  *format = NULL;
+
+  return orthrus_error_createf(APR_NOTFOUND, "No output format named %s",
+                               name);
+}
+
+orthrus_error_t* orthrus_format_write(const orthrus_format_t *format,
+                                      apr_uint64_t value,
+                                      char *buf,
+                                      apr_size_t *len)
+{
+  apr_size_t need = format->write(format->baton, value, buf,
+                                  buf ? *len : 0);
+
+  if (buf && need > *len) {
+    *len = need;
+    return orthrus_error_createf(APR_ENOSPC, "Format %s needs %"
+                                 APR_SIZE_T_FMT " bytes", format->name, need);
+  }
+
+  *len = need;
+
+  return ORTHRUS_SUCCESS;
+}
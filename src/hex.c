@@ -14,61 +14,100 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include "orthrus.h"
 #include "private/context.h"
-#include "apr_strings.h"
-#include <ctype.h>
 
-/* inverse of APR_UINT64_T_HEX_FMT */
-void orthrus__decode_hex(const char *input, apr_uint64_t *output) {
+/* Both directions are table driven, so the result never depends on the
+ * locale and there are no per character branches.
+ */
+
+#define HEX_ROW(h) \
+  {h, '0'}, {h, '1'}, {h, '2'}, {h, '3'}, {h, '4'}, {h, '5'}, {h, '6'}, \
+  {h, '7'}, {h, '8'}, {h, '9'}, {h, 'A'}, {h, 'B'}, {h, 'C'}, {h, 'D'}, \
+  {h, 'E'}, {h, 'F'}
+
+/* The two digits of every byte value. */
+static const char hex_pairs[256][2] = {
+  HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'),
+  HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+  HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('A'), HEX_ROW('B'),
+  HEX_ROW('C'), HEX_ROW('D'), HEX_ROW('E'), HEX_ROW('F')
+};
 
-  *output = 0;
-  const char *p = input;
+/* Digit value plus one, zero for anything that is not a hex digit. */
+static const unsigned char hex_values[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+  ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+/* inverse of APR_UINT64_T_HEX_FMT, anything but hex digits is skipped */
+void orthrus__decode_hex(const char *input, apr_uint64_t *output)
+{
+  orthrus__decode_hex_len(input, strlen(input), output);
+}
+
+/* The same for @a len bytes that need not be NUL terminated. */
+void orthrus__decode_hex_len(const char *input, apr_size_t len,
+                             apr_uint64_t *output)
+{
+  const unsigned char *p = (const unsigned char *)input;
+  const unsigned char *end = p + len;
   apr_uint64_t v = 0;
 
-  while (*p) {
-    char ch = *p;
-    if (ch >= '0' && ch <= '9') {
-      v = (v << 4) + (ch  - '0');
-    }
-    else if (ch >= 'A' && ch <= 'F') {
-      v = (v << 4) + (ch - 'A' + 10);
-    }
-    else if (ch >= 'a' && ch <= 'f') {
-      v = (v << 4) + (ch - 'a' + 10);
-    }
-    p++;
+  while (p < end) {
+    apr_uint32_t d = hex_values[*p++];
+    apr_uint64_t next = (v << 4) | (d - 1);
+
+    v = d ? next : v;
   }
 
   *output = v;
 }
 
-void orthrus__format_hex(orthrus_response_t *reply, apr_pool_t *pool)
+apr_size_t orthrus__hex_write_plain(apr_uint64_t value, char *out)
 {
   int i;
-  char *r = (char *)&reply->hex[0];
-  char s[(8 * 2) + 1];
-
-  apr_snprintf(s, sizeof s, "%" APR_UINT64_T_HEX_FMT, reply->reply);
 
-  for (i = 0; i < 16; ++i) {
-      if (islower(s[i]))
-          s[i] = toupper(s[i]);
+  for (i = 0; i < 8; i++) {
+    memcpy(out + 2 * i, hex_pairs[(value >> (56 - 8 * i)) & 0xff], 2);
   }
-  for (i = 0; i < 13; i += 4) {
-      *r++ = s[i];
-      *r++ = s[i+1];
-      *r++ = s[i+2];
-      *r++ = s[i+3];
-      *r++ = ' ';
-  }
-  r[-1] = 0;
+
+  return 16;
 }
 
-void orthrus_response_format_hex(orthrus_response_t *reply, const char **output)
+apr_size_t orthrus__hex_write(apr_uint64_t value, char *out)
 {
-  *output = reply->hex;
+  int i;
+
+  /* "XXXX XXXX XXXX XXXX" */
+  for (i = 0; i < 4; i++) {
+    apr_uint32_t group = (apr_uint32_t)(value >> (48 - 16 * i));
+
+    memcpy(out + 5 * i, hex_pairs[(group >> 8) & 0xff], 2);
+    memcpy(out + 5 * i + 2, hex_pairs[group & 0xff], 2);
+    if (i < 3) {
+      out[5 * i + 4] = ' ';
+    }
+  }
+
+  return ORT_HEX_LEN;
 }
 
+void orthrus__format_hex(orthrus_response_t *reply, apr_pool_t *pool)
+{
+  char *r = (char *)&reply->hex[0];
 
+  r[orthrus__hex_write(reply->reply, r)] = 0;
+}
 
+void orthrus_response_format_hex(orthrus_response_t *reply, const char **output)
+{
+  /* Formatted on first use, most callers only want one form or none. */
+  if (reply->hex[0] == '\0') {
+    orthrus__format_hex(reply, reply->pool);
+  }
+  *output = reply->hex;
+}
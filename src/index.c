@@ -0,0 +1,266 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "private/index.h"
+#include "apr_file_io.h"
+
+/* "ORTIDX01" read as a native word, so an index from a machine of the
+ * other byte order is simply stale. */
+#define INDEX_MAGIC APR_UINT64_C(0x313058444954524f)
+
+#define INDEX_OFFSET_BITS 40
+#define INDEX_OFFSET_MASK ((APR_UINT64_C(1) << INDEX_OFFSET_BITS) - 1)
+
+#define INDEX_MIN_SLOTS 64
+
+typedef struct index_header_t {
+  apr_uint64_t magic;
+  apr_uint64_t inode;
+  apr_uint64_t device;
+  apr_uint64_t size;
+  apr_uint64_t mtime;
+  apr_uint64_t nslots;
+  apr_uint64_t count;
+  apr_uint64_t reserved;
+} index_header_t;
+
+apr_uint64_t orthrus__index_hash(const char *name, apr_size_t len)
+{
+  const unsigned char *p = (const unsigned char *)name;
+  apr_uint64_t h = APR_UINT64_C(0xcbf29ce484222325);
+
+  while (len--) {
+    h ^= *p++;
+    h *= APR_UINT64_C(0x100000001b3);
+  }
+
+  return h;
+}
+
+apr_status_t orthrus__index_init(orthrus__index_t *idx,
+                                 orthrus__arena_t *arena,
+                                 apr_size_t hint)
+{
+  idx->slots = NULL;
+  idx->nslots = 0;
+  idx->count = 0;
+  idx->overflow = 0;
+  idx->capacity = hint > INDEX_MIN_SLOTS ? hint : INDEX_MIN_SLOTS;
+  idx->pending = orthrus__arena_alloc(arena, idx->capacity * 2 *
+                                             sizeof(apr_uint64_t));
+
+  return idx->pending ? APR_SUCCESS : APR_ENOMEM;
+}
+
+apr_status_t orthrus__index_add(orthrus__index_t *idx,
+                                orthrus__arena_t *arena,
+                                const char *name,
+                                apr_size_t len,
+                                apr_off_t offset)
+{
+  if ((apr_uint64_t)offset >= INDEX_OFFSET_MASK) {
+    idx->overflow = 1;
+    return APR_SUCCESS;
+  }
+
+  if (idx->count == idx->capacity) {
+    apr_uint64_t *pending = orthrus__arena_alloc(arena, idx->capacity * 4 *
+                                                        sizeof(apr_uint64_t));
+    if (pending == NULL) {
+      return APR_ENOMEM;
+    }
+    memcpy(pending, idx->pending, idx->count * 2 * sizeof(apr_uint64_t));
+    idx->pending = pending;
+    idx->capacity *= 2;
+  }
+
+  idx->pending[idx->count * 2] = orthrus__index_hash(name, len);
+  idx->pending[idx->count * 2 + 1] = (apr_uint64_t)offset + 1;
+  idx->count++;
+
+  return APR_SUCCESS;
+}
+
+apr_status_t orthrus__index_finish(orthrus__index_t *idx,
+                                   orthrus__arena_t *arena)
+{
+  apr_size_t i, nslots = INDEX_MIN_SLOTS;
+
+  /* At most half full, so probes stay short. */
+  while (nslots / 2 < idx->count) {
+    nslots *= 2;
+  }
+
+  idx->slots = orthrus__arena_calloc(arena, nslots * sizeof(apr_uint64_t));
+  if (idx->slots == NULL) {
+    return APR_ENOMEM;
+  }
+  idx->nslots = nslots;
+
+  for (i = 0; i < idx->count; i++) {
+    apr_uint64_t hash = idx->pending[i * 2];
+    apr_size_t pos = hash & (nslots - 1);
+
+    while (idx->slots[pos] != 0) {
+      pos = (pos + 1) & (nslots - 1);
+    }
+    idx->slots[pos] = (hash & ~INDEX_OFFSET_MASK) | idx->pending[i * 2 + 1];
+  }
+
+  return APR_SUCCESS;
+}
+
+void orthrus__index_find(const orthrus__index_t *idx,
+                         const char *name,
+                         apr_size_t len,
+                         orthrus__index_iter_t *it)
+{
+  apr_uint64_t hash = orthrus__index_hash(name, len);
+
+  it->tag = hash & ~INDEX_OFFSET_MASK;
+  it->pos = hash & (idx->nslots - 1);
+  it->left = idx->nslots;
+}
+
+int orthrus__index_next(const orthrus__index_t *idx,
+                        orthrus__index_iter_t *it,
+                        apr_off_t *offset)
+{
+  /* left only matters for a damaged index without an empty slot. */
+  while (it->left) {
+    apr_uint64_t slot = idx->slots[it->pos];
+
+    if (slot == 0) {
+      break;
+    }
+    it->pos = (it->pos + 1) & (idx->nslots - 1);
+    it->left--;
+    if ((slot & ~INDEX_OFFSET_MASK) == it->tag) {
+      *offset = (apr_off_t)(slot & INDEX_OFFSET_MASK) - 1;
+      return 1;
+    }
+  }
+
+  it->left = 0;
+  return 0;
+}
+
+static void index_stamp(index_header_t *h, const apr_finfo_t *dbinfo)
+{
+  memset(h, 0, sizeof(*h));
+  h->magic = INDEX_MAGIC;
+  h->inode = (apr_uint64_t)dbinfo->inode;
+  h->device = (apr_uint64_t)dbinfo->device;
+  h->size = (apr_uint64_t)dbinfo->size;
+  h->mtime = (apr_uint64_t)dbinfo->mtime;
+}
+
+apr_status_t orthrus__index_save(const orthrus__index_t *idx,
+                                 const char *path,
+                                 const char *tmppath,
+                                 const apr_finfo_t *dbinfo,
+                                 apr_pool_t *pool)
+{
+  index_header_t h;
+  apr_file_t *file;
+  apr_size_t wsize;
+  apr_status_t rv;
+
+  if (idx->overflow || idx->slots == NULL) {
+    return APR_EGENERAL;
+  }
+
+  index_stamp(&h, dbinfo);
+  h.nslots = idx->nslots;
+  h.count = idx->count;
+
+  rv = apr_file_open(&file, tmppath,
+                     APR_WRITE|APR_CREATE|APR_TRUNCATE|APR_BINARY,
+                     APR_UREAD|APR_UWRITE, pool);
+  if (rv) {
+    return rv;
+  }
+
+  rv = apr_file_write_full(file, &h, sizeof(h), &wsize);
+  if (!rv) {
+    rv = apr_file_write_full(file, idx->slots,
+                             idx->nslots * sizeof(apr_uint64_t), &wsize);
+  }
+  apr_file_close(file);
+
+  if (!rv) {
+    rv = apr_file_rename(tmppath, path, pool);
+  }
+  if (rv) {
+    apr_file_remove(tmppath, pool);
+  }
+
+  return rv;
+}
+
+apr_status_t orthrus__index_load(orthrus__index_t *idx,
+                                 const char *path,
+                                 const apr_finfo_t *dbinfo,
+                                 apr_pool_t *pool)
+{
+  index_header_t want;
+  const index_header_t *h;
+  apr_file_t *file;
+  apr_finfo_t finfo;
+  apr_mmap_t *map;
+  apr_status_t rv;
+
+  idx->slots = NULL;
+
+  rv = apr_file_open(&file, path, APR_READ|APR_BINARY, APR_OS_DEFAULT, pool);
+  if (rv) {
+    return rv;
+  }
+
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+  if (!rv && finfo.size < (apr_off_t)sizeof(*h)) {
+    rv = APR_EGENERAL;
+  }
+  if (!rv) {
+    rv = apr_mmap_create(&map, file, 0, (apr_size_t)finfo.size,
+                         APR_MMAP_READ, pool);
+  }
+  apr_file_close(file);
+  if (rv) {
+    return rv;
+  }
+
+  h = map->mm;
+  index_stamp(&want, dbinfo);
+  if (memcmp(&want, h, offsetof(index_header_t, nslots)) != 0 ||
+      h->nslots < INDEX_MIN_SLOTS || (h->nslots & (h->nslots - 1)) != 0 ||
+      h->count > h->nslots / 2 ||
+      (apr_uint64_t)finfo.size != sizeof(*h) + h->nslots * sizeof(apr_uint64_t)) {
+    apr_mmap_delete(map);
+    return APR_EGENERAL;
+  }
+
+  idx->slots = (apr_uint64_t *)(h + 1);
+  idx->nslots = (apr_size_t)h->nslots;
+  idx->count = (apr_size_t)h->count;
+  idx->pending = NULL;
+  idx->capacity = 0;
+  idx->overflow = 0;
+
+  return APR_SUCCESS;
+}
@@ -18,13 +18,100 @@
 #include "private/context.h"
 #include "apr_md4.h"
 
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define MD4_STEP(f, a, b, c, d, x, t, s) do { \
+    (a) += f((b), (c), (d)) + (x) + (t);      \
+    (a) = ORT_ROL32((a), (s));                \
+} while (0)
+
+#define MD4_A0 0x67452301
+#define MD4_B0 0xefcdab89
+#define MD4_C0 0x98badcfe
+#define MD4_D0 0x10325476
+
+/* One MD4 compression of the 8 byte chain value, carried as the little
+ * endian 64 bit load of the OTP bytes.  Only message words 0, 1, 2 (the
+ * 0x80 terminator) and 14 (the bit length) are non-zero.
+ */
+static APR_INLINE apr_uint64_t md4_chain_step(apr_uint64_t x)
+{
+  const apr_uint32_t x0 = (apr_uint32_t)x, x1 = (apr_uint32_t)(x >> 32);
+  const apr_uint32_t x2 = 0x80, x14 = 64;
+  apr_uint32_t a = MD4_A0, b = MD4_B0, c = MD4_C0, d = MD4_D0;
+
+  MD4_STEP(MD4_F, a, b, c, d, x0, 0, 3);
+  MD4_STEP(MD4_F, d, a, b, c, x1, 0, 7);
+  MD4_STEP(MD4_F, c, d, a, b, x2, 0, 11);
+  MD4_STEP(MD4_F, b, c, d, a, 0, 0, 19);
+  MD4_STEP(MD4_F, a, b, c, d, 0, 0, 3);
+  MD4_STEP(MD4_F, d, a, b, c, 0, 0, 7);
+  MD4_STEP(MD4_F, c, d, a, b, 0, 0, 11);
+  MD4_STEP(MD4_F, b, c, d, a, 0, 0, 19);
+  MD4_STEP(MD4_F, a, b, c, d, 0, 0, 3);
+  MD4_STEP(MD4_F, d, a, b, c, 0, 0, 7);
+  MD4_STEP(MD4_F, c, d, a, b, 0, 0, 11);
+  MD4_STEP(MD4_F, b, c, d, a, 0, 0, 19);
+  MD4_STEP(MD4_F, a, b, c, d, 0, 0, 3);
+  MD4_STEP(MD4_F, d, a, b, c, 0, 0, 7);
+  MD4_STEP(MD4_F, c, d, a, b, x14, 0, 11);
+  MD4_STEP(MD4_F, b, c, d, a, 0, 0, 19);
+
+  MD4_STEP(MD4_G, a, b, c, d, x0, 0x5a827999, 3);
+  MD4_STEP(MD4_G, d, a, b, c, 0, 0x5a827999, 5);
+  MD4_STEP(MD4_G, c, d, a, b, 0, 0x5a827999, 9);
+  MD4_STEP(MD4_G, b, c, d, a, 0, 0x5a827999, 13);
+  MD4_STEP(MD4_G, a, b, c, d, x1, 0x5a827999, 3);
+  MD4_STEP(MD4_G, d, a, b, c, 0, 0x5a827999, 5);
+  MD4_STEP(MD4_G, c, d, a, b, 0, 0x5a827999, 9);
+  MD4_STEP(MD4_G, b, c, d, a, 0, 0x5a827999, 13);
+  MD4_STEP(MD4_G, a, b, c, d, x2, 0x5a827999, 3);
+  MD4_STEP(MD4_G, d, a, b, c, 0, 0x5a827999, 5);
+  MD4_STEP(MD4_G, c, d, a, b, 0, 0x5a827999, 9);
+  MD4_STEP(MD4_G, b, c, d, a, x14, 0x5a827999, 13);
+  MD4_STEP(MD4_G, a, b, c, d, 0, 0x5a827999, 3);
+  MD4_STEP(MD4_G, d, a, b, c, 0, 0x5a827999, 5);
+  MD4_STEP(MD4_G, c, d, a, b, 0, 0x5a827999, 9);
+  MD4_STEP(MD4_G, b, c, d, a, 0, 0x5a827999, 13);
+
+  MD4_STEP(MD4_H, a, b, c, d, x0, 0x6ed9eba1, 3);
+  MD4_STEP(MD4_H, d, a, b, c, 0, 0x6ed9eba1, 9);
+  MD4_STEP(MD4_H, c, d, a, b, 0, 0x6ed9eba1, 11);
+  MD4_STEP(MD4_H, b, c, d, a, 0, 0x6ed9eba1, 15);
+  MD4_STEP(MD4_H, a, b, c, d, x2, 0x6ed9eba1, 3);
+  MD4_STEP(MD4_H, d, a, b, c, 0, 0x6ed9eba1, 9);
+  MD4_STEP(MD4_H, c, d, a, b, 0, 0x6ed9eba1, 11);
+  MD4_STEP(MD4_H, b, c, d, a, x14, 0x6ed9eba1, 15);
+  MD4_STEP(MD4_H, a, b, c, d, x1, 0x6ed9eba1, 3);
+  MD4_STEP(MD4_H, d, a, b, c, 0, 0x6ed9eba1, 9);
+  MD4_STEP(MD4_H, c, d, a, b, 0, 0x6ed9eba1, 11);
+  MD4_STEP(MD4_H, b, c, d, a, 0, 0x6ed9eba1, 15);
+  MD4_STEP(MD4_H, a, b, c, d, 0, 0x6ed9eba1, 3);
+  MD4_STEP(MD4_H, d, a, b, c, 0, 0x6ed9eba1, 9);
+  MD4_STEP(MD4_H, c, d, a, b, 0, 0x6ed9eba1, 11);
+  MD4_STEP(MD4_H, b, c, d, a, 0, 0x6ed9eba1, 15);
+
+  /* Fold the 128 bit digest to 64 bits as two little endian words. */
+  return (((apr_uint64_t)(b + MD4_B0) << 32) | (a + MD4_A0)) ^
+         (((apr_uint64_t)(d + MD4_D0) << 32) | (c + MD4_C0));
+}
+
+static APR_INLINE apr_uint64_t load_le64(const unsigned char *p)
+{
+  return ((apr_uint64_t)p[0]) | ((apr_uint64_t)p[1] << 8) |
+         ((apr_uint64_t)p[2] << 16) | ((apr_uint64_t)p[3] << 24) |
+         ((apr_uint64_t)p[4] << 32) | ((apr_uint64_t)p[5] << 40) |
+         ((apr_uint64_t)p[6] << 48) | ((apr_uint64_t)p[7] << 56);
+}
+
 orthrus_error_t* orthrus__alg_md4_fold(const char *seed,
                                        apr_size_t slen,
                                        const char *pw,
                                        apr_size_t pwlen,
                                        orthrus_response_t *reply)
 {
-  int j;
   unsigned char digest[APR_MD4_DIGESTSIZE];
   apr_md4_ctx_t md4;
 
@@ -34,22 +121,8 @@ orthrus_error_t* orthrus__alg_md4_fold(const char *seed,
   apr_md4_update(&md4, (unsigned char*)pw, pwlen);
 
   apr_md4_final(digest, &md4);
-  
-  for (j = 0; j < 8; j++) {
-    digest[j] ^= digest[j+8];
-  }
 
-
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (j=0; j<4; ++j) {
-        char tmp   = digest[j];
-        digest[j]  = digest[7-j];
-        digest[7-j]= tmp;
-    }
-#endif
-
-  memcpy(&reply->reply, &digest[0], 8);
+  reply->reply = ORT_BSWAP64(load_le64(digest) ^ load_le64(digest + 8));
 
   return ORTHRUS_SUCCESS;
 }
@@ -57,40 +130,18 @@ orthrus_error_t* orthrus__alg_md4_fold(const char *seed,
 orthrus_error_t* orthrus__alg_md4_cycle(apr_uint64_t sequence, 
                                         orthrus_response_t *reply)
 {
-  int i,j;
-  unsigned char digest[APR_MD4_DIGESTSIZE];
-  apr_md4_ctx_t md4;
-
-  memcpy(&digest[0], &reply->reply, 8);
-
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (j=0; j<4; ++j) {
-        char tmp   = digest[j];
-        digest[j]  = digest[7-j];
-        digest[7-j]= tmp;
-    }
-#endif
+  apr_uint64_t i;
+  apr_uint64_t x = ORT_BSWAP64(reply->reply);
 
   for (i = 0; i < sequence; i++) {
-    apr_md4_init(&md4);
-    apr_md4_update(&md4, &digest[0], 8);
-    apr_md4_final(digest, &md4);
-    for (j = 0; j < 8; j++) {
-      digest[j] ^= digest[j+8];
-    }
+    x = md4_chain_step(x);
   }
 
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (j=0; j<4; ++j) {
-        char tmp   = digest[j];
-        digest[j]  = digest[7-j];
-        digest[7-j]= tmp;
-    }
-#endif
-
-  memcpy(&reply->reply, &digest[0], 8);
+  reply->reply = ORT_BSWAP64(x);
 
   return ORTHRUS_SUCCESS;
 }
+
+const orthrus__kernel_t orthrus__md4_portable = {
+  "portable", orthrus__alg_md4_fold, orthrus__alg_md4_cycle
+};
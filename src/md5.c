@@ -18,13 +18,119 @@
 #include "private/context.h"
 #include "apr_md5.h"
 
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s) do { \
+    (a) += f((b), (c), (d)) + (x) + (t);      \
+    (a) = ORT_ROL32((a), (s)) + (b);          \
+} while (0)
+
+#define MD5_A0 0x67452301
+#define MD5_B0 0xefcdab89
+#define MD5_C0 0x98badcfe
+#define MD5_D0 0x10325476
+
+/* One MD5 compression of the 8 byte chain value.  The chain value is kept
+ * as the little endian 64 bit load of the OTP bytes, which is exactly the
+ * first two message words; the remainder of the block is the constant
+ * padding for a 64 bit message (0x80 terminator, length 64 in word 14).
+ */
+static APR_INLINE apr_uint64_t md5_chain_step(apr_uint64_t x)
+{
+  const apr_uint32_t x0 = (apr_uint32_t)x, x1 = (apr_uint32_t)(x >> 32);
+  const apr_uint32_t x2 = 0x80, x14 = 64;
+  apr_uint32_t a = MD5_A0, b = MD5_B0, c = MD5_C0, d = MD5_D0;
+
+  MD5_STEP(MD5_F, a, b, c, d, x0, 0xd76aa478, 7);
+  MD5_STEP(MD5_F, d, a, b, c, x1, 0xe8c7b756, 12);
+  MD5_STEP(MD5_F, c, d, a, b, x2, 0x242070db, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0xc1bdceee, 22);
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0xf57c0faf, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 0, 0x4787c62a, 12);
+  MD5_STEP(MD5_F, c, d, a, b, 0, 0xa8304613, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0xfd469501, 22);
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0x698098d8, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 0, 0x8b44f7af, 12);
+  MD5_STEP(MD5_F, c, d, a, b, 0, 0xffff5bb1, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0x895cd7be, 22);
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0x6b901122, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 0, 0xfd987193, 12);
+  MD5_STEP(MD5_F, c, d, a, b, x14, 0xa679438e, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0x49b40821, 22);
+
+  MD5_STEP(MD5_G, a, b, c, d, x1, 0xf61e2562, 5);
+  MD5_STEP(MD5_G, d, a, b, c, 0, 0xc040b340, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0x265e5a51, 14);
+  MD5_STEP(MD5_G, b, c, d, a, x0, 0xe9b6c7aa, 20);
+  MD5_STEP(MD5_G, a, b, c, d, 0, 0xd62f105d, 5);
+  MD5_STEP(MD5_G, d, a, b, c, 0, 0x02441453, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0xd8a1e681, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0xe7d3fbc8, 20);
+  MD5_STEP(MD5_G, a, b, c, d, 0, 0x21e1cde6, 5);
+  MD5_STEP(MD5_G, d, a, b, c, x14, 0xc33707d6, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0xf4d50d87, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0x455a14ed, 20);
+  MD5_STEP(MD5_G, a, b, c, d, 0, 0xa9e3e905, 5);
+  MD5_STEP(MD5_G, d, a, b, c, x2, 0xfcefa3f8, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0x676f02d9, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0x8d2a4c8a, 20);
+
+  MD5_STEP(MD5_H, a, b, c, d, 0, 0xfffa3942, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0x8771f681, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0x6d9d6122, 16);
+  MD5_STEP(MD5_H, b, c, d, a, x14, 0xfde5380c, 23);
+  MD5_STEP(MD5_H, a, b, c, d, x1, 0xa4beea44, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0x4bdecfa9, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0xf6bb4b60, 16);
+  MD5_STEP(MD5_H, b, c, d, a, 0, 0xbebfbc70, 23);
+  MD5_STEP(MD5_H, a, b, c, d, 0, 0x289b7ec6, 4);
+  MD5_STEP(MD5_H, d, a, b, c, x0, 0xeaa127fa, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0xd4ef3085, 16);
+  MD5_STEP(MD5_H, b, c, d, a, 0, 0x04881d05, 23);
+  MD5_STEP(MD5_H, a, b, c, d, 0, 0xd9d4d039, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0xe6db99e5, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0x1fa27cf8, 16);
+  MD5_STEP(MD5_H, b, c, d, a, x2, 0xc4ac5665, 23);
+
+  MD5_STEP(MD5_I, a, b, c, d, x0, 0xf4292244, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0x432aff97, 10);
+  MD5_STEP(MD5_I, c, d, a, b, x14, 0xab9423a7, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 0, 0xfc93a039, 21);
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0x655b59c3, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0x8f0ccc92, 10);
+  MD5_STEP(MD5_I, c, d, a, b, 0, 0xffeff47d, 15);
+  MD5_STEP(MD5_I, b, c, d, a, x1, 0x85845dd1, 21);
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0x6fa87e4f, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0xfe2ce6e0, 10);
+  MD5_STEP(MD5_I, c, d, a, b, 0, 0xa3014314, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 0, 0x4e0811a1, 21);
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0xf7537e82, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0xbd3af235, 10);
+  MD5_STEP(MD5_I, c, d, a, b, x2, 0x2ad7d2bb, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 0, 0xeb86d391, 21);
+
+  /* Fold the 128 bit digest to 64 bits as two little endian words. */
+  return (((apr_uint64_t)(b + MD5_B0) << 32) | (a + MD5_A0)) ^
+         (((apr_uint64_t)(d + MD5_D0) << 32) | (c + MD5_C0));
+}
+
+static APR_INLINE apr_uint64_t load_le64(const unsigned char *p)
+{
+  return ((apr_uint64_t)p[0]) | ((apr_uint64_t)p[1] << 8) |
+         ((apr_uint64_t)p[2] << 16) | ((apr_uint64_t)p[3] << 24) |
+         ((apr_uint64_t)p[4] << 32) | ((apr_uint64_t)p[5] << 40) |
+         ((apr_uint64_t)p[6] << 48) | ((apr_uint64_t)p[7] << 56);
+}
+
 orthrus_error_t* orthrus__alg_md5_fold(const char *seed,
                                        apr_size_t slen,
                                        const char *pw,
                                        apr_size_t pwlen,
                                        orthrus_response_t *reply)
 {
-  int j;
   unsigned char digest[APR_MD5_DIGESTSIZE];
   apr_md5_ctx_t md5;
 
@@ -34,21 +140,8 @@ orthrus_error_t* orthrus__alg_md5_fold(const char *seed,
   apr_md5_update(&md5, pw, pwlen);
 
   apr_md5_final(digest, &md5);
-  
-  for (j = 0; j < 8; j++) {
-    digest[j] ^= digest[j+8];
-  }
-
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (j=0; j<4; ++j) {
-        char tmp   = digest[j];
-        digest[j]  = digest[7-j];
-        digest[7-j]= tmp;
-    }
-#endif
 
-  memcpy(&reply->reply, &digest[0], 8);
+  reply->reply = ORT_BSWAP64(load_le64(digest) ^ load_le64(digest + 8));
 
   return ORTHRUS_SUCCESS;
 }
@@ -56,40 +149,18 @@ orthrus_error_t* orthrus__alg_md5_fold(const char *seed,
 orthrus_error_t* orthrus__alg_md5_cycle(apr_uint64_t sequence, 
                                         orthrus_response_t *reply)
 {
-  int i,j;
-  unsigned char digest[APR_MD5_DIGESTSIZE];
-  apr_md5_ctx_t md5;
-
-  memcpy(&digest[0], &reply->reply, 8);
-
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (j=0; j<4; ++j) {
-        char tmp   = digest[j];
-        digest[j]  = digest[7-j];
-        digest[7-j]= tmp;
-    }
-#endif
+  apr_uint64_t i;
+  apr_uint64_t x = ORT_BSWAP64(reply->reply);
 
   for (i = 0; i < sequence; i++) {
-    apr_md5_init(&md5);
-    apr_md5_update(&md5, &digest[0], 8);
-    apr_md5_final(digest, &md5);
-    for (j = 0; j < 8; j++) {
-      digest[j] ^= digest[j+8];
-    }
+    x = md5_chain_step(x);
   }
 
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (j=0; j<4; ++j) {
-        char tmp   = digest[j];
-        digest[j]  = digest[7-j];
-        digest[7-j]= tmp;
-    }
-#endif
-
-  memcpy(&reply->reply, &digest[0], 8);
+  reply->reply = ORT_BSWAP64(x);
 
   return ORTHRUS_SUCCESS;
 }
+
+const orthrus__kernel_t orthrus__md5_portable = {
+  "portable", orthrus__alg_md5_fold, orthrus__alg_md5_cycle
+};
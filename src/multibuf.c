@@ -0,0 +1,372 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "orthrus.h"
+#include "private/context.h"
+
+/* Multi-buffer chain engines.
+ *
+ * A single hash chain is strictly sequential, but independent chains can
+ * share SIMD registers: lane i of every vector belongs to chain i.  The
+ * scheduler below keeps every lane busy by handing a lane the next pending
+ * chain as soon as its current one completes.
+ */
+
+void orthrus__mb_chain(const orthrus__mb_engine_t *engine,
+                       apr_uint64_t *values,
+                       const apr_uint64_t *steps,
+                       apr_size_t count)
+{
+  apr_uint64_t lane_value[ORT_MB_MAX_LANES];
+  apr_uint64_t lane_left[ORT_MB_MAX_LANES];
+  apr_size_t lane_job[ORT_MB_MAX_LANES];
+  apr_size_t lanes = engine->lanes;
+  apr_size_t next = 0;
+  apr_size_t i;
+
+  for (i = 0; i < lanes; i++) {
+    lane_value[i] = 0;
+    lane_left[i] = 0;
+  }
+
+  for (;;) {
+    apr_uint64_t run = 0;
+
+    /* Refill idle lanes; chains with nothing to do are already final. */
+    for (i = 0; i < lanes; i++) {
+      while (lane_left[i] == 0 && next < count) {
+        if (steps[next] != 0) {
+          lane_job[i] = next;
+          lane_value[i] = values[next];
+          lane_left[i] = steps[next];
+        }
+        next++;
+      }
+      if (lane_left[i] != 0 && (run == 0 || lane_left[i] < run)) {
+        run = lane_left[i];
+      }
+    }
+
+    if (run == 0) {
+      break;
+    }
+
+    /* Lanes without a chain still compute, their results are masked off
+     * here by never being written back. */
+    engine->chain(lane_value, run);
+
+    for (i = 0; i < lanes; i++) {
+      if (lane_left[i] == 0) {
+        continue;
+      }
+      lane_left[i] -= run;
+      if (lane_left[i] == 0) {
+        values[lane_job[i]] = lane_value[i];
+      }
+    }
+  }
+}
+
+#ifdef ORT_HAVE_X86_KERNELS
+
+typedef apr_uint32_t mb_v4u32 __attribute__((vector_size(16)));
+typedef apr_uint32_t mb_v8u32 __attribute__((vector_size(32)));
+typedef apr_uint32_t mb_v16u32 __attribute__((vector_size(64)));
+
+#define MB_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define MB_BSWAP(x) (((x) << 24) | (((x) << 8) & 0xff0000) | \
+                     (((x) >> 8) & 0xff00) | ((x) >> 24))
+
+#define MB_SHA1_ROUND(f, k, wt) do {                 \
+    tmp = MB_ROL(a, 5) + (f) + e + (k) + (wt);      \
+    e = d;                                           \
+    d = c;                                           \
+    c = MB_ROL(b, 30);                               \
+    b = a;                                           \
+    a = tmp;                                         \
+} while (0)
+
+#define MB_SHA1_W(t) (w[(t) & 15] = MB_ROL(w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^ \
+                                           w[((t) - 14) & 15] ^ w[(t) & 15], 1))
+
+/* Defines fn(values, steps), running the RFC 2289 SHA-1 chain step on
+ * every lane of vector type V.  The layout of a chain value matches the
+ * portable kernel in sha1.c: the two big endian message words of the next
+ * block, with the rest of the block being constant padding.
+ */
+#define MB_SHA1_CHAIN(fn, V, lanes, isa)                                     \
+static ORT_TARGET(isa) void fn(apr_uint64_t *values, apr_uint64_t steps)     \
+{                                                                            \
+  V m0, m1, w[16], a, b, c, d, e, tmp;                                       \
+  apr_uint64_t j;                                                            \
+  int i, t;                                                                  \
+                                                                             \
+  for (i = 0; i < lanes; i++) {                                              \
+    m0[i] = (apr_uint32_t)(values[i] >> 32);                                 \
+    m1[i] = (apr_uint32_t)values[i];                                         \
+  }                                                                          \
+                                                                             \
+  for (j = 0; j < steps; j++) {                                              \
+    w[0] = m0;                                                               \
+    w[1] = m1;                                                               \
+    w[2] = (V){0} + 0x80000000;                                              \
+    for (t = 3; t < 15; t++) {                                               \
+      w[t] = (V){0};                                                         \
+    }                                                                        \
+    w[15] = (V){0} + 64;                                                     \
+                                                                             \
+    a = (V){0} + 0x67452301;                                                 \
+    b = (V){0} + 0xefcdab89;                                                 \
+    c = (V){0} + 0x98badcfe;                                                 \
+    d = (V){0} + 0x10325476;                                                 \
+    e = (V){0} + 0xc3d2e1f0;                                                 \
+                                                                             \
+    for (t = 0; t < 16; t++) {                                               \
+      MB_SHA1_ROUND(d ^ (b & (c ^ d)), 0x5a827999, w[t]);                    \
+    }                                                                        \
+    for (; t < 20; t++) {                                                    \
+      MB_SHA1_ROUND(d ^ (b & (c ^ d)), 0x5a827999, MB_SHA1_W(t));            \
+    }                                                                        \
+    for (; t < 40; t++) {                                                    \
+      MB_SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1, MB_SHA1_W(t));                    \
+    }                                                                        \
+    for (; t < 60; t++) {                                                    \
+      MB_SHA1_ROUND((b & c) | (d & (b | c)), 0x8f1bbcdc, MB_SHA1_W(t));      \
+    }                                                                        \
+    for (; t < 80; t++) {                                                    \
+      MB_SHA1_ROUND(b ^ c ^ d, 0xca62c1d6, MB_SHA1_W(t));                    \
+    }                                                                        \
+                                                                             \
+    a += 0x67452301;                                                         \
+    b += 0xefcdab89;                                                         \
+    c += 0x98badcfe;                                                         \
+    d += 0x10325476;                                                         \
+    e += 0xc3d2e1f0;                                                         \
+    m0 = a ^ c ^ e;                                                          \
+    m1 = b ^ d;                                                              \
+    m0 = MB_BSWAP(m0);                                                       \
+    m1 = MB_BSWAP(m1);                                                       \
+  }                                                                          \
+                                                                             \
+  for (i = 0; i < lanes; i++) {                                              \
+    values[i] = ((apr_uint64_t)m0[i] << 32) | m1[i];                         \
+  }                                                                          \
+}
+
+/* MD5 and MD4 chain values are carried, as in md5.c and md4.c, as the
+ * little endian load of the OTP bytes: message words 0 and 1 of the next
+ * block.  Word 2 holds the 0x80 terminator and word 14 the bit length.
+ */
+static const apr_uint32_t md5_t[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+  0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+  0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+  0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+  0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+  0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_k[64] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+  5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+  0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+};
+
+static const unsigned char md5_s[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const unsigned char md4_k[48] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+  0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15
+};
+
+static const unsigned char md4_s[48] = {
+  3, 7, 11, 19, 3, 7, 11, 19, 3, 7, 11, 19, 3, 7, 11, 19,
+  3, 5, 9, 13, 3, 5, 9, 13, 3, 5, 9, 13, 3, 5, 9, 13,
+  3, 9, 11, 15, 3, 9, 11, 15, 3, 9, 11, 15, 3, 9, 11, 15
+};
+
+#define MB_ROLV(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* Shared by the MD4 and MD5 engines: loads the chain values into the two
+ * message word vectors and stores them back after the steps. */
+#define MB_MD_LOAD(V, lanes)                                                 \
+  for (i = 0; i < lanes; i++) {                                              \
+    apr_uint64_t x = ORT_BSWAP64(values[i]);                                 \
+    m0[i] = (apr_uint32_t)x;                                                 \
+    m1[i] = (apr_uint32_t)(x >> 32);                                         \
+  }                                                                          \
+  for (t = 0; t < 16; t++) {                                                 \
+    x[t] = (V){0};                                                           \
+  }                                                                          \
+  x[2] += 0x80;                                                              \
+  x[14] += 64
+
+#define MB_MD_STORE(lanes)                                                   \
+  for (i = 0; i < lanes; i++) {                                              \
+    values[i] = ORT_BSWAP64(((apr_uint64_t)m1[i] << 32) | m0[i]);            \
+  }
+
+#define MB_MD5_STEP(f) do {                                                  \
+    tmp = a + (f) + x[md5_k[t]] + md5_t[t];                                  \
+    a = d;                                                                   \
+    d = c;                                                                   \
+    c = b;                                                                   \
+    b = b + MB_ROLV(tmp, md5_s[t]);                                          \
+} while (0)
+
+#define MB_MD5_CHAIN(fn, V, lanes, isa)                                      \
+static ORT_TARGET(isa) void fn(apr_uint64_t *values, apr_uint64_t steps)     \
+{                                                                            \
+  V m0, m1, x[16], a, b, c, d, tmp;                                          \
+  apr_uint64_t j;                                                            \
+  int i, t;                                                                  \
+                                                                             \
+  MB_MD_LOAD(V, lanes);                                                      \
+                                                                             \
+  for (j = 0; j < steps; j++) {                                              \
+    x[0] = m0;                                                               \
+    x[1] = m1;                                                               \
+    a = (V){0} + 0x67452301;                                                 \
+    b = (V){0} + 0xefcdab89;                                                 \
+    c = (V){0} + 0x98badcfe;                                                 \
+    d = (V){0} + 0x10325476;                                                 \
+                                                                             \
+    for (t = 0; t < 16; t++) {                                               \
+      MB_MD5_STEP(d ^ (b & (c ^ d)));                                        \
+    }                                                                        \
+    for (; t < 32; t++) {                                                    \
+      MB_MD5_STEP(c ^ (d & (b ^ c)));                                        \
+    }                                                                        \
+    for (; t < 48; t++) {                                                    \
+      MB_MD5_STEP(b ^ c ^ d);                                                \
+    }                                                                        \
+    for (; t < 64; t++) {                                                    \
+      MB_MD5_STEP(c ^ (b | ~d));                                             \
+    }                                                                        \
+                                                                             \
+    m0 = (a + 0x67452301) ^ (c + 0x98badcfe);                                \
+    m1 = (b + 0xefcdab89) ^ (d + 0x10325476);                                \
+  }                                                                          \
+                                                                             \
+  MB_MD_STORE(lanes);                                                        \
+}
+
+#define MB_MD4_STEP(f, k) do {                                               \
+    tmp = a + (f) + x[md4_k[t]] + (k);                                       \
+    a = d;                                                                   \
+    d = c;                                                                   \
+    c = b;                                                                   \
+    b = MB_ROLV(tmp, md4_s[t]);                                              \
+} while (0)
+
+#define MB_MD4_CHAIN(fn, V, lanes, isa)                                      \
+static ORT_TARGET(isa) void fn(apr_uint64_t *values, apr_uint64_t steps)     \
+{                                                                            \
+  V m0, m1, x[16], a, b, c, d, tmp;                                          \
+  apr_uint64_t j;                                                            \
+  int i, t;                                                                  \
+                                                                             \
+  MB_MD_LOAD(V, lanes);                                                      \
+                                                                             \
+  for (j = 0; j < steps; j++) {                                              \
+    x[0] = m0;                                                               \
+    x[1] = m1;                                                               \
+    a = (V){0} + 0x67452301;                                                 \
+    b = (V){0} + 0xefcdab89;                                                 \
+    c = (V){0} + 0x98badcfe;                                                 \
+    d = (V){0} + 0x10325476;                                                 \
+                                                                             \
+    for (t = 0; t < 16; t++) {                                               \
+      MB_MD4_STEP(d ^ (b & (c ^ d)), 0);                                     \
+    }                                                                        \
+    for (; t < 32; t++) {                                                    \
+      MB_MD4_STEP((b & c) | (d & (b | c)), 0x5a827999);                      \
+    }                                                                        \
+    for (; t < 48; t++) {                                                    \
+      MB_MD4_STEP(b ^ c ^ d, 0x6ed9eba1);                                    \
+    }                                                                        \
+                                                                             \
+    m0 = (a + 0x67452301) ^ (c + 0x98badcfe);                                \
+    m1 = (b + 0xefcdab89) ^ (d + 0x10325476);                                \
+  }                                                                          \
+                                                                             \
+  MB_MD_STORE(lanes);                                                        \
+}
+
+MB_SHA1_CHAIN(sha1_chain_sse2, mb_v4u32, 4, "sse2")
+MB_SHA1_CHAIN(sha1_chain_avx2, mb_v8u32, 8, "avx2")
+MB_SHA1_CHAIN(sha1_chain_avx512, mb_v16u32, 16, "avx512f")
+MB_MD5_CHAIN(md5_chain_sse2, mb_v4u32, 4, "sse2")
+MB_MD5_CHAIN(md5_chain_avx2, mb_v8u32, 8, "avx2")
+MB_MD5_CHAIN(md5_chain_avx512, mb_v16u32, 16, "avx512f")
+MB_MD4_CHAIN(md4_chain_sse2, mb_v4u32, 4, "sse2")
+MB_MD4_CHAIN(md4_chain_avx2, mb_v8u32, 8, "avx2")
+MB_MD4_CHAIN(md4_chain_avx512, mb_v16u32, 16, "avx512f")
+
+const orthrus__mb_engine_t orthrus__sha1_mb_sse2 = {
+  "sse2", 4, sha1_chain_sse2
+};
+
+const orthrus__mb_engine_t orthrus__sha1_mb_avx2 = {
+  "avx2", 8, sha1_chain_avx2
+};
+
+const orthrus__mb_engine_t orthrus__sha1_mb_avx512 = {
+  "avx512", 16, sha1_chain_avx512
+};
+
+const orthrus__mb_engine_t orthrus__md5_mb_sse2 = {
+  "sse2", 4, md5_chain_sse2
+};
+
+const orthrus__mb_engine_t orthrus__md5_mb_avx2 = {
+  "avx2", 8, md5_chain_avx2
+};
+
+const orthrus__mb_engine_t orthrus__md5_mb_avx512 = {
+  "avx512", 16, md5_chain_avx512
+};
+
+const orthrus__mb_engine_t orthrus__md4_mb_sse2 = {
+  "sse2", 4, md4_chain_sse2
+};
+
+const orthrus__mb_engine_t orthrus__md4_mb_avx2 = {
+  "avx2", 8, md4_chain_avx2
+};
+
+const orthrus__mb_engine_t orthrus__md4_mb_avx512 = {
+  "avx512", 16, md4_chain_avx512
+};
+
+#endif
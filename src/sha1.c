@@ -14,50 +14,110 @@
  * limitations under the License.
  */
 
-#include <stdio.h>
+#include <string.h>
 #include "orthrus.h"
 #include "private/context.h"
 #include "apr_sha1.h"
 
+/* The RFC 2289 chain input is always the previous 8 byte OTP, so every
+ * step hashes exactly one block: two message words, the 0x80 terminator and
+ * a bit length of 64.  Words 2..15 never change.
+ */
+static const apr_uint32_t sha1_chain_pad[16] = {
+  0, 0, 0x80000000, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 64
+};
+
+#define SHA1_H0 0x67452301
+#define SHA1_H1 0xefcdab89
+#define SHA1_H2 0x98badcfe
+#define SHA1_H3 0x10325476
+#define SHA1_H4 0xc3d2e1f0
+
+#define SHA1_W(t) (w[(t) & 15] = ORT_ROL32(w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^ \
+                                           w[((t) - 14) & 15] ^ w[(t) & 15], 1))
+
+#define SHA1_ROUND(f, k, wt) do {                                 \
+    apr_uint32_t tmp = ORT_ROL32(a, 5) + (f) + e + (k) + (wt);   \
+    e = d;                                                        \
+    d = c;                                                        \
+    c = ORT_ROL32(b, 30);                                         \
+    b = a;                                                        \
+    a = tmp;                                                      \
+} while (0)
+
+/* RFC 2289 folds the five digest words as little endian values:
+ * the OTP is le(H0 ^ H2 ^ H4) followed by le(H1 ^ H3).  Keeping the chain
+ * value as the two big endian message words of the next block lets the
+ * fold feed straight back into the compression function.
+ */
+static APR_INLINE void sha1_chain_fold(apr_uint32_t h0, apr_uint32_t h1,
+                                       apr_uint32_t h2, apr_uint32_t h3,
+                                       apr_uint32_t h4,
+                                       apr_uint32_t *m0, apr_uint32_t *m1)
+{
+  *m0 = ORT_BSWAP32(h0 ^ h2 ^ h4);
+  *m1 = ORT_BSWAP32(h1 ^ h3);
+}
+
+static APR_INLINE void sha1_chain_step(apr_uint32_t *m0, apr_uint32_t *m1)
+{
+  apr_uint32_t w[16];
+  apr_uint32_t a = SHA1_H0, b = SHA1_H1, c = SHA1_H2, d = SHA1_H3, e = SHA1_H4;
+  int t;
+
+  memcpy(w, sha1_chain_pad, sizeof(w));
+  w[0] = *m0;
+  w[1] = *m1;
+
+  for (t = 0; t < 16; t++) {
+    SHA1_ROUND((b & c) | (~b & d), 0x5a827999, w[t]);
+  }
+  for (; t < 20; t++) {
+    SHA1_ROUND((b & c) | (~b & d), 0x5a827999, SHA1_W(t));
+  }
+  for (; t < 40; t++) {
+    SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1, SHA1_W(t));
+  }
+  for (; t < 60; t++) {
+    SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8f1bbcdc, SHA1_W(t));
+  }
+  for (; t < 80; t++) {
+    SHA1_ROUND(b ^ c ^ d, 0xca62c1d6, SHA1_W(t));
+  }
+
+  sha1_chain_fold(a + SHA1_H0, b + SHA1_H1, c + SHA1_H2, d + SHA1_H3,
+                  e + SHA1_H4, m0, m1);
+}
+
+static APR_INLINE apr_uint32_t load_be32(const unsigned char *p)
+{
+  return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16) |
+         ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
 orthrus_error_t* orthrus__alg_sha1_fold(const char *seed,
                                        apr_size_t slen,
                                        const char *pw,
                                        apr_size_t pwlen,
                                        orthrus_response_t *reply)
 {
-  apr_uint32_t digest[5];
+  unsigned char digest[APR_SHA1_DIGESTSIZE];
   apr_sha1_ctx_t sha1;
-  int i;
-  unsigned char* bits = (unsigned char*)digest;
+  apr_uint32_t m0, m1;
 
   apr_sha1_init(&sha1);
 
   apr_sha1_update_binary(&sha1, (unsigned char*)seed, slen);
   apr_sha1_update_binary(&sha1, (unsigned char*)pw, pwlen);
 
-  apr_sha1_final((unsigned char*)&digest[0], &sha1);
-  
-    /* reverse the order */
-    for (i=0; i<10; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[19-i];
-        bits[19-i]= tmp;
-    }
+  apr_sha1_final(digest, &sha1);
 
-  digest[0] ^= digest[2];
-  digest[0] ^= digest[4];
-  digest[1] ^= digest[3];
-  
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (i=0; i<4; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[7-i];
-        bits[7-i]= tmp;
-    }
-#endif
+  sha1_chain_fold(load_be32(digest), load_be32(digest + 4),
+                  load_be32(digest + 8), load_be32(digest + 12),
+                  load_be32(digest + 16), &m0, &m1);
 
-  memcpy(&reply->reply, &digest[0], 8);
+  reply->reply = ((apr_uint64_t)m0 << 32) | m1;
 
   return ORTHRUS_SUCCESS;
 }
@@ -65,51 +125,234 @@ orthrus_error_t* orthrus__alg_sha1_fold(const char *seed,
 orthrus_error_t* orthrus__alg_sha1_cycle(apr_uint64_t sequence, 
                                         orthrus_response_t *reply)
 {
-  int j;
-  apr_uint32_t digest[5];
-  apr_sha1_ctx_t sha1;
-  int i;
-  unsigned char* bits = (unsigned char*)digest;
-  
-  apr_sha1_init(&sha1);
+  apr_uint64_t j;
+  apr_uint32_t m0 = (apr_uint32_t)(reply->reply >> 32);
+  apr_uint32_t m1 = (apr_uint32_t)reply->reply;
+
+  for (j = 0; j < sequence; j++) {
+    sha1_chain_step(&m0, &m1);
+  }
+
+  reply->reply = ((apr_uint64_t)m0 << 32) | m1;
+
+  return ORTHRUS_SUCCESS;
+}
+
+const orthrus__kernel_t orthrus__sha1_portable = {
+  "portable", orthrus__alg_sha1_fold, orthrus__alg_sha1_cycle
+};
+
+#ifdef ORT_HAVE_X86_KERNELS
+#include <immintrin.h>
+
+#define SHA_NI_TARGET ORT_TARGET("sha,sse4.1,ssse3")
+
+/* Rounds 4g..4g+3 of the SHA-NI schedule for 3 <= g < 17: consume message
+ * block m0 while computing m1 (msg2), m3 (msg1) and m2 (xor) ahead.
+ */
+#define SHANI_QUAD(ex, ey, m0, m1, m2, m3, f) do {  \
+    ex = _mm_sha1nexte_epu32(ex, m0);               \
+    ey = abcd;                                      \
+    m1 = _mm_sha1msg2_epu32(m1, m0);                \
+    abcd = _mm_sha1rnds4_epu32(abcd, ex, f);        \
+    m3 = _mm_sha1msg1_epu32(m3, m0);                \
+    m2 = _mm_xor_si128(m2, m0);                     \
+} while (0)
+
+/* One SHA-1 compression.  abcd holds A..D from the high lane down and the
+ * high lane of e holds E; w0..w3 are message words 0..15, four per
+ * register, again with the lowest word index in the high lane.
+ */
+static APR_INLINE SHA_NI_TARGET
+void sha1_shani_rounds(__m128i *state_abcd, __m128i *state_e,
+                       __m128i w0, __m128i w1, __m128i w2, __m128i w3)
+{
+  __m128i abcd = *state_abcd;
+  __m128i e0 = *state_e, e1;
 
+  /* Rounds 0-15 load the block itself. */
+  e0 = _mm_add_epi32(e0, w0);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
 
-  memcpy(&digest[0], &reply->reply, 8);
+  e1 = _mm_sha1nexte_epu32(e1, w1);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+  w0 = _mm_sha1msg1_epu32(w0, w1);
 
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (i=0; i<4; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[7-i];
-        bits[7-i]= tmp;
+  e0 = _mm_sha1nexte_epu32(e0, w2);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+  w1 = _mm_sha1msg1_epu32(w1, w2);
+  w0 = _mm_xor_si128(w0, w2);
+
+  SHANI_QUAD(e1, e0, w3, w0, w1, w2, 0);
+
+  /* Rounds 16-67 */
+  SHANI_QUAD(e0, e1, w0, w1, w2, w3, 0);
+  SHANI_QUAD(e1, e0, w1, w2, w3, w0, 1);
+  SHANI_QUAD(e0, e1, w2, w3, w0, w1, 1);
+  SHANI_QUAD(e1, e0, w3, w0, w1, w2, 1);
+  SHANI_QUAD(e0, e1, w0, w1, w2, w3, 1);
+  SHANI_QUAD(e1, e0, w1, w2, w3, w0, 1);
+  SHANI_QUAD(e0, e1, w2, w3, w0, w1, 2);
+  SHANI_QUAD(e1, e0, w3, w0, w1, w2, 2);
+  SHANI_QUAD(e0, e1, w0, w1, w2, w3, 2);
+  SHANI_QUAD(e1, e0, w1, w2, w3, w0, 2);
+  SHANI_QUAD(e0, e1, w2, w3, w0, w1, 2);
+  SHANI_QUAD(e1, e0, w3, w0, w1, w2, 3);
+  SHANI_QUAD(e0, e1, w0, w1, w2, w3, 3);
+
+  /* Rounds 68-79 only finish the schedule already in flight. */
+  e1 = _mm_sha1nexte_epu32(e1, w1);
+  e0 = abcd;
+  w2 = _mm_sha1msg2_epu32(w2, w1);
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+  w3 = _mm_xor_si128(w3, w1);
+
+  e0 = _mm_sha1nexte_epu32(e0, w2);
+  e1 = abcd;
+  w3 = _mm_sha1msg2_epu32(w3, w2);
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+  e1 = _mm_sha1nexte_epu32(e1, w3);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+  *state_e = _mm_sha1nexte_epu32(e0, *state_e);
+  *state_abcd = _mm_add_epi32(abcd, *state_abcd);
+}
+
+static APR_INLINE SHA_NI_TARGET
+void sha1_shani_block(__m128i *abcd, __m128i *e, const unsigned char *p)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+
+  sha1_shani_rounds(abcd, e,
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 0)), bswap),
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), bswap),
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), bswap),
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), bswap));
+}
+
+typedef struct sha1_shani_ctx_t {
+  __m128i abcd;
+  __m128i e;
+  unsigned char block[64];
+  apr_size_t fill;
+  apr_uint64_t total;
+} sha1_shani_ctx_t;
+
+static SHA_NI_TARGET
+void sha1_shani_update(sha1_shani_ctx_t *ctx, const unsigned char *p,
+                       apr_size_t len)
+{
+  ctx->total += len;
+
+  if (ctx->fill) {
+    apr_size_t n = 64 - ctx->fill;
+    if (n > len) {
+      n = len;
     }
-#endif
+    memcpy(ctx->block + ctx->fill, p, n);
+    ctx->fill += n;
+    p += n;
+    len -= n;
+    if (ctx->fill < 64) {
+      return;
+    }
+    sha1_shani_block(&ctx->abcd, &ctx->e, ctx->block);
+    ctx->fill = 0;
+  }
+
+  for (; len >= 64; p += 64, len -= 64) {
+    sha1_shani_block(&ctx->abcd, &ctx->e, p);
+  }
+
+  memcpy(ctx->block, p, len);
+  ctx->fill = len;
+}
+
+static SHA_NI_TARGET
+orthrus_error_t* sha1_shani_fold(const char *seed,
+                                 apr_size_t slen,
+                                 const char *pw,
+                                 apr_size_t pwlen,
+                                 orthrus_response_t *reply)
+{
+  sha1_shani_ctx_t ctx;
+  apr_uint64_t bits;
+  apr_uint32_t m0, m1;
+  int i;
+
+  ctx.abcd = _mm_set_epi32(SHA1_H0, SHA1_H1, SHA1_H2, SHA1_H3);
+  ctx.e = _mm_set_epi32(SHA1_H4, 0, 0, 0);
+  ctx.fill = 0;
+  ctx.total = 0;
+
+  sha1_shani_update(&ctx, (const unsigned char *)seed, slen);
+  sha1_shani_update(&ctx, (const unsigned char *)pw, pwlen);
+
+  bits = ctx.total * 8;
+  ctx.block[ctx.fill++] = 0x80;
+  if (ctx.fill > 56) {
+    memset(ctx.block + ctx.fill, 0, 64 - ctx.fill);
+    sha1_shani_block(&ctx.abcd, &ctx.e, ctx.block);
+    ctx.fill = 0;
+  }
+  memset(ctx.block + ctx.fill, 0, 56 - ctx.fill);
+  for (i = 0; i < 8; i++) {
+    ctx.block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+  }
+  sha1_shani_block(&ctx.abcd, &ctx.e, ctx.block);
+
+  sha1_chain_fold(_mm_extract_epi32(ctx.abcd, 3), _mm_extract_epi32(ctx.abcd, 2),
+                  _mm_extract_epi32(ctx.abcd, 1), _mm_extract_epi32(ctx.abcd, 0),
+                  _mm_extract_epi32(ctx.e, 3), &m0, &m1);
+
+  reply->reply = ((apr_uint64_t)m0 << 32) | m1;
+
+  return ORTHRUS_SUCCESS;
+}
+
+static SHA_NI_TARGET
+orthrus_error_t* sha1_shani_cycle(apr_uint64_t sequence,
+                                  orthrus_response_t *reply)
+{
+  apr_uint64_t j;
+  const __m128i iv_abcd = _mm_set_epi32(SHA1_H0, SHA1_H1, SHA1_H2, SHA1_H3);
+  const __m128i iv_e = _mm_set_epi32(SHA1_H4, 0, 0, 0);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i length = _mm_set_epi32(0, 0, 0, 64);
+  const __m128i pad = _mm_set_epi32(0, 0, 0x80000000, 0);
+  /* Moves byte swapped lanes 1 and 0 up to lanes 3 and 2, zeroing the rest. */
+  const __m128i fold = _mm_set_epi8(4, 5, 6, 7, 0, 1, 2, 3,
+                                    -128, -128, -128, -128,
+                                    -128, -128, -128, -128);
+  __m128i w0 = _mm_set_epi32((apr_uint32_t)(reply->reply >> 32),
+                             (apr_uint32_t)reply->reply, 0x80000000, 0);
 
   for (j = 0; j < sequence; j++) {
-    apr_sha1_init(&sha1);
-    apr_sha1_update_binary(&sha1, (unsigned char*)&digest[0], 8);
-    apr_sha1_final((unsigned char*)&digest[0], &sha1);
-    /* reverse the order */
-    for (i=0; i<10; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[19-i];
-        bits[19-i]= tmp;
-    }
-    digest[0] ^= digest[2];
-    digest[1] ^= digest[3];
-    digest[0] ^= digest[4];
+    __m128i abcd = iv_abcd;
+    __m128i e = iv_e;
+
+    sha1_shani_rounds(&abcd, &e, w0, zero, zero, length);
+
+    /* lane 1 = A ^ C ^ E, lane 0 = B ^ D */
+    abcd = _mm_xor_si128(abcd, _mm_srli_si128(abcd, 8));
+    abcd = _mm_xor_si128(abcd, _mm_srli_si128(e, 8));
+    w0 = _mm_or_si128(_mm_shuffle_epi8(abcd, fold), pad);
   }
 
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (i=0; i<4; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[7-i];
-        bits[7-i]= tmp;
-    }
-#endif
+  reply->reply = ((apr_uint64_t)(apr_uint32_t)_mm_extract_epi32(w0, 3) << 32) |
+                 (apr_uint32_t)_mm_extract_epi32(w0, 2);
 
-  memcpy(&reply->reply, &digest[0], 8);
-  
   return ORTHRUS_SUCCESS;
 }
+
+const orthrus__kernel_t orthrus__sha1_shani = {
+  "sha-ni", sha1_shani_fold, sha1_shani_cycle
+};
+
+#endif
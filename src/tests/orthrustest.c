@@ -16,7 +16,12 @@
 
 #include "orthrus.h"
 #include "apr_file_io.h"
+#include "apr_strings.h"
+#include "apr_env.h"
 #include <stdlib.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 #ifndef NL
 #define NL APR_EOL_STR
@@ -66,6 +71,81 @@ otp_test_t tests[] =
   {ORTHRUS_ALG_SHA1, "OTP's are good", "correct", 99, "4F29 6A74 FE15 67EC", "AURA ALOE HURL WING BERG WAIT"},
 };
 
+/* Resident set size in bytes, or 0 where we don't know how to get it. */
+static apr_size_t test_rss(apr_pool_t *pool)
+{
+  apr_size_t rss = 0;
+#ifdef __linux__
+  apr_file_t *f;
+  char line[128];
+
+  if (apr_file_open(&f, "/proc/self/statm", APR_READ, APR_OS_DEFAULT,
+                    pool) == APR_SUCCESS) {
+    if (apr_file_gets(line, sizeof(line), f) == APR_SUCCESS) {
+      char *p = strchr(line, ' ');
+      if (p) {
+        rss = (apr_size_t)atol(p + 1) * sysconf(_SC_PAGESIZE);
+      }
+    }
+    apr_file_close(f);
+  }
+#endif
+  return rss;
+}
+
+/* Reads all of @a path into @a *buf. */
+static apr_status_t test_read_file(const char *path, char **buf,
+                                   apr_size_t *len, apr_pool_t *pool)
+{
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+
+  rv = apr_file_open(&f, path, APR_READ|APR_BINARY, APR_OS_DEFAULT, pool);
+  if (rv) {
+    return rv;
+  }
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f);
+  if (!rv) {
+    *len = (apr_size_t)finfo.size;
+    *buf = apr_palloc(pool, *len + 1);
+    rv = apr_file_read_full(f, *buf, *len, NULL);
+  }
+  apr_file_close(f);
+  return rv;
+}
+
+/* A format registered by the test, the OTP in decimal. */
+static apr_size_t format_decimal(void *baton, apr_uint64_t value,
+                                 char *buf, apr_size_t size)
+{
+  char tmp[32];
+  apr_size_t len = apr_snprintf(tmp, sizeof(tmp), "%" APR_UINT64_T_FMT, value);
+
+  if (size >= len) {
+    memcpy(buf, tmp, len);
+  }
+  return len;
+}
+
+static const orthrus_format_t decimal_format = {"decimal", format_decimal, NULL};
+
+/* Enrolls "alice" at sequence 100 with @a first, then logs in with
+ * @a reply, leaving the userdb at @a path open on the updated file. */
+static orthrus_error_t* test_login(orthrus_t *ort, const char *path,
+                                   const char *first, const char *reply,
+                                   apr_pool_t *pool)
+{
+  const char *challenge;
+
+  ORT_ERR(orthrus_userdb_open(ort, path));
+  ORT_ERR(orthrus_userdb_save(ort, "alice", "otp-sha1 100 verify1", first));
+  /* Each update renames a new file into place, which the context must
+   * notice without being reopened. */
+  ORT_ERR(orthrus_userdb_get_challenge(ort, "alice", &challenge, pool));
+  return orthrus_userdb_verify(ort, "alice", challenge, reply);
+}
+
 int main(int argc, const char * const argv[])
 {
   int i;
@@ -94,7 +174,38 @@ int main(int argc, const char * const argv[])
     return 1;
   }
   
+  for (i = ORTHRUS_ALG_MD4; i <= ORTHRUS_ALG_SHA1; i++) {
+    const char *kernel, *engine;
+
+    err = orthrus_kernel_name(ort, i, &kernel);
+    if (!err) {
+      err = orthrus_engine_name(ort, i, &engine);
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Failed to query kernel: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+    apr_file_printf(errfile, "alg %d kernel: %s engine: %s"NL,
+                    i, kernel, engine);
+  }
+
   apr_pool_create(&tpool, pool);
+
+  /* Preallocated errors must survive being destroyed, others not be one. */
+  err = orthrus_error_static(ORTHRUS_EUSER_NOT_FOUND);
+  orthrus_error_destroy(err);
+  if (!orthrus_error_is_static(err) || err->err != APR_NOTFOUND ||
+      err->line != 0 || strcmp(err->file, "(static)") != 0) {
+    apr_file_printf(errfile, "Static error Failed"NL);
+    return 1;
+  }
+  err = orthrus_error_createf(APR_EGENERAL, "error %d", 42);
+  if (orthrus_error_is_static(err) || strcmp(err->msg, "error 42") != 0) {
+    apr_file_printf(errfile, "Dynamic error Failed: '%s'"NL, err->msg);
+    return 1;
+  }
+  orthrus_error_destroy(err);
   
   for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
     otp_test_t *t = &tests[i];
@@ -129,6 +240,1017 @@ int main(int argc, const char * const argv[])
   }
 
   apr_file_printf(errfile, "%d tests completed"NL, i);
+
+  {
+    orthrus_request_t requests[sizeof(tests) / sizeof(tests[0])];
+    orthrus_response_t *replies[sizeof(tests) / sizeof(tests[0])];
+    int n = sizeof(tests) / sizeof(tests[0]);
+
+    for (i = 0; i < n; i++) {
+      requests[i].alg = tests[i].alg;
+      requests[i].sequence = tests[i].sequence;
+      requests[i].seed = tests[i].seed;
+      requests[i].pw = tests[i].password;
+      requests[i].pwlen = strlen(tests[i].password);
+    }
+
+    err = orthrus_calculate_batch(ort, replies, requests, n, tpool);
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Batch Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+      const char *p;
+      apr_uint64_t value, expected = 0;
+
+      for (p = tests[i].hex; *p; p++) {
+        if (*p != ' ') {
+          expected = (expected << 4) | (*p <= '9' ? *p - '0' : *p - 'A' + 10);
+        }
+      }
+
+      orthrus_response_value(replies[i], &value);
+      if (value != expected) {
+        apr_file_printf(errfile, "Batch %d Failed: Value mismatch. expected=%"
+                        APR_UINT64_T_HEX_FMT" got=%" APR_UINT64_T_HEX_FMT NL,
+                        i, expected, value);
+        return 1;
+      }
+
+      orthrus_response_format_hex(replies[i], &p);
+      if (strcmp(p, tests[i].hex) != 0) {
+        apr_file_printf(errfile, "Batch %d Failed: Hex mismatch. expected='%s' got='%s'"NL,
+                        i, tests[i].hex, p);
+        return 1;
+      }
+
+      orthrus_response_format_words(replies[i], &p);
+      if (strcmp(p, tests[i].words) != 0) {
+        apr_file_printf(errfile, "Batch %d Failed: Words mismatch. expected='%s' got='%s'"NL,
+                        i, tests[i].words, p);
+        return 1;
+      }
+    }
+    apr_pool_clear(tpool);
+
+    apr_file_printf(errfile, "%d batch tests completed"NL, i);
+  }
+
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    otp_test_t *t = &tests[i];
+    orthrus_otp_t otp;
+
+    err = orthrus_calculate_into(ort, &otp, t->alg, t->sequence, t->seed,
+                                 t->password, strlen(t->password));
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Into %d Failed: %s (%d)"NL,
+                      err->file, err->line, i, err->msg, err->err);
+      return 1;
+    }
+
+    if (strcmp(otp.hex, t->hex) != 0 || strcmp(otp.words, t->words) != 0) {
+      apr_file_printf(errfile, "Into %d Failed: expected='%s' '%s' got='%s' '%s'"NL,
+                      i, t->hex, t->words, otp.hex, otp.words);
+      return 1;
+    }
+  }
+
+  apr_file_printf(errfile, "%d into tests completed"NL, i);
+
+  {
+    /* More MD4 and MD5 chains than the widest engine has lanes, of mixed
+     * lengths, so lanes are refilled as their chains finish. */
+    orthrus_request_t requests[80];
+    orthrus_response_t *replies[80];
+    int n = sizeof(requests) / sizeof(requests[0]);
+
+    for (i = 0; i < n; i++) {
+      requests[i].alg = i % 2 ? ORTHRUS_ALG_MD5 : ORTHRUS_ALG_MD4;
+      requests[i].sequence = (i * 37) % 97 + (i % 5 == 0 ? 300 : 0);
+      requests[i].seed = apr_psprintf(tpool, "lane%d", i);
+      requests[i].pw = "This is a test.";
+      requests[i].pwlen = strlen(requests[i].pw);
+    }
+
+    err = orthrus_calculate_batch(ort, replies, requests, n, tpool);
+    for (i = 0; i < n && !err; i++) {
+      orthrus_response_t *reply;
+      const char *value, *expected;
+
+      err = orthrus_calculate(ort, &reply, requests[i].alg,
+                              requests[i].sequence, requests[i].seed,
+                              requests[i].pw, requests[i].pwlen, tpool);
+      if (err) {
+        break;
+      }
+      orthrus_response_format_hex(reply, &expected);
+      orthrus_response_format_hex(replies[i], &value);
+      if (strcmp(value, expected) != 0) {
+        apr_file_printf(errfile, "Wide batch %d Failed: expected='%s' got='%s'"NL,
+                        i, expected, value);
+        return 1;
+      }
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Wide batch Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+    apr_pool_clear(tpool);
+
+    apr_file_printf(errfile, "%d wide batch tests completed"NL, i);
+  }
+
+  {
+    /* RFC 2289 Appendix C, SHA-1 of "This is a test." at 99. */
+    static const struct {
+      const char *name;
+      const char *out;
+      apr_size_t len;
+    } formats[] = {
+      {"hex", "87FE C776 8B73 CCF9", 19},
+      {"hex-lower", "87fe c776 8b73 ccf9", 19},
+      {"hex-compact", "87FEC7768B73CCF9", 16},
+      {"hex-compact-lower", "87fec7768b73ccf9", 16},
+      {"words", "GAFF WAIT SKID GIG SKY EYED", 27},
+      {"binary", "\x87\xfe\xc7\x76\x8b\x73\xcc\xf9", 8},
+      {"decimal", "9799489151164468473", 19},
+    };
+    apr_uint64_t value = APR_UINT64_C(0x87fec7768b73ccf9);
+    const orthrus_format_t *format;
+    char buf[64];
+    apr_size_t len;
+
+    err = orthrus_format_register(ort, &decimal_format);
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Format Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+      err = orthrus_format_get(ort, formats[i].name, &format);
+      if (!err) {
+        len = 0;
+        err = orthrus_format_write(format, value, NULL, &len);
+      }
+      if (!err && len != formats[i].len) {
+        apr_file_printf(errfile, "Format %s Failed: needs %" APR_SIZE_T_FMT
+                        NL, formats[i].name, len);
+        return 1;
+      }
+      if (!err) {
+        len = sizeof(buf);
+        err = orthrus_format_write(format, value, buf, &len);
+      }
+      if (err) {
+        apr_file_printf(errfile, "[%s:%d] Format %s Failed: %s (%d)"NL,
+                        err->file, err->line, formats[i].name, err->msg,
+                        err->err);
+        return 1;
+      }
+      if (len != formats[i].len || memcmp(buf, formats[i].out, len) != 0) {
+        apr_file_printf(errfile, "Format %s Failed: got '%.*s'"NL,
+                        formats[i].name, (int)len, buf);
+        return 1;
+      }
+
+      len = formats[i].len - 1;
+      err = orthrus_format_write(format, value, buf, &len);
+      if (err == NULL || err->err != APR_ENOSPC || len != formats[i].len) {
+        apr_file_printf(errfile, "Format %s Failed: short buffer accepted"NL,
+                        formats[i].name);
+        return 1;
+      }
+      orthrus_error_destroy(err);
+    }
+
+    apr_file_printf(errfile, "%d format tests completed"NL, i);
+  }
+
+  {
+    int ranges = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+      otp_test_t *t = &tests[i];
+      apr_size_t len = (t->sequence + 1) * ORTHRUS_RANGE_LINE_MAX;
+      char *buf = apr_palloc(tpool, len);
+      apr_size_t off = 0;
+      int seq;
+
+      if (t->sequence < 2) {
+        continue;
+      }
+
+      err = orthrus_calculate_range(ort, buf, &len,
+                                    ORTHRUS_RANGE_HEX | ORTHRUS_RANGE_WORDS,
+                                    t->alg, t->sequence, t->sequence + 1,
+                                    t->seed, t->password,
+                                    strlen(t->password), tpool);
+      if (err) {
+        apr_file_printf(errfile, "[%s:%d] Range %d Failed: %s (%d)"NL,
+                        err->file, err->line, i, err->msg, err->err);
+        return 1;
+      }
+
+      /* Every line must match a single orthrus_calculate. */
+      for (seq = t->sequence; seq >= 0; seq--) {
+        orthrus_response_t *reply;
+        const char *hex, *words, *line;
+
+        err = orthrus_calculate(ort, &reply, t->alg, seq, t->seed,
+                                t->password, strlen(t->password), tpool);
+        if (err) {
+          apr_file_printf(errfile, "[%s:%d] Range %d Failed: %s (%d)"NL,
+                          err->file, err->line, i, err->msg, err->err);
+          return 1;
+        }
+
+        orthrus_response_format_hex(reply, &hex);
+        orthrus_response_format_words(reply, &words);
+        line = apr_psprintf(tpool, "%d: %s %s\n", seq, hex, words);
+
+        if (off + strlen(line) > len ||
+            memcmp(buf + off, line, strlen(line)) != 0) {
+          apr_file_printf(errfile, "Range %d Failed: mismatch at sequence %d"NL,
+                          i, seq);
+          return 1;
+        }
+        off += strlen(line);
+      }
+
+      if (off != len) {
+        apr_file_printf(errfile, "Range %d Failed: %" APR_SIZE_T_FMT
+                        " trailing bytes"NL, i, len - off);
+        return 1;
+      }
+
+      apr_pool_clear(tpool);
+      ranges++;
+    }
+
+    apr_file_printf(errfile, "%d range tests completed"NL, ranges);
+  }
+
+  {
+    int pass;
+
+    /* The first pass fills the checkpoint files, the second reads them. */
+    for (pass = 0; pass < 2; pass++) {
+      for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        otp_test_t *t = &tests[i];
+        orthrus_response_t *reply;
+        const char *p;
+        const char *path = apr_psprintf(tpool, "orthrustest-%d-%s.ckpt",
+                                        t->alg, t->seed);
+
+        err = orthrus_calculate_cached(ort, &reply, path, t->alg,
+                                       t->sequence, t->seed,
+                                       t->password, strlen(t->password),
+                                       tpool);
+        if (err) {
+          apr_file_printf(errfile, "[%s:%d] Cached %d Failed: %s (%d)"NL,
+                          err->file, err->line, i, err->msg, err->err);
+          return 1;
+        }
+
+        orthrus_response_format_hex(reply, &p);
+        if (strcmp(p, t->hex) != 0) {
+          apr_file_printf(errfile, "Cached %d Failed: Hex mismatch. expected='%s' got='%s'"NL,
+                          i, t->hex, p);
+          return 1;
+        }
+      }
+      apr_pool_clear(tpool);
+    }
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+      apr_file_remove(apr_psprintf(tpool, "orthrustest-%d-%s.ckpt",
+                                   tests[i].alg, tests[i].seed), tpool);
+    }
+    i = sizeof(tests) / sizeof(tests[0]);
+
+    apr_file_printf(errfile, "%d cached tests completed"NL, i * pass);
+  }
+
+  {
+    /* Chains long enough to use the file, filled going down as OTPs are
+     * used, then a mistyped password, which must neither be trusted nor
+     * overwrite the file. */
+    static const apr_uint64_t seqs[] = {40000, 39999, 35000};
+    const char *path = "orthrustest-long.ckpt";
+    orthrus_response_t *reply, *expect;
+    const char *got, *want;
+    char *before = NULL, *after = NULL;
+    apr_size_t blen = 0, alen = 0;
+    int alg, j, checks = 0;
+
+    for (alg = ORTHRUS_ALG_MD4; alg <= ORTHRUS_ALG_SHA1; alg++) {
+      for (j = 0; j < sizeof(seqs) / sizeof(seqs[0]); j++) {
+        err = orthrus_calculate_cached(ort, &reply, path, alg, seqs[j],
+                                       "longseed", "test", 4, tpool);
+        if (!err) {
+          err = orthrus_calculate(ort, &expect, alg, seqs[j], "longseed",
+                                  "test", 4, tpool);
+        }
+        if (err) {
+          apr_file_printf(errfile, "[%s:%d] Long cached %d Failed: %s (%d)"NL,
+                          err->file, err->line, alg, err->msg, err->err);
+          return 1;
+        }
+        orthrus_response_format_hex(reply, &got);
+        orthrus_response_format_hex(expect, &want);
+        if (strcmp(got, want) != 0) {
+          apr_file_printf(errfile, "Long cached %d %" APR_UINT64_T_FMT
+                          " Failed: mismatch"NL, alg, seqs[j]);
+          return 1;
+        }
+        checks++;
+      }
+
+      rv = test_read_file(path, &before, &blen, tpool);
+      if (!rv) {
+        err = orthrus_calculate_cached(ort, &reply, path, alg, 39000,
+                                       "longseed", "wrong", 5, tpool);
+      }
+      if (!rv && !err) {
+        err = orthrus_calculate(ort, &expect, alg, 39000, "longseed",
+                                "wrong", 5, tpool);
+      }
+      if (!rv && !err) {
+        rv = test_read_file(path, &after, &alen, tpool);
+      }
+      if (rv || err) {
+        apr_file_printf(errfile, "Wrong password %d Failed: %s"NL, alg,
+                        err ? err->msg : "can't read checkpoint file");
+        return 1;
+      }
+      orthrus_response_format_hex(reply, &got);
+      orthrus_response_format_hex(expect, &want);
+      if (strcmp(got, want) != 0 || blen != alen ||
+          memcmp(before, after, blen) != 0) {
+        apr_file_printf(errfile, "Wrong password %d Failed: %s"NL, alg,
+                        strcmp(got, want) ? "checkpoint trusted" :
+                                            "file changed");
+        return 1;
+      }
+      checks++;
+
+      apr_file_remove(path, tpool);
+      apr_pool_clear(tpool);
+    }
+
+    apr_file_printf(errfile, "%d long cached tests completed"NL, checks);
+  }
+
+  {
+    /* A burst of logins, with a wrong OTP, a replay and an unknown user.
+     * "bob" must not match "bobby"'s record. */
+    static const char *names[] = {"bob", "bobby", "carol", "dave"};
+    orthrus_error_t *expected[6];
+    orthrus_otp_t first[4], next[4];
+    orthrus_verify_t v[6];
+    const char *path = "orthrustest-batch.db";
+    const char *challenge;
+
+    for (i = 0; i < 4; i++) {
+      const char *seed = apr_psprintf(pool, "batch%d", i);
+
+      err = orthrus_calculate_into(ort, &first[i], ORTHRUS_ALG_SHA1, 100,
+                                   seed, "test", 4);
+      if (!err) {
+        err = orthrus_calculate_into(ort, &next[i], ORTHRUS_ALG_SHA1, 99,
+                                     seed, "test", 4);
+      }
+      if (!err) {
+        err = orthrus_userdb_open(ort, path);
+      }
+      if (!err) {
+        err = orthrus_userdb_save(ort, names[i],
+                                  apr_psprintf(pool, "otp-sha1 100 %s", seed),
+                                  first[i].hex);
+      }
+      if (err) {
+        apr_file_printf(errfile, "[%s:%d] Batch verify Failed: %s (%d)"NL,
+                        err->file, err->line, err->msg, err->err);
+        return 1;
+      }
+
+      v[i].username = names[i];
+      v[i].challenge = apr_psprintf(pool, "otp-sha1 99 %s", seed);
+      v[i].reply = next[i].words;
+      expected[i] = ORTHRUS_SUCCESS;
+    }
+
+    /* Records are no longer limited to 1024 bytes. */
+    {
+      char *longname = apr_palloc(pool, 3001);
+
+      memset(longname, 'x', 3000);
+      longname[3000] = '\0';
+      err = orthrus_userdb_open(ort, path);
+      if (!err) {
+        err = orthrus_userdb_save(ort, longname, "otp-sha1 7 long", first[0].hex);
+      }
+      if (!err) {
+        err = orthrus_userdb_get_challenge(ort, longname, &challenge, tpool);
+      }
+      if (err || strcmp(challenge, "otp-sha1 6 long") != 0) {
+        apr_file_printf(errfile, "Batch verify Failed: long record: %s"NL,
+                        err ? err->msg : challenge);
+        return 1;
+      }
+    }
+
+    v[2].reply = first[2].hex;
+    expected[2] = orthrus_error_static(ORTHRUS_EINVALID_RESPONSE);
+    v[4] = v[0];
+    expected[4] = orthrus_error_static(ORTHRUS_ESEQUENCE_CHANGED);
+    v[5] = v[0];
+    v[5].username = "nobody";
+    expected[5] = orthrus_error_static(ORTHRUS_EUSER_NOT_FOUND);
+
+    err = orthrus_userdb_open(ort, path);
+    if (!err) {
+      err = orthrus_userdb_verify_batch(ort, v, 6);
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Batch verify Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    for (i = 0; i < 6; i++) {
+      if (v[i].err != expected[i]) {
+        apr_file_printf(errfile, "Batch verify %d Failed: %s"NL, i,
+                        v[i].err ? v[i].err->msg : "accepted");
+        return 1;
+      }
+      orthrus_error_destroy(v[i].err);
+    }
+
+    for (i = 0; i < 4; i++) {
+      err = orthrus_userdb_get_challenge(ort, names[i], &challenge, tpool);
+      if (err || strcmp(challenge, apr_psprintf(tpool, "otp-sha1 %d batch%d",
+                                                i == 2 ? 99 : 98, i)) != 0) {
+        apr_file_printf(errfile, "Batch verify Failed: %s has %s"NL,
+                        names[i], err ? err->msg : challenge);
+        return 1;
+      }
+    }
+
+    /* Records added by hand are found although the index predates them,
+     * and a damaged index is rebuilt. */
+    {
+      apr_file_t *db;
+      const char *idxpath = apr_pstrcat(tpool, path, ".idx", NULL);
+      const char *want = "otp-sha1 41 byhand";
+
+      rv = apr_file_open(&db, path, APR_WRITE|APR_APPEND|APR_BINARY,
+                         APR_OS_DEFAULT, tpool);
+      if (!rv) {
+        apr_file_printf(db, "edited 0042 byhand 0  Jan 01,2026 00:00:00\n");
+        apr_file_close(db);
+      }
+      err = orthrus_userdb_get_challenge(ort, "edited", &challenge, tpool);
+      if (!err && strcmp(challenge, want) == 0) {
+        orthrus_userdb_close(ort);
+        rv = apr_file_open(&db, idxpath, APR_WRITE|APR_TRUNCATE|APR_BINARY,
+                           APR_OS_DEFAULT, tpool);
+        if (!rv) {
+          apr_file_printf(db, "not an index");
+          apr_file_close(db);
+        }
+        err = orthrus_userdb_open(ort, path);
+        if (!err) {
+          err = orthrus_userdb_get_challenge(ort, "edited", &challenge, tpool);
+        }
+      }
+      if (err || strcmp(challenge, want) != 0) {
+        apr_file_printf(errfile, "Batch verify Failed: edited has %s"NL,
+                        err ? err->msg : challenge);
+        return 1;
+      }
+    }
+
+    orthrus_userdb_close(ort);
+    apr_file_remove(path, tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".lock", NULL), tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".idx", NULL), tpool);
+    apr_pool_clear(tpool);
+
+    apr_file_printf(errfile, "%d batch verify tests completed"NL, 8);
+  }
+
+  {
+    /* Updates stream the text userdb in 64KB blocks: a record across a
+     * block boundary is carried over, and one longer than a block grows
+     * the buffer. */
+    const char *path = "orthrustest-stream.db";
+    const char *names[4], *expect[4];
+    char *longname = apr_palloc(pool, 70001);
+    char line[128];
+    apr_off_t off = 0;
+    apr_file_t *db;
+    orthrus_otp_t first;
+
+    memset(longname, 'y', 70000);
+    longname[70000] = '\0';
+    names[0] = NULL;
+
+    err = orthrus_calculate_into(ort, &first, ORTHRUS_ALG_SHA1, 100, "stream",
+                                 "test", 4);
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Stream Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    rv = apr_file_open(&db, path, APR_WRITE|APR_CREATE|APR_TRUNCATE,
+                       APR_OS_DEFAULT, tpool);
+    for (i = 0; i < 1200 && !rv; i++) {
+      apr_size_t len = apr_snprintf(line, sizeof(line),
+                                    "filler%04d %04d seed%d %24"
+                                    APR_UINT64_T_HEX_FMT
+                                    "  Jan 01,2026 00:00:00\n",
+                                    i, 50 + i % 7, i, (apr_uint64_t)i);
+
+      if (off < 65536 && off + (apr_off_t)len > 65536) {
+        names[0] = apr_psprintf(tpool, "filler%04d", i);
+        expect[0] = apr_psprintf(tpool, "otp-sha1 %d seed%d",
+                                 50 + i % 7 - 1, i);
+      }
+      off += len;
+      rv = apr_file_write_full(db, line, len, NULL);
+    }
+    if (!rv) {
+      rv = apr_file_printf(db, "%s 0020 longseed %24"
+                           APR_UINT64_T_HEX_FMT "  Jan 01,2026 00:00:00\n"
+                           "tail 0030 tailseed %24" APR_UINT64_T_HEX_FMT
+                           "  Jan 01,2026 00:00:00\n",
+                           longname, (apr_uint64_t)1, (apr_uint64_t)2) > 0
+           ? APR_SUCCESS : APR_EGENERAL;
+    }
+    apr_file_close(db);
+    if (rv || names[0] == NULL) {
+      apr_file_printf(errfile, "Stream Failed: can't write %s"NL, path);
+      return 1;
+    }
+
+    names[1] = longname;
+    expect[1] = "otp-sha1 19 longseed";
+    names[2] = "tail";
+    expect[2] = "otp-sha1 99 stream";
+    names[3] = "filler1199";
+    expect[3] = apr_psprintf(tpool, "otp-sha1 %d seed1199", 50 + 1199 % 7 - 1);
+
+    /* Rewrites every record through the reader. */
+    err = orthrus_userdb_open(ort, path);
+    if (!err) {
+      err = orthrus_userdb_save(ort, "tail", "otp-sha1 100 stream",
+                                first.hex);
+    }
+    for (i = 0; i < 4 && !err; i++) {
+      const char *challenge;
+
+      err = orthrus_userdb_get_challenge(ort, names[i], &challenge, tpool);
+      if (!err && strcmp(challenge, expect[i]) != 0) {
+        apr_file_printf(errfile, "Stream %d Failed: expected='%s' got='%s'"NL,
+                        i, expect[i], challenge);
+        return 1;
+      }
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Stream Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    orthrus_userdb_close(ort);
+    apr_file_remove(path, tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".lock", NULL), tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".idx", NULL), tpool);
+    apr_pool_clear(tpool);
+
+    apr_file_printf(errfile, "%d stream tests completed"NL, i);
+  }
+
+  {
+    /* The binary userdb, and conversion both ways. */
+    const char *path = "orthrustest-binary.db";
+    const char *challenge = NULL;
+    char *longname = apr_palloc(pool, 82);
+    orthrus_otp_t prev, cur;
+    apr_finfo_t before, after;
+    apr_file_t *db;
+    char magic[8];
+    int j;
+
+    memset(longname, 'x', 81);
+    longname[81] = '\0';
+
+    err = orthrus_calculate_into(ort, &prev, ORTHRUS_ALG_SHA1, 100, "verify1",
+                                 "test", 4);
+    if (!err) {
+      err = orthrus_calculate_into(ort, &cur, ORTHRUS_ALG_SHA1, 99, "verify1",
+                                   "test", 4);
+    }
+    if (!err) {
+      err = orthrus_userdb_open(ort, path);
+    }
+    if (!err) {
+      err = orthrus_userdb_save(ort, "carol", "otp-sha1 50 carolseed", prev.hex);
+    }
+    if (!err) {
+      err = orthrus_userdb_convert(ort, ORTHRUS_USERDB_BINARY);
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Binary userdb Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    rv = apr_file_open(&db, path, APR_READ|APR_BINARY, APR_OS_DEFAULT, tpool);
+    if (!rv) {
+      rv = apr_file_read_full(db, magic, sizeof(magic), NULL);
+      apr_file_close(db);
+    }
+    if (rv || memcmp(magic, "\211ORTUDB", sizeof(magic)) != 0) {
+      apr_file_printf(errfile, "Binary userdb Failed: not converted"NL);
+      return 1;
+    }
+
+    /* Logins and saves of known users rewrite their records in place. */
+    rv = apr_stat(&before, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    err = test_login(ort, path, prev.hex, cur.words, tpool);
+    if (!err) {
+      err = orthrus_userdb_save(ort, "alice", "otp-sha1 99 verify1", cur.hex);
+    }
+    if (!err) {
+      rv = apr_stat(&after, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    }
+    if (err || rv || before.inode != after.inode || before.size != after.size) {
+      apr_file_printf(errfile, "Binary userdb Failed: login not in place: %s"NL,
+                      err ? err->msg : "rewritten");
+      return 1;
+    }
+
+    /* Enough new users to grow the table. */
+    for (j = 0; j < 40 && !err; j++) {
+      err = orthrus_userdb_save(ort, apr_psprintf(tpool, "user%d", j),
+                                "otp-sha1 10 grow", prev.hex);
+    }
+    for (j = 0; j < 40 && !err; j++) {
+      err = orthrus_userdb_get_challenge(ort, apr_psprintf(tpool, "user%d", j),
+                                         &challenge, tpool);
+      if (!err && strcmp(challenge, "otp-sha1 9 grow") != 0) {
+        break;
+      }
+    }
+    if (err || j != 40) {
+      apr_file_printf(errfile, "Binary userdb Failed: user%d: %s"NL, j,
+                      err ? err->msg : challenge);
+      return 1;
+    }
+
+    err = orthrus_userdb_save(ort, longname, "otp-sha1 10 long", prev.hex);
+    if (err == NULL) {
+      apr_file_printf(errfile, "Binary userdb Failed: long username saved"NL);
+      return 1;
+    }
+    orthrus_error_destroy(err);
+
+    err = orthrus_userdb_convert(ort, ORTHRUS_USERDB_TEXT);
+    if (!err) {
+      err = orthrus_userdb_get_challenge(ort, "carol", &challenge, tpool);
+    }
+    if (!err && strcmp(challenge, "otp-sha1 49 carolseed") == 0) {
+      err = orthrus_userdb_get_challenge(ort, "alice", &challenge, tpool);
+    }
+    if (err || strcmp(challenge, "otp-sha1 98 verify1") != 0) {
+      apr_file_printf(errfile, "Binary userdb Failed: converted back: %s"NL,
+                      err ? err->msg : challenge);
+      return 1;
+    }
+
+    orthrus_userdb_close(ort);
+    apr_file_remove(path, tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".lock", NULL), tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".idx", NULL), tpool);
+    apr_pool_clear(tpool);
+
+    apr_file_printf(errfile, "%d binary userdb tests completed"NL, 6);
+  }
+
+  {
+    /* The log userdb: appends, a torn tail and compaction. */
+    const char *path = "orthrustest-log.db";
+    const char *challenge = NULL;
+    orthrus_otp_t prev, cur;
+    apr_finfo_t before, after;
+    apr_size_t len = 5;
+    apr_file_t *db;
+    char magic[8];
+    int j;
+
+    err = orthrus_calculate_into(ort, &prev, ORTHRUS_ALG_SHA1, 100, "verify1",
+                                 "test", 4);
+    if (!err) {
+      err = orthrus_calculate_into(ort, &cur, ORTHRUS_ALG_SHA1, 99, "verify1",
+                                   "test", 4);
+    }
+    if (!err) {
+      err = orthrus_userdb_open(ort, path);
+    }
+    if (!err) {
+      err = orthrus_userdb_save(ort, "carol", "otp-sha1 50 carolseed", prev.hex);
+    }
+    if (!err) {
+      err = orthrus_userdb_convert(ort, ORTHRUS_USERDB_LOG);
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Log userdb Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    rv = apr_file_open(&db, path, APR_READ|APR_BINARY, APR_OS_DEFAULT, tpool);
+    if (!rv) {
+      rv = apr_file_read_full(db, magic, sizeof(magic), NULL);
+      apr_file_close(db);
+    }
+    if (rv || memcmp(magic, "\211ORTLOG", sizeof(magic)) != 0) {
+      apr_file_printf(errfile, "Log userdb Failed: not converted"NL);
+      return 1;
+    }
+
+    /* Logins append to the same file. */
+    rv = apr_stat(&before, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    err = test_login(ort, path, prev.hex, cur.words, tpool);
+    if (!err) {
+      rv = apr_stat(&after, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    }
+    if (err || rv || before.inode != after.inode || before.size >= after.size) {
+      apr_file_printf(errfile, "Log userdb Failed: login not appended: %s"NL,
+                      err ? err->msg : "rewritten");
+      return 1;
+    }
+
+    /* A partly written record at the end is ignored, then written over. */
+    rv = apr_file_open(&db, path, APR_WRITE|APR_APPEND|APR_BINARY,
+                       APR_OS_DEFAULT, tpool);
+    if (!rv) {
+      rv = apr_file_write_full(db, "\x40\0\0\0\x01", len, NULL);
+      apr_file_close(db);
+    }
+    err = orthrus_userdb_get_challenge(ort, "carol", &challenge, tpool);
+    if (!err && strcmp(challenge, "otp-sha1 49 carolseed") == 0) {
+      err = orthrus_userdb_save(ort, "carol", "otp-sha1 60 carolseed",
+                                prev.hex);
+    }
+    if (!err) {
+      err = orthrus_userdb_get_challenge(ort, "carol", &challenge, tpool);
+    }
+    if (rv || err || strcmp(challenge, "otp-sha1 59 carolseed") != 0) {
+      apr_file_printf(errfile, "Log userdb Failed: torn tail: %s"NL,
+                      err ? err->msg : challenge);
+      return 1;
+    }
+
+    /* Superseded records pile up, as logins only append, until the log
+     * is compacted. */
+    rv = apr_stat(&before, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    for (j = 0; j < 2000 && !err; j++) {
+      err = orthrus_userdb_save(ort, "carol",
+                                apr_psprintf(tpool, "otp-sha1 %d carolseed",
+                                             1000 + j), prev.hex);
+    }
+    if (!err) {
+      rv = apr_stat(&after, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    }
+    if (err || rv || before.inode != after.inode ||
+        after.size <= 64 * 1024) {
+      apr_file_printf(errfile, "Log userdb Failed: login compacted: %s"NL,
+                      err ? err->msg : "rewritten");
+      return 1;
+    }
+
+    err = orthrus_userdb_compact(ort);
+    if (!err) {
+      rv = apr_stat(&after, path, APR_FINFO_IDENT|APR_FINFO_SIZE, tpool);
+    }
+    if (err || rv || before.inode == after.inode ||
+        after.size > 64 * 1024) {
+      apr_file_printf(errfile, "Log userdb Failed: not compacted: %s"NL,
+                      err ? err->msg : "too large");
+      return 1;
+    }
+
+    err = orthrus_userdb_get_challenge(ort, "carol", &challenge, tpool);
+    if (!err && strcmp(challenge, "otp-sha1 2998 carolseed") == 0) {
+      err = orthrus_userdb_get_challenge(ort, "alice", &challenge, tpool);
+    }
+    if (err || strcmp(challenge, "otp-sha1 98 verify1") != 0) {
+      apr_file_printf(errfile, "Log userdb Failed: compacted: %s"NL,
+                      err ? err->msg : challenge);
+      return 1;
+    }
+
+    err = orthrus_userdb_convert(ort, ORTHRUS_USERDB_TEXT);
+    if (!err) {
+      err = orthrus_userdb_get_challenge(ort, "carol", &challenge, tpool);
+    }
+    if (err || strcmp(challenge, "otp-sha1 2998 carolseed") != 0) {
+      apr_file_printf(errfile, "Log userdb Failed: converted back: %s"NL,
+                      err ? err->msg : challenge);
+      return 1;
+    }
+
+    /* Damage followed by good records is not a torn tail: it must be
+     * reported, and no update may cut the later records off. */
+    err = orthrus_userdb_convert(ort, ORTHRUS_USERDB_LOG);
+    if (!err) {
+      orthrus_userdb_close(ort);
+      rv = apr_file_open(&db, path, APR_READ|APR_WRITE|APR_BINARY,
+                         APR_OS_DEFAULT, tpool);
+      if (!rv) {
+        apr_off_t off = 16 + 8;
+        char c;
+
+        rv = apr_file_seek(db, APR_SET, &off);
+        if (!rv) {
+          rv = apr_file_read_full(db, &c, 1, NULL);
+        }
+        c ^= 0x01;
+        off = 16 + 8;
+        if (!rv) {
+          rv = apr_file_seek(db, APR_SET, &off);
+        }
+        if (!rv) {
+          rv = apr_file_write_full(db, &c, 1, NULL);
+        }
+        apr_file_close(db);
+      }
+      if (!rv) {
+        rv = apr_stat(&before, path, APR_FINFO_SIZE, tpool);
+      }
+      err = orthrus_userdb_open(ort, path);
+    }
+    if (rv || err) {
+      apr_file_printf(errfile, "Log userdb Failed: damaging: %s"NL,
+                      err ? err->msg : "can't edit the log");
+      return 1;
+    }
+    for (j = 0; j < 2; j++) {
+      err = j ? orthrus_userdb_save(ort, "dave", "otp-sha1 10 daveseed",
+                                    prev.hex)
+              : orthrus_userdb_get_challenge(ort, "alice", &challenge, tpool);
+      if (err == NULL || err->err != APR_EGENERAL) {
+        break;
+      }
+      orthrus_error_destroy(err);
+      err = NULL;
+    }
+    if (j == 2) {
+      rv = apr_stat(&after, path, APR_FINFO_SIZE, tpool);
+    }
+    if (j != 2 || rv || before.size != after.size) {
+      apr_file_printf(errfile, "Log userdb Failed: damage not reported: %s"NL,
+                      err ? err->msg : "accepted or truncated");
+      return 1;
+    }
+
+    orthrus_userdb_close(ort);
+    apr_file_remove(path, tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".lock", NULL), tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".idx", NULL), tpool);
+    apr_pool_clear(tpool);
+
+    apr_file_printf(errfile, "%d log userdb tests completed"NL, 9);
+  }
+
+  {
+    /* One long lived context verifying over and over, as an auth server
+     * would, must not grow.  ORTHRUS_TEST_VERIFIES sets the count. */
+    const char *path = "orthrustest.db";
+    const char *challenge;
+    char *value;
+    orthrus_otp_t prev, cur;
+    long count = 1000000;
+    apr_size_t rss = 0, end;
+
+    if (apr_env_get(&value, "ORTHRUS_TEST_VERIFIES", pool) == APR_SUCCESS) {
+      count = atol(value);
+    }
+
+    err = orthrus_calculate_into(ort, &prev, ORTHRUS_ALG_SHA1, 100, "verify1",
+                                 "test", 4);
+    if (!err) {
+      err = orthrus_calculate_into(ort, &cur, ORTHRUS_ALG_SHA1, 99, "verify1",
+                                   "test", 4);
+    }
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Verify Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    /* Every way of writing the OTP, RFC 2243 tags included. */
+    {
+      const char *replies[] = {
+        cur.words, cur.hex,
+        apr_pstrcat(pool, "word:", cur.words, NULL),
+        apr_pstrcat(pool, " HEX:", cur.hex, NULL),
+        apr_psprintf(pool, "Hex:%016" APR_UINT64_T_HEX_FMT, cur.value),
+      };
+      const char *bad[] = {
+        apr_pstrcat(pool, "word:", cur.hex, NULL),
+        apr_pstrcat(pool, "hex:", cur.words, NULL),
+        apr_pstrcat(pool, "hex:", cur.hex, " zz", NULL),
+        apr_pstrcat(pool, "hex:", cur.hex, "0", NULL),
+        apr_pstrcat(pool, "init-hex:", cur.hex, NULL),
+      };
+      int j;
+
+      for (j = 0; j < sizeof(replies) / sizeof(replies[0]); j++) {
+        err = test_login(ort, path, prev.hex, replies[j], tpool);
+        if (err) {
+          apr_file_printf(errfile, "[%s:%d] Reply '%s' Failed: %s (%d)"NL,
+                          err->file, err->line, replies[j], err->msg, err->err);
+          return 1;
+        }
+      }
+
+      for (j = 0; j < sizeof(bad) / sizeof(bad[0]); j++) {
+        err = test_login(ort, path, prev.hex, bad[j], tpool);
+        if (err == NULL) {
+          apr_file_printf(errfile, "Reply '%s' Failed: accepted"NL, bad[j]);
+          return 1;
+        }
+        orthrus_error_destroy(err);
+      }
+      apr_pool_clear(tpool);
+    }
+
+    /* Opened once, so whatever a verify leaves in dbpool stays there. */
+    err = orthrus_userdb_open(ort, path);
+    if (err) {
+      apr_file_printf(errfile, "[%s:%d] Verify Failed: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+      /* Mostly wrong OTPs, as during a guessing attack, with a successful
+       * login every so often to exercise the update path. */
+      if (i % 1000 == 0) {
+        apr_pool_clear(tpool);
+        err = orthrus_userdb_save(ort, "alice", "otp-sha1 100 verify1",
+                                  prev.hex);
+        if (!err) {
+          err = orthrus_userdb_verify(ort, "alice", "otp-sha1 99 verify1",
+                                      cur.words);
+        }
+        if (!err) {
+          err = orthrus_userdb_get_challenge(ort, "alice", &challenge, tpool);
+        }
+      }
+      else {
+        /* prev is the OTP just used, never the next one. */
+        err = orthrus_userdb_verify(ort, "alice", challenge, prev.hex);
+        if (err != orthrus_error_static(ORTHRUS_EINVALID_RESPONSE)) {
+          apr_file_printf(errfile, "Verify %d Failed: wrong OTP not rejected"NL, i);
+          return 1;
+        }
+        err = ORTHRUS_SUCCESS;
+      }
+      if (err) {
+        apr_file_printf(errfile, "[%s:%d] Verify %d Failed: %s (%d)"NL,
+                        err->file, err->line, i, err->msg, err->err);
+        return 1;
+      }
+
+      if (i == count / 10) {
+        rss = test_rss(tpool);
+      }
+    }
+
+    orthrus_userdb_close(ort);
+    apr_file_remove(path, tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".lock", NULL), tpool);
+    apr_file_remove(apr_pstrcat(tpool, path, ".idx", NULL), tpool);
+
+    end = test_rss(tpool);
+    if (rss != 0 && end > rss + 1024 * 1024) {
+      apr_file_printf(errfile, "Verify Failed: RSS grew from %" APR_SIZE_T_FMT
+                      " to %" APR_SIZE_T_FMT " bytes"NL, rss, end);
+      return 1;
+    }
+
+    apr_file_printf(errfile, "%ld verify tests completed"NL, count);
+  }
   
   return 0;
 }
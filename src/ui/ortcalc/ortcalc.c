@@ -21,6 +21,7 @@
 #include "apr_lib.h"
 #include "apr_strings.h"
 #include "apr_getopt.h"
+#include "apr_env.h"
 #ifndef WIN32
 #include <unistd.h>
 #include <termios.h>
@@ -51,6 +52,8 @@ typedef struct ortcalc_t {
   apr_uint64_t num;
   const char *seed;
   int showhex;
+  apr_uint64_t count;
+  int usecache;
 } ortcalc_t;
 
 
@@ -94,15 +97,56 @@ static orthrus_error_t* acquire_password(ortcalc_t *oc)
   return ORTHRUS_SUCCESS;
 }
 
+/* Checkpoints live in ~/.orthrus, one file per algorithm and seed. */
+static orthrus_error_t* cache_path(ortcalc_t *oc, const char **path)
+{
+  apr_status_t rv;
+  char *home;
+  char *seed;
+  const char *dir;
+  char *p;
+
+  rv = apr_env_get(&home, "HOME", oc->pool);
+  if (rv) {
+    return orthrus_error_create(rv, "HOME is not set");
+  }
+
+  seed = apr_pstrdup(oc->pool, oc->seed);
+  for (p = seed; *p; p++) {
+    if (!apr_isalnum(*p)) {
+      return orthrus_error_createf(APR_BADARG, "Seed '%s' is not "
+                                   "alphanumeric", oc->seed);
+    }
+    *p = apr_tolower(*p);
+  }
+
+  dir = apr_pstrcat(oc->pool, home, "/.orthrus", NULL);
+
+  rv = apr_dir_make_recursive(dir, APR_UREAD|APR_UWRITE|APR_UEXECUTE,
+                              oc->pool);
+  if (rv) {
+    return orthrus_error_createf(rv, "Unable to create %s", dir);
+  }
+
+  *path = apr_pstrcat(oc->pool, dir, "/sha1-", seed, ".ckpt", NULL);
+
+  return ORTHRUS_SUCCESS;
+}
+
 static void usage(ortcalc_t *oc)
 {
   apr_file_printf(oc->errfile,
     "%s -- Program to calculate OTP responses" NL
-    "Usage: %s [-VhH] [sequence] [seed]"
+    "Usage: %s [-VhHc] [-n count] [sequence] [seed]"
     ""NL
     "   -V   Print version information and exit." NL
     "   -h   Print help text and exit." NL NL
     "   -H   Output Hex Response" NL
+    "   -n   Output count responses, from sequence downwards" NL
+    "   -c   Keep encrypted chain checkpoints in ~/.orthrus," NL
+    "        for sequences of 32768 and up; not with -n." NL
+    "        Anyone who reads them can guess the password faster" NL
+    "        than from observed OTPs." NL
     ""NL,
     oc->shortname,
     oc->shortname);
@@ -167,7 +211,7 @@ int main(int argc, const char * const argv[])
 
   opt->interleave = 1;
 
-  while ((rv = apr_getopt(opt, "VhH", &ch, &optarg)) == APR_SUCCESS) {
+  while ((rv = apr_getopt(opt, "VhHcn:", &ch, &optarg)) == APR_SUCCESS) {
     switch (ch) {
       case 'V':
         apr_file_printf(oc.outfile, "%s %s" NL, oc.shortname, ORTHRUS_VERSION_STRING);
@@ -177,6 +221,18 @@ int main(int argc, const char * const argv[])
         return 0;
       case 'H':
         oc.showhex = 1;
+        break;
+      case 'n':
+        if (apr_atoi64(optarg) <= 0) {
+          apr_file_printf(oc.errfile, "Error: count must be positive" NL NL);
+          usage(&oc);
+          return 1;
+        }
+        oc.count = apr_atoi64(optarg);
+        break;
+      case 'c':
+        oc.usecache = 1;
+        break;
     }
   }
 
@@ -192,9 +248,24 @@ int main(int argc, const char * const argv[])
     return 1;
   }
 
+  if (oc.usecache && oc.count) {
+    apr_file_printf(oc.errfile, "Error: -c can't be combined with -n" NL NL);
+    usage(&oc);
+    return 1;
+  }
+
   oc.num = apr_atoi64(opt->argv[opt->ind]);
   oc.seed = apr_pstrdup(oc.pool, opt->argv[opt->ind+1]);
 
+  /* Sequences run down to 0, and the whole output is buffered. */
+  if (oc.count > oc.num + 1 ||
+      oc.count > APR_SIZE_MAX / ORTHRUS_RANGE_LINE_MAX) {
+    apr_file_printf(oc.errfile, "Error: count must be at most sequence + 1"
+                    NL NL);
+    usage(&oc);
+    return 1;
+  }
+
   err = acquire_password(&oc);
   if (err) {
     apr_file_printf(oc.errfile, "[%s:%d] acquire_password: %s (%d)"NL,
@@ -202,10 +273,54 @@ int main(int argc, const char * const argv[])
     return 1;
   }
 
-  err = orthrus_calculate(oc.ort, &reply, ORTHRUS_ALG_SHA1,
-                          oc.num, oc.seed,
-                          oc.pwin, strlen(oc.pwin),
-                          oc.pool);
+  if (oc.count) {
+    apr_size_t len = oc.count * ORTHRUS_RANGE_LINE_MAX;
+    char *buf = apr_palloc(oc.pool, len);
+
+    if (buf == NULL) {
+      bzero(oc.pwin, sizeof oc.pwin);
+      apr_file_printf(oc.errfile, "Error: no memory for %" APR_UINT64_T_FMT
+                      " responses" NL, oc.count);
+      return 1;
+    }
+
+    err = orthrus_calculate_range(oc.ort, buf, &len,
+                                  oc.showhex ? ORTHRUS_RANGE_HEX :
+                                               ORTHRUS_RANGE_WORDS,
+                                  ORTHRUS_ALG_SHA1, oc.num, oc.count,
+                                  oc.seed, oc.pwin, strlen(oc.pwin),
+                                  oc.pool);
+
+    bzero(oc.pwin, sizeof oc.pwin);
+
+    if (err) {
+      apr_file_printf(oc.errfile, "[%s:%d] Failed to calculate OTPs: %s (%d)"NL,
+                      err->file, err->line, err->msg, err->err);
+      return 1;
+    }
+
+    apr_file_write_full(oc.outfile, buf, len, NULL);
+
+    return 0;
+  }
+
+  if (oc.usecache) {
+    const char *path = NULL;
+
+    err = cache_path(&oc, &path);
+    if (!err) {
+      err = orthrus_calculate_cached(oc.ort, &reply, path, ORTHRUS_ALG_SHA1,
+                                     oc.num, oc.seed,
+                                     oc.pwin, strlen(oc.pwin),
+                                     oc.pool);
+    }
+  }
+  else {
+    err = orthrus_calculate(oc.ort, &reply, ORTHRUS_ALG_SHA1,
+                            oc.num, oc.seed,
+                            oc.pwin, strlen(oc.pwin),
+                            oc.pool);
+  }
 
   bzero(oc.pwin, sizeof oc.pwin);
 
@@ -14,24 +14,300 @@
  * limitations under the License.
  */
 
+/* For memmem, which glibc only declares when asked; before any header. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
 #include "orthrus.h"
 #include "private/context.h"
+#include "private/userdb.h"
 #include "apr_lib.h"
 #include "apr_strings.h"
-#include "apr_time.h"
 
-#define ORT_USERDB_MAX_LINE_LEN 1024
+/* Streams the userdb a record at a time.  The file is read in large
+ * blocks and records are handed out in place, so a pass costs a few read
+ * calls however many users there are, and records can be of any length.
+ */
+typedef struct userdb_reader_t {
+  orthrus_t *ort;
+  apr_file_t *file;
+  char *buf;
+  apr_size_t size;
+  apr_size_t pos;
+  apr_size_t len;
+  int eof;
+} userdb_reader_t;
+
+static apr_status_t reader_init(userdb_reader_t *r, orthrus_t *ort,
+                                apr_file_t *file)
+{
+  apr_off_t start = 0;
+
+  r->ort = ort;
+  r->file = file;
+  r->buf = ort->readbuf;
+  r->size = ORT_USERDB_BUFFER_SIZE;
+  r->pos = r->len = 0;
+  r->eof = 0;
+
+  return apr_file_seek(file, APR_SET, &start);
+}
+
+/* Returns the next record, without its newline, NUL terminated and
+ * writable until the next call.  Returns APR_EOF after the last one. */
+static apr_status_t reader_next(userdb_reader_t *r, char **line,
+                                apr_size_t *len)
+{
+  apr_status_t rv;
+
+  for (;;) {
+    char *start = r->buf + r->pos;
+    char *nl = memchr(start, '\n', r->len - r->pos);
+
+    if (nl != NULL) {
+      *nl = '\0';
+      *line = start;
+      *len = nl - start;
+      r->pos += *len + 1;
+      return APR_SUCCESS;
+    }
+
+    if (r->eof) {
+      if (r->pos == r->len) {
+        return APR_EOF;
+      }
+      /* A last record without a newline; size leaves room for the NUL. */
+      r->buf[r->len] = '\0';
+      *line = start;
+      *len = r->len - r->pos;
+      r->pos = r->len;
+      return APR_SUCCESS;
+    }
+
+    /* Keep the partial record and read more behind it. */
+    if (r->pos > 0) {
+      memmove(r->buf, start, r->len - r->pos);
+      r->len -= r->pos;
+      r->pos = 0;
+    }
+
+    if (r->len == r->size) {
+      char *buf = orthrus__arena_alloc(&r->ort->scratch, r->size * 2 + 1);
+      if (buf == NULL) {
+        return APR_ENOMEM;
+      }
+      memcpy(buf, r->buf, r->len);
+      r->buf = buf;
+      r->size *= 2;
+    }
+
+    {
+      apr_size_t n = r->size - r->len;
+
+      rv = apr_file_read(r->file, r->buf + r->len, &n);
+      r->len += n;
+      if (APR_STATUS_IS_EOF(rv) || (rv == APR_SUCCESS && n == 0)) {
+        r->eof = 1;
+      }
+      else if (rv != APR_SUCCESS) {
+        return rv;
+      }
+    }
+  }
+}
+
+apr_status_t orthrus__userdb_writer_flush(orthrus__userdb_writer_t *w)
+{
+  apr_size_t wsize;
+  apr_status_t rv = APR_SUCCESS;
+
+  if (w->len) {
+    rv = apr_file_write_full(w->file, w->buf, w->len, &wsize);
+    w->len = 0;
+  }
+
+  return rv;
+}
+
+apr_status_t orthrus__userdb_writer_write(orthrus__userdb_writer_t *w,
+                                          const void *data, apr_size_t len)
+{
+  apr_size_t wsize;
+  apr_status_t rv;
+
+  w->off += len;
+
+  if (w->len + len > ORT_USERDB_BUFFER_SIZE) {
+    rv = orthrus__userdb_writer_flush(w);
+    if (rv) {
+      return rv;
+    }
+    if (len > ORT_USERDB_BUFFER_SIZE) {
+      return apr_file_write_full(w->file, data, len, &wsize);
+    }
+  }
+
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+
+  return APR_SUCCESS;
+}
 
 orthrus_error_t* orthrus_userdb_close(orthrus_t *ort)
 {
 
-  if (ort->userdb) {
+  if (ort->lock) {
     apr_file_close(ort->lock);
-    apr_file_close(ort->userdb);
-    ort->userdb = NULL;
     ort->lock = NULL;
   }
 
+  /* Closes and unmaps ort->userdb along with mappool. */
+  if (ort->dbpool) {
+    apr_pool_clear(ort->dbpool);
+  }
+  ort->mappool = NULL;
+  ort->userdb = NULL;
+  ort->map = NULL;
+  ort->index.slots = NULL;
+  ort->log = NULL;
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Adds the record [line, line + len) at @a offset to @a idx, if it is one. */
+static apr_status_t index_record(orthrus_t *ort, orthrus__index_t *idx,
+                                 const char *line, apr_size_t len,
+                                 apr_off_t offset)
+{
+  const char *sp;
+
+  if (len == 0 || *line == '#' || apr_isspace(*line)) {
+    return APR_SUCCESS;
+  }
+
+  sp = memchr(line, ' ', len);
+
+  return orthrus__index_add(idx, &ort->scratch, line,
+                            sp ? (apr_size_t)(sp - line) : len, offset);
+}
+
+/* Indexes the mapped userdb and saves the result as <path>.idx.  The index
+ * only makes lookups faster, so failing to build it is not an error. */
+static void userdb_build_index(orthrus_t *ort)
+{
+  orthrus__index_t idx;
+  const char *m = ort->map->mm;
+  const char *p = m;
+  const char *end = m + ort->map->size;
+
+  if (orthrus__index_init(&idx, &ort->scratch, ort->map->size / 64)) {
+    return;
+  }
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+
+    if (nl == NULL) {
+      nl = end;
+    }
+    if (index_record(ort, &idx, p, nl - p, p - m)) {
+      return;
+    }
+    p = nl + 1;
+  }
+
+  if (orthrus__index_finish(&idx, &ort->scratch) == APR_SUCCESS &&
+      orthrus__index_save(&idx, ort->idxpath,
+                          apr_pstrcat(ort->tmppool, ort->idxpath, ".tmp", NULL),
+                          &ort->dbinfo, ort->tmppool) == APR_SUCCESS) {
+    orthrus__index_load(&ort->index, ort->idxpath, &ort->dbinfo, ort->mappool);
+  }
+}
+
+/* Makes ort->userdb and ort->map refer to the file now at ort->path.
+ * Text updates rename a new file into place, after which the open one is
+ * stale.  Unchanged files cost one stat.
+ */
+static orthrus_error_t* userdb_refresh(orthrus_t *ort)
+{
+  static const orthrus__userdb_backend_t *const tagged[] = {
+    &orthrus__userdb_binary,
+    &orthrus__userdb_log
+  };
+  const apr_int32_t wanted = APR_FINFO_IDENT|APR_FINFO_SIZE|APR_FINFO_MTIME;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+  apr_size_t i;
+
+  rv = apr_stat(&finfo, ort->path, wanted, ort->tmppool);
+  if (rv == APR_SUCCESS && ort->userdb != NULL &&
+      finfo.inode == ort->dbinfo.inode && finfo.device == ort->dbinfo.device &&
+      finfo.size == ort->dbinfo.size && finfo.mtime == ort->dbinfo.mtime) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  apr_pool_clear(ort->mappool);
+  ort->userdb = NULL;
+  ort->map = NULL;
+  ort->index.slots = NULL;
+  ort->log = NULL;
+
+  rv = apr_file_open(&ort->userdb, ort->path,
+                     APR_READ|APR_WRITE|APR_CREATE|APR_BINARY,
+                     APR_UREAD|APR_UWRITE, ort->mappool);
+  if (rv) {
+    ort->userdb = NULL;
+    return orthrus_error_createf(rv, "Unable to open %s", ort->path);
+  }
+
+  /* From the open file, so the mapping and dbinfo agree. */
+  rv = apr_file_info_get(&ort->dbinfo, wanted, ort->userdb);
+  if (rv) {
+    return orthrus_error_createf(rv, "Unable to stat %s", ort->path);
+  }
+
+  /* Empty files can't be mapped.  If mapping fails for any other reason,
+   * lookups stream the file instead. */
+  if (ort->dbinfo.size > 0 &&
+      (apr_off_t)(apr_size_t)ort->dbinfo.size == ort->dbinfo.size) {
+    rv = apr_mmap_create(&ort->map, ort->userdb, 0,
+                         (apr_size_t)ort->dbinfo.size, APR_MMAP_READ,
+                         ort->mappool);
+    if (rv) {
+      ort->map = NULL;
+    }
+  }
+
+  ort->backend = &orthrus__userdb_text;
+  if (ort->dbinfo.size >= 8) {
+    char magic[8];
+    apr_off_t start = 0;
+
+    if (ort->map != NULL) {
+      memcpy(magic, ort->map->mm, sizeof(magic));
+    }
+    else if (apr_file_seek(ort->userdb, APR_SET, &start) != APR_SUCCESS ||
+             apr_file_read_full(ort->userdb, magic, sizeof(magic),
+                                NULL) != APR_SUCCESS) {
+      return orthrus_error_createf(APR_EGENERAL, "Unable to read %s", ort->path);
+    }
+    for (i = 0; i < sizeof(tagged) / sizeof(tagged[0]); i++) {
+      if (memcmp(magic, tagged[i]->magic, sizeof(magic)) == 0) {
+        ort->backend = tagged[i];
+      }
+    }
+  }
+
+  /* text_update leaves a current index behind, so this only rebuilds one
+   * after the userdb was changed by hand. */
+  if (ort->backend == &orthrus__userdb_text && ort->map != NULL &&
+      orthrus__index_load(&ort->index, ort->idxpath, &ort->dbinfo,
+                          ort->mappool) != APR_SUCCESS) {
+    userdb_build_index(ort);
+  }
+
   return ORTHRUS_SUCCESS;
 }
 
@@ -39,16 +315,25 @@ orthrus_error_t* orthrus_userdb_open(orthrus_t *ort, const char *path)
 {
   apr_status_t rv;
 
-  if (ort->userdb) {
-    orthrus_userdb_close(ort);
+  orthrus_userdb_close(ort);
+
+  /* Reopening is common in long running processes, so nothing here may
+   * come from ort->pool. */
+  if (ort->dbpool == NULL) {
+    apr_pool_create(&ort->dbpool, ort->pool);
+    apr_pool_create(&ort->tmppool, ort->pool);
   }
 
-  ort->path = apr_pstrdup(ort->pool, path);
-  ort->lockpath = apr_pstrcat(ort->pool, path, ".lock", NULL);
+  ort->path = apr_pstrdup(ort->dbpool, path);
+  ort->lockpath = apr_pstrcat(ort->dbpool, path, ".lock", NULL);
+  ort->tmppath = apr_pstrcat(ort->dbpool, path, ".tmp", NULL);
+  ort->idxpath = apr_pstrcat(ort->dbpool, path, ".idx", NULL);
+  ort->readbuf = apr_palloc(ort->dbpool, ORT_USERDB_BUFFER_SIZE + 1);
+  ort->writebuf = apr_palloc(ort->dbpool, ORT_USERDB_BUFFER_SIZE);
 
   rv = apr_file_open(&ort->lock, ort->lockpath,
                      APR_READ|APR_WRITE|APR_CREATE|APR_BINARY,
-                     APR_UREAD|APR_UWRITE, ort->pool);
+                     APR_UREAD|APR_UWRITE, ort->dbpool);
   if (rv) {
       return orthrus_error_createf(rv, "Unable to open %s", ort->lockpath);
   }
@@ -58,103 +343,359 @@ orthrus_error_t* orthrus_userdb_open(orthrus_t *ort, const char *path)
       return orthrus_error_createf(rv, "Unable to lock %s", ort->lockpath);
   }
 
-  rv = apr_file_open(&ort->userdb, path, APR_READ|APR_WRITE|APR_CREATE|APR_BINARY,
-                     APR_UREAD|APR_UWRITE, ort->pool);
-  if (rv) {
-    return orthrus_error_createf(rv, "Unable to open %s", ort->path);
+  apr_pool_create(&ort->mappool, ort->dbpool);
+
+  return userdb_refresh(ort);
+}
+
+/* Splits the next space separated field off [*p, end). */
+static int next_field(const char **p, const char *end,
+                      const char **field, apr_size_t *len)
+{
+  const char *f = *p;
+
+  while (f < end && *f == ' ') {
+    f++;
+  }
+  if (f == end) {
+    return 0;
+  }
+
+  *field = f;
+  while (f < end && *f != ' ') {
+    f++;
+  }
+  *len = f - *field;
+  *p = f;
+
+  return 1;
+}
+
+/* Copies [s, s + len) to the scratch arena as a string. */
+static const char* scratch_strndup(orthrus_t *ort, const char *s,
+                                   apr_size_t len)
+{
+  char *copy = orthrus__arena_alloc(&ort->scratch, len + 1);
+
+  if (copy != NULL) {
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+  }
+
+  return copy;
+}
+
+/* Fills in @a user from the fields that follow the username at @a p in a
+ * record ending at @a end.  Fields are parsed where they lie; unless
+ * @a copy is set the seed is left pointing into the record, which must
+ * outlive the operation.
+ *
+ * UserDB Format:
+ * $username $sequence $seed $lastreply $date_of_last_use
+ * foobar 0400 mi3444  asdgfhasgdfjkh  Mar 04,2009 21:45:09
+ *
+ * We don't parse the date, just the first 4 fields.
+ */
+static orthrus_error_t* parse_record(orthrus_t *ort, orthrus_user_t *user,
+                                     const char *p, const char *end,
+                                     int copy, int lineno)
+{
+  const char *v;
+  apr_size_t vlen;
+
+  if (!next_field(&p, end, &v, &vlen)) {
+    return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
+  }
+
+  user->ch.sequence = 0;
+  while (vlen-- && apr_isdigit(*v)) {
+    user->ch.sequence = user->ch.sequence * 10 + (*v++ - '0');
+  }
+
+  if (!next_field(&p, end, &v, &vlen)) {
+    return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
   }
 
+  user->ch.seed = copy ? scratch_strndup(ort, v, vlen) : v;
+  user->ch.slen = vlen;
+  if (user->ch.seed == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+
+  if (!next_field(&p, end, &v, &vlen)) {
+    user->ch.seed = NULL;
+    return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
+  }
+
+  orthrus__decode_hex_len(v, vlen, &user->lastreply);
+
   return ORTHRUS_SUCCESS;
 }
 
-typedef struct orthrus_challenge_t {
-  apr_uint32_t sequence;
-  const char *seed;
-} orthrus_challenge_t;
+/* Fills in the user, if any, whose record is [line, line + len). */
+static orthrus_error_t* match_record(orthrus_t *ort, apr_hash_t *users,
+                                     const char *line, apr_size_t len,
+                                     int copy, int lineno)
+{
+  const char *end = line + len;
+  const char *p = line;
+  const char *v;
+  apr_size_t vlen;
+  orthrus_user_t *user;
+
+  if (len == 0 || *line == '#' || apr_isspace(*line)) {
+    return ORTHRUS_SUCCESS;
+  }
 
-typedef struct orthrus_user_t {
-  const char *username;
-  orthrus_challenge_t ch;
-  const char *lastreply;
-} orthrus_user_t;
+  if (!next_field(&p, end, &v, &vlen)) {
+    return ORTHRUS_SUCCESS;
+  }
 
-static orthrus_error_t* userdb_get_user(orthrus_t *ort,
-                                        const char *username,
-                                        orthrus_user_t **out_user)
+  user = apr_hash_get(users, v, vlen);
+  if (user == NULL || user->ch.seed != NULL) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  return parse_record(ort, user, p, end, copy, lineno);
+}
+
+/* match_record for the mapped record at @a start. */
+static orthrus_error_t* map_match_record(orthrus_t *ort, apr_hash_t *users,
+                                         const char *start)
 {
-  char line[ORT_USERDB_MAX_LINE_LEN];
-  int lineno = 0;
-  orthrus_user_t *user = NULL;
-  apr_off_t start = 0;
-  apr_status_t rv;
+  const char *m = ort->map->mm;
+  const char *end = m + ort->map->size;
+  const char *nl = memchr(start, '\n', end - start);
+  orthrus_error_t *err;
+  int lineno;
+
+  if (nl == NULL) {
+    nl = end;
+  }
 
-  rv = apr_file_seek(ort->userdb, APR_SET, &start);
-  if (rv) {
-      return orthrus_error_create(rv, "can't seek to start of dbfile");
+  err = match_record(ort, users, start, nl - start, 0, 0);
+  if (err) {
+    /* Only worth counting lines for the message. */
+    for (lineno = 1; m < start; lineno++) {
+      m = (const char *)memchr(m, '\n', start - m) + 1;
+    }
+    orthrus_error_destroy(err);
+    return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
   }
-  while (apr_file_gets(line, sizeof(line), ort->userdb) == APR_SUCCESS) {
-    lineno++;
-    char *strtok_state;
-    char *v;
-    if (*line == '#' || apr_isspace(*line)) {
-      continue;
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Finds the first record of every user in @a users through ort->index. */
+static orthrus_error_t* index_get_users(orthrus_t *ort, apr_hash_t *users)
+{
+  const char *m = ort->map->mm;
+  apr_size_t size = ort->map->size;
+  apr_hash_index_t *hi;
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    const char *username;
+    apr_ssize_t ulen;
+    orthrus__index_iter_t it;
+    apr_off_t off;
+    const char *first = NULL;
+
+    apr_hash_this(hi, (const void **)&username, &ulen, NULL);
+    if (ulen == APR_HASH_KEY_STRING) {
+      ulen = strlen(username);
     }
 
-    /**
-     * UserDB Format:
-     * $username $sequence $seed $lastreply $date_of_last_use
-     * foobar 0400 mi3444  asdgfhasgdfjkh  Mar 04,2009 21:45:09
-     *
-     * We don't parse the date, just the first 4 fields.
-     */
-    v = apr_strtok(line, " ", &strtok_state);
-    if (!v) {
-      continue;
+    orthrus__index_find(&ort->index, username, ulen, &it);
+    while (orthrus__index_next(&ort->index, &it, &off)) {
+      const char *rec = m + off;
+
+      if ((apr_uint64_t)off + ulen > size ||
+          (off > 0 && rec[-1] != '\n') ||
+          memcmp(rec, username, ulen) != 0) {
+        continue;
+      }
+      if ((apr_size_t)off + ulen < size && rec[ulen] != ' ' &&
+          rec[ulen] != '\n') {
+        continue;
+      }
+      if (first == NULL || rec < first) {
+        first = rec;
+      }
     }
 
-    if (strcmp(v, username) != 0) {
-      continue;
+    if (first != NULL) {
+      ORT_ERR(map_match_record(ort, users, first));
+    }
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+#ifdef HAVE_MEMMEM
+/* Finds the first record of the only user in @a users by searching the
+ * mapping for "\n$username ", which skips most of the file rather than
+ * looking at every record.  Sets @a *found to -1 if the username can't
+ * be searched for that way. */
+static orthrus_error_t* map_find_user(orthrus_t *ort, apr_hash_t *users,
+                                      int *found)
+{
+  const char *m = ort->map->mm;
+  const char *end = m + ort->map->size;
+  const char *username, *start;
+  apr_ssize_t ulen;
+  char *needle;
+
+  *found = 0;
+  apr_hash_this(apr_hash_first(ort->tmppool, users), (const void **)&username,
+                &ulen, NULL);
+  if (ulen == APR_HASH_KEY_STRING) {
+    ulen = strlen(username);
+  }
+
+  /* match_record skips comments and indented lines. */
+  if (ulen == 0 || *username == '#' || apr_isspace(*username) ||
+      strcspn(username, " \n") != (apr_size_t)ulen) {
+    *found = -1;
+    return ORTHRUS_SUCCESS;
+  }
+
+  needle = orthrus__arena_alloc(&ort->scratch, ulen + 2);
+  if (needle == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+  needle[0] = '\n';
+  memcpy(needle + 1, username, ulen);
+  needle[ulen + 1] = ' ';
+
+  if (end - m > ulen && memcmp(m, needle + 1, ulen + 1) == 0) {
+    start = m;
+  }
+  else {
+    start = memmem(m, end - m, needle, ulen + 2);
+    if (start == NULL) {
+      return ORTHRUS_SUCCESS;
     }
+    start++;
+  }
+
+  *found = 1;
+  return map_match_record(ort, users, start);
+}
+#endif
 
-    user = apr_pcalloc(ort->pool, sizeof(orthrus_user_t));
-    user->username = apr_pstrdup(ort->pool, v);
+/* Looks up every user in @a users through the index, or else in one pass
+ * over the userdb.  The mapped file is scanned in place, and the seeds
+ * found point into it until the next operation's userdb_refresh.
+ */
+static orthrus_error_t* text_get_users(orthrus_t *ort, apr_hash_t *users)
+{
+  userdb_reader_t reader;
+  char *line;
+  apr_size_t len;
+  int lineno = 0;
+  apr_status_t rv;
 
-    v = apr_strtok(NULL, " ", &strtok_state);
-    if (!v) {
-      return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
+  if (ort->map != NULL) {
+    const char *p = ort->map->mm;
+    const char *end = p + ort->map->size;
+
+    if (ort->index.slots != NULL) {
+      return index_get_users(ort, users);
     }
 
-    user->ch.sequence = apr_strtoi64(v, NULL, 10);
+#ifdef HAVE_MEMMEM
+    if (apr_hash_count(users) == 1) {
+      int found;
 
-    v = apr_strtok(NULL, " ", &strtok_state);
-    if (!v) {
-      return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
+      ORT_ERR(map_find_user(ort, users, &found));
+      if (found >= 0) {
+        return ORTHRUS_SUCCESS;
+      }
     }
+#endif
 
-    user->ch.seed = apr_pstrdup(ort->pool, v);
+    while (p < end) {
+      const char *nl = memchr(p, '\n', end - p);
 
-    v = apr_strtok(NULL, " ", &strtok_state);
-    if (!v) {
-      return orthrus_error_createf(APR_EGENERAL, "userdb corrupted at line %d", lineno);
+      if (nl == NULL) {
+        nl = end;
+      }
+      ORT_ERR(match_record(ort, users, p, nl - p, 0, ++lineno));
+      p = nl + 1;
     }
 
-    user->lastreply = apr_pstrdup(ort->pool, v);
+    return ORTHRUS_SUCCESS;
+  }
 
-    break;
+  rv = reader_init(&reader, ort, ort->userdb);
+  if (rv) {
+      return orthrus_error_create(rv, "can't seek to start of dbfile");
+  }
+  while ((rv = reader_next(&reader, &line, &len)) == APR_SUCCESS) {
+    ORT_ERR(match_record(ort, users, line, len, 1, ++lineno));
   }
 
-  if (user) {
-    *out_user = user;
-    return ORTHRUS_SUCCESS;
+  if (!APR_STATUS_IS_EOF(rv)) {
+    return orthrus_error_create(rv, "can't read dbfile");
   }
 
-  return orthrus_error_create(APR_NOTFOUND, "user not found");
+  return ORTHRUS_SUCCESS;
 }
 
-orthrus_error_t* orthrus_userdb_get_challenge(orthrus_t *ort,
-                                              const char *username,
-                                              const char **challenge,
-                                              apr_pool_t *pool)
+/* Looks up every user in @a users, a hash of username to orthrus_user_t,
+ * in whatever format the userdb is now in. */
+static orthrus_error_t* userdb_get_users(orthrus_t *ort, apr_hash_t *users)
+{
+  ORT_ERR(userdb_refresh(ort));
+
+  return ort->backend->get_users(ort, users);
+}
+
+/* Adds an empty record for @a username to @a users, or returns the one
+ * already there. */
+static orthrus_user_t* userdb_want_user(orthrus_t *ort, apr_hash_t *users,
+                                        const char *username)
+{
+  orthrus_user_t *user = apr_hash_get(users, username, APR_HASH_KEY_STRING);
+
+  if (user == NULL) {
+    user = orthrus__arena_calloc(&ort->scratch, sizeof(orthrus_user_t));
+    if (user != NULL) {
+      user->username = username;
+      apr_hash_set(users, username, APR_HASH_KEY_STRING, user);
+    }
+  }
+
+  return user;
+}
+
+static orthrus_error_t* userdb_get_user(orthrus_t *ort,
+                                        const char *username,
+                                        orthrus_user_t **out_user)
+{
+  apr_hash_t *users = apr_hash_make(ort->tmppool);
+  orthrus_user_t *user = userdb_want_user(ort, users, username);
+
+  *out_user = NULL;
+
+  if (user == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+
+  ORT_ERR(userdb_get_users(ort, users));
+
+  if (user->ch.seed == NULL) {
+    return orthrus_error_static(ORTHRUS_EUSER_NOT_FOUND);
+  }
+
+  *out_user = user;
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* userdb_get_challenge(orthrus_t *ort,
+                                             const char *username,
+                                             const char **challenge,
+                                             apr_pool_t *pool)
 {
   orthrus_error_t* err;
   orthrus_user_t *user;
@@ -165,7 +706,8 @@ orthrus_error_t* orthrus_userdb_get_challenge(orthrus_t *ort,
   }
 
   /* TODO: Configurable algorithms */
-  *challenge = apr_psprintf(pool, "otp-sha1 %u %s", user->ch.sequence - 1,  user->ch.seed);
+  *challenge = apr_psprintf(pool, "otp-sha1 %u %.*s", user->ch.sequence - 1,
+                            (int)user->ch.slen, user->ch.seed);
 
   return ORTHRUS_SUCCESS;
 }
@@ -176,7 +718,11 @@ static orthrus_error_t* decode_challenge(orthrus_t *ort,
 {
   char *strtok_state;
   char *v;
-  char *p = apr_pstrdup(ort->pool, challenge);
+  char *p = orthrus__arena_strdup(&ort->scratch, challenge);
+
+  if (p == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
 
   /* len("otp-md5 1 a") = 11 */
   if (strlen(p) < 11) {
@@ -205,112 +751,452 @@ static orthrus_error_t* decode_challenge(orthrus_t *ort,
                                 "invalid challenge string when looking for seed.");
   }
 
-  ch->seed = apr_pstrdup(ort->pool, v);
+  ch->seed = v;
+  ch->slen = strlen(v);
 
   return ORTHRUS_SUCCESS;
 }
 
-static orthrus_error_t* decode_reply(orthrus_t *ort,
-                                    const char *reply,
-                                    orthrus_response_t **out_resp)
+/* How a reply is encoded, as far as can be told without decoding it. */
+typedef enum reply_kind_e {
+  REPLY_HEX,
+  REPLY_WORDS,
+  /* Only the letters A-F: six words, or else hex. */
+  REPLY_EITHER
+} reply_kind_e;
+
+/* Consumes @a tag, which is lower case, from the front of @a *p. */
+static int reply_tag(const char **p, const char *tag)
+{
+  apr_size_t i;
+
+  for (i = 0; tag[i] != '\0'; i++) {
+    if (apr_tolower((*p)[i]) != tag[i]) {
+      return 0;
+    }
+  }
+
+  *p += i;
+  return 1;
+}
+
+/* One pass over the characters of an untagged reply.  Words never contain
+ * digits and hex never contains letters past F, so usually one of them
+ * decides it. */
+static reply_kind_e classify_reply(const char *reply)
 {
-  orthrus_response_t *resp;
-  /* TODO: Support Six word dictionary decoding.
-   *  (note, its just a SHOULD from the RFC) */
+  const unsigned char *c = (const unsigned char *)reply;
+  int digits = 0, nonhex = 0, tokens = 0, in_token = 0;
+
+  for (; *c != '\0'; c++) {
+    if (apr_isalpha(*c)) {
+      nonhex |= !apr_isxdigit(*c);
+      tokens += !in_token;
+      in_token = 1;
+    }
+    else {
+      digits |= apr_isdigit(*c);
+      in_token = 0;
+    }
+  }
+
+  if (nonhex && !digits) {
+    return REPLY_WORDS;
+  }
+  if (digits && !nonhex) {
+    return REPLY_HEX;
+  }
+  if (!digits && !nonhex && tokens != 6) {
+    return REPLY_HEX;
+  }
+
+  return REPLY_EITHER;
+}
+
+/* A reply tagged hex: must be 16 hex digits, spaced however the user
+ * likes, rather than whatever hex can be picked out of it. */
+static int strict_hex(const char *reply)
+{
+  const unsigned char *c = (const unsigned char *)reply;
+  int digits = 0;
+
+  for (; *c != '\0'; c++) {
+    if (apr_isxdigit(*c)) {
+      digits++;
+    }
+    else if (!apr_isspace(*c)) {
+      return 0;
+    }
+  }
+
+  return digits == 16;
+}
+
+static orthrus_error_t* decode_reply(const char *reply, apr_uint64_t *value)
+{
+  orthrus_error_t *err;
+  reply_kind_e kind;
+
+  while (apr_isspace(*reply)) {
+    reply++;
+  }
+
+  /* RFC 2243 Section 2, extended responses name their encoding. */
+  if (reply_tag(&reply, "hex:")) {
+    if (!strict_hex(reply)) {
+      return orthrus_error_static(ORTHRUS_EINVALID_RESPONSE);
+    }
+    kind = REPLY_HEX;
+  }
+  else if (reply_tag(&reply, "word:")) {
+    kind = REPLY_WORDS;
+  }
+  else if (reply_tag(&reply, "init-")) {
+    return orthrus_error_create(APR_ENOTIMPL,
+                                "reinitialization responses are not supported.");
+  }
+  else {
+    kind = classify_reply(reply);
+  }
 
   /* RFC 2289 Section 6.0, "Form of Output":
    * If a six-word encoded one-time password is valid, it is accepted.
    * Otherwise, if the one-time password can be interpreted as hexadecimal, and
    * with that decoding it is valid, then it is accepted.*/
-  resp = apr_pcalloc(ort->pool, sizeof(orthrus_response_t));
-  resp->pool = ort->pool;
-
-  if (orthrus__decode_words(reply, &resp->reply) != ORTHRUS_SUCCESS)
-      orthrus__decode_hex(reply, &resp->reply);
-
-  *out_resp =  resp;
+  if (kind == REPLY_HEX) {
+    orthrus__decode_hex(reply, value);
+  }
+  else {
+    err = orthrus__decode_words(reply, value);
+    if (err != ORTHRUS_SUCCESS) {
+      if (kind == REPLY_WORDS) {
+        return err;
+      }
+      orthrus__decode_hex(reply, value);
+    }
+  }
 
   return ORTHRUS_SUCCESS;
 }
 
-static
-orthrus_error_t* update_db(orthrus_t *ort, orthrus_user_t *user, apr_uint64_t reply)
+static apr_status_t write_user(orthrus_t *ort, orthrus__userdb_writer_t *w,
+                               orthrus_user_t *user)
 {
-    char line[ORT_USERDB_MAX_LINE_LEN], *tmpfilename;
-    int found = 0;
+  char date[32];
+  apr_time_exp_t t;
+  apr_size_t tsize;
+  char *line;
+
+  apr_time_exp_lt(&t, user->lastuse ? user->lastuse : apr_time_now());
+  apr_strftime(date, &tsize, sizeof date, "%b %d,%Y %H:%M:%S", &t);
+  line = apr_psprintf(ort->tmppool,
+                      "%s %04d %.*s %24"  APR_UINT64_T_HEX_FMT "  %s\n",
+                      user->username, user->ch.sequence,
+                      (int)user->ch.slen, user->ch.seed,
+                      user->lastreply, date);
+
+  return orthrus__userdb_writer_write(w, line, strlen(line));
+}
+
+/* Rewrites the userdb with the record of every dirty user in @a users
+ * replaced, or appended if it had none, and renames it into place.  The
+ * new file's index is built on the way, as the rewrite reads every record
+ * anyway. */
+static orthrus_error_t* text_update(orthrus_t *ort, apr_hash_t *users)
+{
+    const char *tmpfilename = ort->tmppath;
     apr_status_t rv;
     apr_file_t *tmpfile;
-    apr_off_t start = 0;
-
-    tmpfilename = apr_pstrcat(ort->pool, ort->path, ".tmp", NULL);
-    rv = apr_file_open(&tmpfile, tmpfilename, APR_READ|APR_WRITE|APR_CREATE|APR_BINARY,
-                     APR_UREAD|APR_UWRITE, ort->pool);
+    apr_hash_index_t *hi;
+    apr_finfo_t finfo;
+    userdb_reader_t reader;
+    orthrus__userdb_writer_t writer;
+    orthrus__index_t idx;
+    int indexing;
+    char *line;
+    apr_size_t len;
+
+    indexing = orthrus__index_init(&idx, &ort->scratch,
+                                   ort->index.count +
+                                   apr_hash_count(users)) == APR_SUCCESS;
+
+    rv = apr_file_open(&tmpfile, tmpfilename,
+                       APR_READ|APR_WRITE|APR_CREATE|APR_TRUNCATE|APR_BINARY,
+                       APR_UREAD|APR_UWRITE, ort->tmppool);
     if (rv) {
         return orthrus_error_create(rv, "can't open temporary dbfile");
     }
 
-    rv = apr_file_seek(ort->userdb, APR_SET, &start);
+    writer.file = tmpfile;
+    writer.buf = ort->writebuf;
+    writer.len = 0;
+    writer.off = 0;
+
+    rv = reader_init(&reader, ort, ort->userdb);
     if (rv) {
         return orthrus_error_create(rv, "can't seek to start of dbfile");
     }
 
-    while (apr_file_gets(line, sizeof(line), ort->userdb) == APR_SUCCESS) {
-        char *newline;
-        char date[32];
-        apr_time_exp_t t;
-        apr_size_t tsize, wsize;
+    while ((rv = reader_next(&reader, &line, &len)) == APR_SUCCESS) {
+        orthrus_user_t *user = NULL;
 
-        if (strncmp(line, user->username, strlen(user->username)) != 0) {
-            rv = apr_file_write_full(tmpfile, line, strlen(line), &wsize);
-            if (rv) {
-                apr_file_close(tmpfile);
-                apr_file_remove(tmpfilename, ort->pool);
-                return orthrus_error_create(rv, "Can't write to temporary dbfile");
-            }
-            continue;
+        if (indexing && index_record(ort, &idx, line, len, writer.off)) {
+            indexing = 0;
         }
 
-        apr_time_exp_lt(&t, apr_time_now());
-        apr_strftime(date, &tsize, sizeof date, "%b %d,%Y %H:%M:%S", &t);
-        newline = apr_psprintf(ort->pool, "%s %04d %s %24"  APR_UINT64_T_HEX_FMT "  %s\n",
-                           user->username, user->ch.sequence, user->ch.seed,
-                           reply, date);
-        rv = apr_file_write_full(tmpfile, newline, strlen(newline), &wsize);
-        if (rv) {
-            apr_file_close(tmpfile);
-            apr_file_remove(tmpfilename, ort->pool);
-            return orthrus_error_create(rv, "Can't write to temporary dbfile");
+        if (*line != '#' && !apr_isspace(*line)) {
+            user = apr_hash_get(users, line, strcspn(line, " "));
+        }
+
+        /* Only the first record of a user counts, as in text_get_users. */
+        if (user && user->dirty) {
+            rv = write_user(ort, &writer, user);
+            user->dirty = 0;
+        }
+        else {
+            line[len] = '\n';
+            rv = orthrus__userdb_writer_write(&writer, line, len + 1);
         }
-        found = 1;
-    }
-    if (!found) {
-        char date[32];
-        apr_time_exp_t t;
-        apr_size_t tsize, wsize;
-        char *newline;
-
-        apr_time_exp_lt(&t, apr_time_now());
-        apr_strftime(date, &tsize, sizeof date, "%b %d,%Y %H:%M:%S", &t);
-        newline = apr_psprintf(ort->pool, "%s %04d %s %24"  APR_UINT64_T_HEX_FMT "  %s\n",
-                               user->username, user->ch.sequence, user->ch.seed,
-                               reply, date);
-        rv = apr_file_write_full(tmpfile, newline, strlen(newline), &wsize);
+
         if (rv) {
             apr_file_close(tmpfile);
-            apr_file_remove(tmpfilename, ort->pool);
+            apr_file_remove(tmpfilename, ort->tmppool);
             return orthrus_error_create(rv, "Can't write to temporary dbfile");
         }
     }
 
+    if (!APR_STATUS_IS_EOF(rv)) {
+        apr_file_close(tmpfile);
+        apr_file_remove(tmpfilename, ort->tmppool);
+        return orthrus_error_create(rv, "can't read dbfile");
+    }
+
+    rv = APR_SUCCESS;
+    for (hi = apr_hash_first(ort->tmppool, users); hi && !rv;
+         hi = apr_hash_next(hi)) {
+        orthrus_user_t *user;
+
+        apr_hash_this(hi, NULL, NULL, (void **)&user);
+        if (user->dirty) {
+            if (indexing &&
+                orthrus__index_add(&idx, &ort->scratch, user->username,
+                                   strlen(user->username), writer.off)) {
+                indexing = 0;
+            }
+            rv = write_user(ort, &writer, user);
+            user->dirty = 0;
+        }
+    }
+
+    if (!rv) {
+        rv = orthrus__userdb_writer_flush(&writer);
+    }
+    if (rv) {
+        apr_file_close(tmpfile);
+        apr_file_remove(tmpfilename, ort->tmppool);
+        return orthrus_error_create(rv, "Can't write to temporary dbfile");
+    }
+
     apr_file_close(tmpfile);
+
+    /* rename keeps what the index is stamped with. */
+    if (indexing) {
+        indexing = apr_stat(&finfo, tmpfilename,
+                            APR_FINFO_IDENT|APR_FINFO_SIZE|APR_FINFO_MTIME,
+                            ort->tmppool) == APR_SUCCESS;
+    }
+
     rv = apr_file_rename(tmpfilename, ort->path, 0);
 
     if (rv)
         return orthrus_error_create(rv, "Can't rename tmpfile to dbfile");
 
+    /* Without it the next lookup rebuilds the index from the new file. */
+    if (indexing &&
+        orthrus__index_finish(&idx, &ort->scratch) == APR_SUCCESS) {
+        orthrus__index_save(&idx, ort->idxpath,
+                            apr_pstrcat(ort->tmppool, ort->idxpath, ".tmp", NULL),
+                            &finfo, ort->tmppool);
+    }
+
     return ORTHRUS_SUCCESS;
 }
 
+/* Hands out copies of the first record of each user as they are read. */
+static orthrus_error_t* text_each(orthrus_t *ort, orthrus__userdb_each_t cb,
+                                  void *baton)
+{
+  apr_hash_t *seen = apr_hash_make(ort->tmppool);
+  userdb_reader_t reader;
+  char *line;
+  apr_size_t len;
+  int lineno = 0;
+  apr_status_t rv;
+
+  rv = reader_init(&reader, ort, ort->userdb);
+  if (rv) {
+      return orthrus_error_create(rv, "can't seek to start of dbfile");
+  }
+
+  while ((rv = reader_next(&reader, &line, &len)) == APR_SUCCESS) {
+    const char *end = line + len;
+    const char *p = line;
+    const char *v;
+    apr_size_t vlen;
+    orthrus_user_t *user;
+
+    lineno++;
+    if (len == 0 || *line == '#' || apr_isspace(*line) ||
+        !next_field(&p, end, &v, &vlen) || apr_hash_get(seen, v, vlen)) {
+      continue;
+    }
+
+    user = orthrus__arena_calloc(&ort->scratch, sizeof(*user));
+    if (user == NULL ||
+        (user->username = scratch_strndup(ort, v, vlen)) == NULL) {
+      return orthrus_error_create(APR_ENOMEM, "out of memory");
+    }
+    ORT_ERR(parse_record(ort, user, p, end, 1, lineno));
+    apr_hash_set(seen, user->username, vlen, user);
+    ORT_ERR(cb(baton, user));
+  }
+
+  if (!APR_STATUS_IS_EOF(rv)) {
+    return orthrus_error_create(rv, "can't read dbfile");
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* text_write(orthrus_t *ort, apr_file_t *file,
+                                   orthrus_user_t **users, apr_size_t count)
+{
+  orthrus__userdb_writer_t writer;
+  apr_status_t rv = APR_SUCCESS;
+  apr_size_t i;
+
+  writer.file = file;
+  writer.buf = ort->writebuf;
+  writer.len = 0;
+  writer.off = 0;
+
+  for (i = 0; i < count && !rv; i++) {
+    rv = write_user(ort, &writer, users[i]);
+  }
+  if (!rv) {
+    rv = orthrus__userdb_writer_flush(&writer);
+  }
+  if (rv) {
+    return orthrus_error_create(rv, "Can't write to temporary dbfile");
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+const orthrus__userdb_backend_t orthrus__userdb_text = {
+  "text",
+  ORTHRUS_USERDB_TEXT,
+  NULL,
+  text_get_users,
+  text_update,
+  text_each,
+  text_write
+};
+
+typedef struct rewrite_baton_t {
+  orthrus_t *ort;
+  apr_hash_t *users;
+  orthrus_user_t **list;
+  apr_size_t count;
+  apr_size_t capacity;
+} rewrite_baton_t;
+
+/* Appends @a user, or the dirty user of the same name that replaces it. */
+static orthrus_error_t* rewrite_add(void *baton, orthrus_user_t *user)
+{
+  rewrite_baton_t *b = baton;
+  orthrus_user_t *dirty = NULL;
+
+  if (b->users) {
+    dirty = apr_hash_get(b->users, user->username, APR_HASH_KEY_STRING);
+  }
+  if (dirty && dirty->dirty) {
+    dirty->dirty = 0;
+    user = dirty;
+  }
+
+  if (b->count == b->capacity) {
+    apr_size_t capacity = b->capacity ? b->capacity * 2 : 64;
+    orthrus_user_t **list = orthrus__arena_alloc(&b->ort->scratch,
+                                                 capacity * sizeof(*list));
+
+    if (list == NULL) {
+      return orthrus_error_create(APR_ENOMEM, "out of memory");
+    }
+    if (b->count) {
+      memcpy(list, b->list, b->count * sizeof(*list));
+    }
+    b->list = list;
+    b->capacity = capacity;
+  }
+
+  b->list[b->count++] = user;
+  return ORTHRUS_SUCCESS;
+}
+
+orthrus_error_t* orthrus__userdb_rewrite(orthrus_t *ort,
+                                         const orthrus__userdb_backend_t *backend,
+                                         apr_hash_t *users)
+{
+  rewrite_baton_t b;
+  apr_hash_index_t *hi;
+  apr_file_t *tmpfile;
+  orthrus_error_t *err;
+  apr_status_t rv;
+
+  b.ort = ort;
+  b.users = users;
+  b.list = NULL;
+  b.count = b.capacity = 0;
+
+  ORT_ERR(ort->backend->each(ort, rewrite_add, &b));
+
+  if (users) {
+    for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+      orthrus_user_t *user;
+
+      apr_hash_this(hi, NULL, NULL, (void **)&user);
+      if (user->dirty) {
+        ORT_ERR(rewrite_add(&b, user));
+      }
+    }
+  }
+
+  rv = apr_file_open(&tmpfile, ort->tmppath,
+                     APR_READ|APR_WRITE|APR_CREATE|APR_TRUNCATE|APR_BINARY,
+                     APR_UREAD|APR_UWRITE, ort->tmppool);
+  if (rv) {
+    return orthrus_error_create(rv, "can't open temporary dbfile");
+  }
+
+  err = backend->write(ort, tmpfile, b.list, b.count);
+  apr_file_close(tmpfile);
+  if (err) {
+    apr_file_remove(ort->tmppath, ort->tmppool);
+    return err;
+  }
+
+  rv = apr_file_rename(ort->tmppath, ort->path, ort->tmppool);
+  if (rv) {
+    return orthrus_error_create(rv, "Can't rename tmpfile to dbfile");
+  }
+
+  /* Only the text format is indexed, and its next lookup makes a new one. */
+  apr_file_remove(ort->idxpath, ort->tmppool);
+
+  return ORTHRUS_SUCCESS;
+}
+
 /* RFC 2289 Section 7.0 "VERIFICATION OF ONE-TIME PASSWORDS":
  * The server system has a database containing, for each user, the
  * one-time password from the last successful authentication or the
@@ -322,56 +1208,234 @@ orthrus_error_t* update_db(orthrus_t *ort, orthrus_user_t *user, apr_uint64_t re
  * one-time password is stored for future use.
  */
 
-orthrus_error_t* orthrus_userdb_verify(orthrus_t *ort,
-                                       const char *username,
-                                       const char *challenge,
-                                       const char *reply)
+static orthrus_error_t* userdb_verify_batch(orthrus_t *ort,
+                                            orthrus_verify_t *requests,
+                                            apr_size_t count)
 {
-  apr_uint64_t last = 0, r = 0;
-  orthrus_error_t* err;
-  orthrus_challenge_t ch;
-  orthrus_user_t *user;
-  orthrus_response_t *resp;
+  orthrus_error_t *err;
+  apr_hash_t *users = apr_hash_make(ort->tmppool);
+  orthrus_user_t **user;
+  orthrus_challenge_t *ch;
+  apr_uint64_t *replies, *hashed, *steps;
+  apr_size_t i, accepted = 0;
+  apr_time_t now = apr_time_now();
+
+  user = orthrus__arena_alloc(&ort->scratch, count * sizeof(*user));
+  ch = orthrus__arena_alloc(&ort->scratch, count * sizeof(*ch));
+  replies = orthrus__arena_alloc(&ort->scratch, count * sizeof(*replies));
+  hashed = orthrus__arena_alloc(&ort->scratch, count * sizeof(*hashed));
+  steps = orthrus__arena_alloc(&ort->scratch, count * sizeof(*steps));
+  if (count && (!user || !ch || !replies || !hashed || !steps)) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
 
-  err = userdb_get_user(ort, username, &user);
-  if (err != ORTHRUS_SUCCESS) {
-    return err;
+  for (i = 0; i < count; i++) {
+    requests[i].err = ORTHRUS_SUCCESS;
+    user[i] = userdb_want_user(ort, users, requests[i].username);
+    if (user[i] == NULL) {
+      return orthrus_error_create(APR_ENOMEM, "out of memory");
+    }
   }
 
-  err = decode_challenge(ort, challenge, &ch);
-  if (err != ORTHRUS_SUCCESS) {
-    return err;
+  ORT_ERR(userdb_get_users(ort, users));
+
+  /* Everything that doesn't depend on earlier logins in the batch. */
+  for (i = 0; i < count; i++) {
+    orthrus_verify_t *req = &requests[i];
+
+    steps[i] = 1;
+    hashed[i] = 0;
+    replies[i] = 0;
+
+    if (user[i]->ch.seed == NULL) {
+      req->err = orthrus_error_static(ORTHRUS_EUSER_NOT_FOUND);
+      continue;
+    }
+
+    req->err = decode_challenge(ort, req->challenge, &ch[i]);
+    if (req->err == ORTHRUS_SUCCESS) {
+      req->err = decode_reply(req->reply, &replies[i]);
+    }
+    if (req->err == ORTHRUS_SUCCESS) {
+      hashed[i] = replies[i];
+    }
   }
 
-  if (strcmp(ch.seed, user->ch.seed) != 0) {
-    return orthrus_error_create(APR_EGENERAL, "seed changed between challenge and verification.");
+  if (ort->engines[ORTHRUS_ALG_SHA1] && count > 1) {
+    orthrus__mb_chain(ort->engines[ORTHRUS_ALG_SHA1], hashed, steps, count);
   }
+  else {
+    orthrus_response_t resp;
 
-  if (ch.sequence != user->ch.sequence - 1) {
-    return orthrus_error_create(APR_EGENERAL, "sequence changed between challenge and verification.");
+    for (i = 0; i < count; i++) {
+      resp.reply = hashed[i];
+      err = ort->kernels[ORTHRUS_ALG_SHA1]->cycle(1, &resp);
+      if (err) {
+        return err;
+      }
+      hashed[i] = resp.reply;
+    }
   }
 
-  err = decode_reply(ort, reply, &resp);
+  /* In order, so a second login with the same OTP is a replay. */
+  for (i = 0; i < count; i++) {
+    orthrus_verify_t *req = &requests[i];
 
-  if (err != ORTHRUS_SUCCESS) {
-    return err;
+    if (req->err != ORTHRUS_SUCCESS) {
+      continue;
+    }
+
+    if (ch[i].slen != user[i]->ch.slen ||
+        memcmp(ch[i].seed, user[i]->ch.seed, ch[i].slen) != 0) {
+      req->err = orthrus_error_static(ORTHRUS_ESEED_CHANGED);
+    }
+    else if (ch[i].sequence != user[i]->ch.sequence - 1) {
+      req->err = orthrus_error_static(ORTHRUS_ESEQUENCE_CHANGED);
+    }
+    else if (hashed[i] != user[i]->lastreply) {
+      req->err = orthrus_error_static(ORTHRUS_EINVALID_RESPONSE);
+    }
+    else {
+      user[i]->ch.sequence--;
+      user[i]->lastreply = replies[i];
+      user[i]->lastuse = now;
+      user[i]->dirty = 1;
+      accepted++;
+    }
   }
 
-  r = resp->reply;
+  if (accepted == 0) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  err = ort->backend->update(ort, users);
+  if (err) {
+    /* None of the accepted logins were recorded, so none may count. */
+    for (i = 0; i < count; i++) {
+      if (requests[i].err == ORTHRUS_SUCCESS) {
+        requests[i].err = orthrus_error_create(err->err,
+                                               "Can't record login in userdb");
+      }
+    }
+  }
+
+  return err;
+}
 
-  err = orthrus__alg_sha1_cycle(1, resp);
-  if (err != ORTHRUS_SUCCESS) {
+static orthrus_error_t* userdb_verify(orthrus_t *ort,
+                                      const char *username,
+                                      const char *challenge,
+                                      const char *reply)
+{
+  orthrus_error_t* err;
+  orthrus_verify_t req;
+
+  req.username = username;
+  req.challenge = challenge;
+  req.reply = reply;
+
+  err = userdb_verify_batch(ort, &req, 1);
+  if (err) {
+    orthrus_error_destroy(req.err);
     return err;
   }
 
-  orthrus__decode_hex(user->lastreply, &last);
+  return req.err;
+}
+
+static orthrus_error_t* userdb_save(orthrus_t *ort,
+                                    const char *username,
+                                    const char *challenge,
+                                    const char *reply)
+{
+    apr_hash_t *users = apr_hash_make(ort->tmppool);
+    orthrus_user_t user;
+
+    memset(&user, 0, sizeof(user));
+    user.username = username;
+
+    ORT_ERR(decode_reply(reply, &user.lastreply));
+    ORT_ERR(decode_challenge(ort, challenge, &user.ch));
+
+    user.lastuse = apr_time_now();
+    user.dirty = 1;
+    apr_hash_set(users, username, APR_HASH_KEY_STRING, &user);
+
+    ORT_ERR(userdb_refresh(ort));
 
-  if (last != resp->reply) {
-    return orthrus_error_create(APR_EGENERAL, "invalid response.");
+    return ort->backend->update(ort, users);
+}
+
+static orthrus_error_t* userdb_convert(orthrus_t *ort, int format)
+{
+  const orthrus__userdb_backend_t *backend;
+
+  if (format == ORTHRUS_USERDB_TEXT) {
+    backend = &orthrus__userdb_text;
   }
+  else if (format == ORTHRUS_USERDB_BINARY) {
+    backend = &orthrus__userdb_binary;
+  }
+  else if (format == ORTHRUS_USERDB_LOG) {
+    backend = &orthrus__userdb_log;
+  }
+  else {
+    return orthrus_error_createf(APR_EINVAL, "Unknown userdb format %d", format);
+  }
+
+  ORT_ERR(userdb_refresh(ort));
+
+  if (ort->backend == backend) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  return orthrus__userdb_rewrite(ort, backend, NULL);
+}
+
+/* The public entry points release the operation's scratch memory however
+ * it ends, so a long lived orthrus_t doesn't grow with use. */
+static void userdb_release(orthrus_t *ort)
+{
+  orthrus__arena_reset(&ort->scratch);
+
+  if (ort->tmppool) {
+    apr_pool_clear(ort->tmppool);
+  }
+}
+
+orthrus_error_t* orthrus_userdb_get_challenge(orthrus_t *ort,
+                                              const char *username,
+                                              const char **challenge,
+                                              apr_pool_t *pool)
+{
+  orthrus_error_t *err = userdb_get_challenge(ort, username, challenge, pool);
+
+  userdb_release(ort);
+
+  return err;
+}
+
+orthrus_error_t* orthrus_userdb_verify(orthrus_t *ort,
+                                       const char *username,
+                                       const char *challenge,
+                                       const char *reply)
+{
+  orthrus_error_t *err = userdb_verify(ort, username, challenge, reply);
 
-  user->ch.sequence--;
-  return update_db(ort, user, r);
+  userdb_release(ort);
+
+  return err;
+}
+
+orthrus_error_t* orthrus_userdb_verify_batch(orthrus_t *ort,
+                                             orthrus_verify_t *requests,
+                                             apr_size_t count)
+{
+  orthrus_error_t *err = userdb_verify_batch(ort, requests, count);
+
+  userdb_release(ort);
+
+  return err;
 }
 
 orthrus_error_t* orthrus_userdb_save(orthrus_t *ort,
@@ -379,20 +1443,38 @@ orthrus_error_t* orthrus_userdb_save(orthrus_t *ort,
                                      const char *challenge,
                                      const char *reply)
 {
-    orthrus_response_t *resp;
-    orthrus_user_t user;
-    orthrus_error_t *err;
+  orthrus_error_t *err = userdb_save(ort, username, challenge, reply);
 
-    user.username = username;
-    user.lastreply = NULL;
+  userdb_release(ort);
 
-    err = decode_reply(ort, reply, &resp);
-    if (err != ORTHRUS_SUCCESS)
-        return err;
+  return err;
+}
 
-    err = decode_challenge(ort, challenge, &user.ch);
-    if (err != ORTHRUS_SUCCESS)
-        return err;
+orthrus_error_t* orthrus_userdb_convert(orthrus_t *ort, int format)
+{
+  orthrus_error_t *err = userdb_convert(ort, format);
+
+  userdb_release(ort);
+
+  return err;
+}
+
+static orthrus_error_t* userdb_compact(orthrus_t *ort)
+{
+  ORT_ERR(userdb_refresh(ort));
+
+  if (ort->backend != &orthrus__userdb_log) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  return orthrus__userdb_log_compact(ort);
+}
+
+orthrus_error_t* orthrus_userdb_compact(orthrus_t *ort)
+{
+  orthrus_error_t *err = userdb_compact(ort);
+
+  userdb_release(ort);
 
-    return update_db(ort, &user, resp->reply);
+  return err;
 }
@@ -0,0 +1,413 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "orthrus.h"
+#include "private/context.h"
+#include "private/userdb.h"
+
+/* Binary userdb: a header and then an open addressing hash table of fixed
+ * size records, keyed by the hash of the username and at most half full.
+ * A login rewrites its user's record with one write at a known offset,
+ * and a new user takes the first empty slot after its hash, so only
+ * growing the table rewrites the file.  Records are 128 byte aligned, so
+ * none straddles a disk sector.  Integers are in the byte order of the
+ * machine that wrote the file.
+ */
+
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 128
+#define BINARY_RECORD_SIZE 128
+#define BINARY_MIN_SLOTS 64
+
+typedef struct binary_header_t {
+  char magic[8];
+  apr_uint32_t version;
+  apr_uint32_t record_size;
+  apr_uint64_t nslots;
+  apr_uint64_t count;
+  char reserved[BINARY_HEADER_SIZE - 32];
+} binary_header_t;
+
+typedef struct binary_record_t {
+  /* Username hash, zero for an empty slot. */
+  apr_uint64_t hash;
+  apr_uint32_t sequence;
+  apr_uint32_t reserved;
+  apr_uint64_t lastreply;
+  /* Seconds since the epoch, zero if unknown. */
+  apr_int64_t lastuse;
+  /* Both NUL padded, and only NUL terminated when shorter than the field. */
+  char seed[ORT_SEED_MAX];
+  char username[ORTHRUS_USERDB_BINARY_NAME_MAX];
+} binary_record_t;
+
+typedef char binary_header_size_check
+  [sizeof(binary_header_t) == BINARY_HEADER_SIZE ? 1 : -1];
+typedef char binary_record_size_check
+  [sizeof(binary_record_t) == BINARY_RECORD_SIZE ? 1 : -1];
+
+static apr_uint64_t binary_hash(const char *name, apr_size_t len)
+{
+  apr_uint64_t hash = orthrus__index_hash(name, len);
+
+  return hash ? hash : 1;
+}
+
+static apr_off_t slot_offset(apr_uint64_t slot)
+{
+  return BINARY_HEADER_SIZE + (apr_off_t)slot * BINARY_RECORD_SIZE;
+}
+
+/* Reads from the mapping where it covers @a off, else from the file. */
+static orthrus_error_t* binary_read(orthrus_t *ort, apr_off_t off,
+                                    void *buf, apr_size_t len)
+{
+  apr_status_t rv;
+
+  if (ort->map != NULL && (apr_uint64_t)off + len <= ort->map->size) {
+    memcpy(buf, (const char *)ort->map->mm + off, len);
+    return ORTHRUS_SUCCESS;
+  }
+
+  rv = apr_file_seek(ort->userdb, APR_SET, &off);
+  if (!rv) {
+    rv = apr_file_read_full(ort->userdb, buf, len, NULL);
+  }
+  if (rv) {
+    return orthrus_error_create(rv, "can't read dbfile");
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* binary_write(orthrus_t *ort, apr_off_t off,
+                                     const void *buf, apr_size_t len)
+{
+  apr_size_t wsize;
+  apr_status_t rv;
+
+  rv = apr_file_seek(ort->userdb, APR_SET, &off);
+  if (!rv) {
+    rv = apr_file_write_full(ort->userdb, buf, len, &wsize);
+  }
+  if (rv) {
+    return orthrus_error_create(rv, "Can't write to dbfile");
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* binary_header(orthrus_t *ort, binary_header_t *h)
+{
+  ORT_ERR(binary_read(ort, 0, h, sizeof(*h)));
+
+  if (h->version != BINARY_VERSION) {
+    return orthrus_error_createf(APR_EGENERAL,
+                                 "%s is a binary userdb of version %u, or "
+                                 "from a machine of the other byte order",
+                                 ort->path, h->version);
+  }
+
+  if (h->record_size != BINARY_RECORD_SIZE ||
+      h->nslots < BINARY_MIN_SLOTS || (h->nslots & (h->nslots - 1)) != 0 ||
+      h->count > h->nslots / 2 ||
+      (apr_uint64_t)ort->dbinfo.size != (apr_uint64_t)slot_offset(h->nslots)) {
+    return orthrus_error_createf(APR_EGENERAL, "userdb %s corrupted", ort->path);
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Probes for @a name.  Sets @a *found, and @a *slot to its record or to
+ * the empty slot it would take. */
+static orthrus_error_t* binary_find(orthrus_t *ort, const binary_header_t *h,
+                                    const char *name, binary_record_t *rec,
+                                    apr_uint64_t *slot, int *found)
+{
+  apr_size_t len = strlen(name);
+  apr_uint64_t hash = binary_hash(name, len);
+  apr_uint64_t n;
+
+  *found = 0;
+  *slot = hash & (h->nslots - 1);
+
+  for (n = 0; n < h->nslots; n++) {
+    ORT_ERR(binary_read(ort, slot_offset(*slot), rec, sizeof(*rec)));
+
+    if (rec->hash == 0) {
+      return ORTHRUS_SUCCESS;
+    }
+
+    if (rec->hash == hash && len <= sizeof(rec->username) &&
+        memcmp(rec->username, name, len) == 0 &&
+        (len == sizeof(rec->username) || rec->username[len] == '\0')) {
+      *found = 1;
+      return ORTHRUS_SUCCESS;
+    }
+
+    *slot = (*slot + 1) & (h->nslots - 1);
+  }
+
+  return orthrus_error_createf(APR_EGENERAL, "userdb %s corrupted", ort->path);
+}
+
+/* Fills in @a user from @a rec, copying the seed to the scratch arena. */
+static orthrus_error_t* binary_get(orthrus_t *ort, const binary_record_t *rec,
+                                   orthrus_user_t *user)
+{
+  char *seed;
+  apr_size_t slen = 0;
+
+  while (slen < sizeof(rec->seed) && rec->seed[slen] != '\0') {
+    slen++;
+  }
+
+  seed = orthrus__arena_alloc(&ort->scratch, slen + 1);
+  if (seed == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+  memcpy(seed, rec->seed, slen);
+  seed[slen] = '\0';
+
+  user->ch.sequence = rec->sequence;
+  user->ch.seed = seed;
+  user->ch.slen = slen;
+  user->lastreply = rec->lastreply;
+  user->lastuse = rec->lastuse ? apr_time_from_sec(rec->lastuse) : 0;
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* binary_put(orthrus_t *ort, const orthrus_user_t *user,
+                                   binary_record_t *rec)
+{
+  apr_size_t len = strlen(user->username);
+
+  if (len > sizeof(rec->username)) {
+    return orthrus_error_createf(APR_EINVAL,
+                                 "username %s is too long for a binary userdb",
+                                 user->username);
+  }
+  if (user->ch.slen > sizeof(rec->seed)) {
+    return orthrus_error_createf(APR_EINVAL,
+                                 "seed of %s is too long for a binary userdb",
+                                 user->username);
+  }
+
+  memset(rec, 0, sizeof(*rec));
+  rec->hash = binary_hash(user->username, len);
+  rec->sequence = user->ch.sequence;
+  rec->lastreply = user->lastreply;
+  rec->lastuse = apr_time_sec(user->lastuse);
+  memcpy(rec->seed, user->ch.seed, user->ch.slen);
+  memcpy(rec->username, user->username, len);
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* binary_get_users(orthrus_t *ort, apr_hash_t *users)
+{
+  binary_header_t h;
+  binary_record_t rec;
+  apr_hash_index_t *hi;
+
+  ORT_ERR(binary_header(ort, &h));
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+    apr_uint64_t slot;
+    int found;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    ORT_ERR(binary_find(ort, &h, user->username, &rec, &slot, &found));
+    if (found) {
+      ORT_ERR(binary_get(ort, &rec, user));
+    }
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Writes each dirty user's record in place, and the header after them if
+ * there were new users.  Only a table that would be more than half full
+ * is rewritten, twice the size. */
+static orthrus_error_t* binary_update(orthrus_t *ort, apr_hash_t *users)
+{
+  binary_header_t h;
+  binary_record_t rec;
+  apr_hash_index_t *hi;
+  apr_uint64_t added = 0;
+
+  ORT_ERR(binary_header(ort, &h));
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+    apr_uint64_t slot;
+    int found;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    if (user->dirty) {
+      ORT_ERR(binary_find(ort, &h, user->username, &rec, &slot, &found));
+      added += !found;
+    }
+  }
+
+  if ((h.count + added) * 2 > h.nslots) {
+    return orthrus__userdb_rewrite(ort, &orthrus__userdb_binary, users);
+  }
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+    apr_uint64_t slot;
+    int found;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    if (!user->dirty) {
+      continue;
+    }
+
+    ORT_ERR(binary_find(ort, &h, user->username, &rec, &slot, &found));
+    ORT_ERR(binary_put(ort, user, &rec));
+    ORT_ERR(binary_write(ort, slot_offset(slot), &rec, sizeof(rec)));
+    user->dirty = 0;
+    h.count += !found;
+  }
+
+  if (added) {
+    ORT_ERR(binary_write(ort, 0, &h, sizeof(h)));
+  }
+
+  /* The file is the same one, so keep it mapped. */
+  if (apr_file_info_get(&ort->dbinfo,
+                        APR_FINFO_IDENT|APR_FINFO_SIZE|APR_FINFO_MTIME,
+                        ort->userdb) != APR_SUCCESS) {
+    ort->dbinfo.size = -1;
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* binary_each(orthrus_t *ort, orthrus__userdb_each_t cb,
+                                    void *baton)
+{
+  binary_header_t h;
+  binary_record_t rec;
+  apr_uint64_t slot;
+
+  ORT_ERR(binary_header(ort, &h));
+
+  for (slot = 0; slot < h.nslots; slot++) {
+    orthrus_user_t *user;
+    apr_size_t len = 0;
+    char *username;
+
+    ORT_ERR(binary_read(ort, slot_offset(slot), &rec, sizeof(rec)));
+    if (rec.hash == 0) {
+      continue;
+    }
+
+    while (len < sizeof(rec.username) && rec.username[len] != '\0') {
+      len++;
+    }
+
+    user = orthrus__arena_calloc(&ort->scratch, sizeof(*user));
+    username = orthrus__arena_alloc(&ort->scratch, len + 1);
+    if (user == NULL || username == NULL) {
+      return orthrus_error_create(APR_ENOMEM, "out of memory");
+    }
+    memcpy(username, rec.username, len);
+    username[len] = '\0';
+    user->username = username;
+
+    ORT_ERR(binary_get(ort, &rec, user));
+    ORT_ERR(cb(baton, user));
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Lays the table out in memory as slot numbers, then streams the records
+ * out in slot order. */
+static orthrus_error_t* binary_write_all(orthrus_t *ort, apr_file_t *file,
+                                         orthrus_user_t **users,
+                                         apr_size_t count)
+{
+  binary_header_t h;
+  binary_record_t *buf = (binary_record_t *)ort->writebuf;
+  apr_size_t per_write = ORT_USERDB_BUFFER_SIZE / sizeof(binary_record_t);
+  apr_size_t *table;
+  apr_size_t i, n = 0;
+  apr_size_t wsize;
+  apr_status_t rv;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, orthrus__userdb_binary.magic, sizeof(h.magic));
+  h.version = BINARY_VERSION;
+  h.record_size = BINARY_RECORD_SIZE;
+  h.nslots = BINARY_MIN_SLOTS;
+  h.count = count;
+  while (h.nslots / 2 < count) {
+    h.nslots *= 2;
+  }
+
+  /* Slot i holds users[table[i] - 1], or nothing if table[i] is zero. */
+  table = orthrus__arena_calloc(&ort->scratch, h.nslots * sizeof(*table));
+  if (table == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+
+  for (i = 0; i < count; i++) {
+    const char *name = users[i]->username;
+    apr_uint64_t slot = binary_hash(name, strlen(name)) & (h.nslots - 1);
+
+    while (table[slot] != 0) {
+      slot = (slot + 1) & (h.nslots - 1);
+    }
+    table[slot] = i + 1;
+  }
+
+  rv = apr_file_write_full(file, &h, sizeof(h), &wsize);
+
+  for (i = 0; i < h.nslots && !rv; i++) {
+    if (table[i] == 0) {
+      memset(&buf[n], 0, sizeof(buf[n]));
+    }
+    else {
+      ORT_ERR(binary_put(ort, users[table[i] - 1], &buf[n]));
+    }
+    if (++n == per_write || i + 1 == h.nslots) {
+      rv = apr_file_write_full(file, buf, n * sizeof(*buf), &wsize);
+      n = 0;
+    }
+  }
+
+  if (rv) {
+    return orthrus_error_create(rv, "Can't write to temporary dbfile");
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+const orthrus__userdb_backend_t orthrus__userdb_binary = {
+  "binary",
+  ORTHRUS_USERDB_BINARY,
+  ORT_USERDB_BINARY_MAGIC,
+  binary_get_users,
+  binary_update,
+  binary_each,
+  binary_write_all
+};
@@ -0,0 +1,480 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "orthrus.h"
+#include "private/context.h"
+#include "private/userdb.h"
+#include "apr_strings.h"
+
+/* Log userdb: a header and then records appended one after another, each
+ * a fixed part followed by the username and seed and padded to 8 bytes.
+ * A user's latest record is current and the earlier ones are garbage, so
+ * a login is a single sequential append however many users there are.
+ * Records carry a checksum.  A bad record with nothing valid after it is
+ * the remains of an append cut short by a crash, which is ignored and
+ * written over by the next append; anywhere else the log is corrupted.
+ *
+ * Logins only ever append.  Compacting, copying the current records to a
+ * new log that is renamed into place, is a separate maintenance step, see
+ * orthrus_userdb_compact, so no login pays for a rewrite of the whole
+ * log.  Integers are in the byte order of the machine that wrote the file.
+ */
+
+#define LOG_VERSION 1
+#define LOG_ALIGN(n) (((n) + 7) & ~(apr_size_t)7)
+
+/* Logs smaller than this are not worth compacting. */
+#define ORT_LOG_COMPACT_MIN (64 * 1024)
+
+typedef struct log_header_t {
+  char magic[8];
+  apr_uint32_t version;
+  apr_uint32_t reserved;
+} log_header_t;
+
+typedef struct log_record_t {
+  /* Of the whole record, padding included. */
+  apr_uint32_t size;
+  /* Low half of the FNV-1a hash of the rest of the record. */
+  apr_uint32_t check;
+  apr_uint64_t lastreply;
+  /* Seconds since the epoch, zero if unknown. */
+  apr_int64_t lastuse;
+  apr_uint32_t sequence;
+  apr_uint16_t namelen;
+  unsigned char seedlen;
+  unsigned char reserved;
+  /* Followed by the username and the seed, neither NUL terminated. */
+} log_record_t;
+
+#define LOG_RECORD_MAX LOG_ALIGN(sizeof(log_record_t) + 0xffff + 0xff)
+
+typedef char log_header_size_check[sizeof(log_header_t) == 16 ? 1 : -1];
+typedef char log_record_size_check[sizeof(log_record_t) == 32 ? 1 : -1];
+
+typedef struct log_entry_t {
+  apr_off_t off;
+  apr_uint32_t size;
+} log_entry_t;
+
+struct orthrus__log_t {
+  /* Username to the log_entry_t of its latest record. */
+  apr_hash_t *latest;
+  /* End of the last good record, where the next one goes. */
+  apr_off_t end;
+  /* Bytes of records superseded by later ones. */
+  apr_off_t garbage;
+};
+
+static apr_uint32_t log_check(const log_record_t *rec)
+{
+  return (apr_uint32_t)orthrus__index_hash((const char *)rec + 8,
+                                           rec->size - 8);
+}
+
+/* Points @a *out at @a len bytes at @a off, in the mapping where it covers
+ * them and otherwise read into the scratch arena; appends since the file
+ * was mapped are only in the file. */
+static orthrus_error_t* log_read(orthrus_t *ort, apr_off_t off,
+                                 apr_size_t len, const void **out)
+{
+  apr_status_t rv;
+  void *buf;
+
+  if (ort->map != NULL && (apr_uint64_t)off + len <= ort->map->size) {
+    *out = (const char *)ort->map->mm + off;
+    return ORTHRUS_SUCCESS;
+  }
+
+  buf = orthrus__arena_alloc(&ort->scratch, len);
+  if (buf == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+
+  rv = apr_file_seek(ort->userdb, APR_SET, &off);
+  if (!rv) {
+    rv = apr_file_read_full(ort->userdb, buf, len, NULL);
+  }
+  if (rv) {
+    return orthrus_error_create(rv, "can't read dbfile");
+  }
+
+  *out = buf;
+  return ORTHRUS_SUCCESS;
+}
+
+/* Sets @a *rec to the record at @a off if there is a whole one there that
+ * passes its checksum, and to NULL otherwise. */
+static orthrus_error_t* log_record(orthrus_t *ort, apr_off_t off,
+                                   const log_record_t **rec)
+{
+  const log_record_t *r;
+  apr_off_t size = ort->dbinfo.size;
+
+  *rec = NULL;
+  if (off + (apr_off_t)sizeof(*r) > size) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  ORT_ERR(log_read(ort, off, sizeof(*r), (const void **)&r));
+  if (r->size < sizeof(*r) || r->size % 8 != 0 || off + r->size > size ||
+      sizeof(*r) + r->namelen + r->seedlen > r->size) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  ORT_ERR(log_read(ort, off, r->size, (const void **)&r));
+  if (log_check(r) == r->check) {
+    *rec = r;
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Reads the log once per file, to find the latest record of each user. */
+static orthrus_error_t* log_load(orthrus_t *ort)
+{
+  orthrus__log_t *log;
+  const log_header_t *h;
+  apr_off_t off = sizeof(log_header_t);
+  apr_off_t size = ort->dbinfo.size;
+
+  if (ort->log != NULL) {
+    return ORTHRUS_SUCCESS;
+  }
+
+  ORT_ERR(log_read(ort, 0, sizeof(*h), (const void **)&h));
+  if (h->version != LOG_VERSION) {
+    return orthrus_error_createf(APR_EGENERAL,
+                                 "%s is a log userdb of version %u, or "
+                                 "from a machine of the other byte order",
+                                 ort->path, h->version);
+  }
+
+  log = apr_pcalloc(ort->mappool, sizeof(*log));
+  log->latest = apr_hash_make(ort->mappool);
+
+  while (off < size) {
+    const log_record_t *rec;
+    log_entry_t *entry;
+    const char *name;
+    apr_off_t next;
+
+    ORT_ERR(log_record(ort, off, &rec));
+    if (rec == NULL) {
+      /* Records start 8 byte aligned, so a good one after this means the
+       * log was damaged rather than cut short. */
+      for (next = off + 8; next < size; next += 8) {
+        ORT_ERR(log_record(ort, next, &rec));
+        if (rec != NULL) {
+          return orthrus_error_createf(APR_EGENERAL,
+                                       "userdb %s corrupted at offset %"
+                                       APR_OFF_T_FMT, ort->path, off);
+        }
+      }
+      break;
+    }
+
+    name = (const char *)(rec + 1);
+    entry = apr_hash_get(log->latest, name, rec->namelen);
+    if (entry != NULL) {
+      log->garbage += entry->size;
+    }
+    else {
+      entry = apr_palloc(ort->mappool, sizeof(*entry));
+      apr_hash_set(log->latest, apr_pstrmemdup(ort->mappool, name, rec->namelen),
+                   rec->namelen, entry);
+    }
+    entry->off = off;
+    entry->size = rec->size;
+
+    off += rec->size;
+  }
+
+  log->end = off;
+  ort->log = log;
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* log_get(orthrus_t *ort, const log_record_t *rec,
+                                orthrus_user_t *user)
+{
+  char *seed = orthrus__arena_alloc(&ort->scratch, rec->seedlen + 1);
+
+  if (seed == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+  memcpy(seed, (const char *)(rec + 1) + rec->namelen, rec->seedlen);
+  seed[rec->seedlen] = '\0';
+
+  user->ch.sequence = rec->sequence;
+  user->ch.seed = seed;
+  user->ch.slen = rec->seedlen;
+  user->lastreply = rec->lastreply;
+  user->lastuse = rec->lastuse ? apr_time_from_sec(rec->lastuse) : 0;
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* log_size(const orthrus_user_t *user,
+                                 apr_size_t *size)
+{
+  apr_size_t namelen = strlen(user->username);
+
+  if (namelen > 0xffff || user->ch.slen > 0xff) {
+    return orthrus_error_createf(APR_EINVAL,
+                                 "record of %s is too long for a log userdb",
+                                 user->username);
+  }
+
+  *size = LOG_ALIGN(sizeof(log_record_t) + namelen + user->ch.slen);
+  return ORTHRUS_SUCCESS;
+}
+
+/* Builds @a user's record of @a size bytes, as from log_size, in @a buf. */
+static void log_put(const orthrus_user_t *user, apr_size_t size, void *buf)
+{
+  log_record_t *rec = buf;
+  char *p = (char *)(rec + 1);
+
+  memset(buf, 0, size);
+  rec->size = (apr_uint32_t)size;
+  rec->lastreply = user->lastreply;
+  rec->lastuse = apr_time_sec(user->lastuse);
+  rec->sequence = user->ch.sequence;
+  rec->namelen = (apr_uint16_t)strlen(user->username);
+  rec->seedlen = (unsigned char)user->ch.slen;
+  memcpy(p, user->username, rec->namelen);
+  memcpy(p + rec->namelen, user->ch.seed, rec->seedlen);
+  rec->check = log_check(rec);
+}
+
+static orthrus_error_t* log_get_users(orthrus_t *ort, apr_hash_t *users)
+{
+  apr_hash_index_t *hi;
+
+  ORT_ERR(log_load(ort));
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+    const log_entry_t *entry;
+    const log_record_t *rec;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    entry = apr_hash_get(ort->log->latest, user->username, APR_HASH_KEY_STRING);
+    if (entry != NULL) {
+      ORT_ERR(log_read(ort, entry->off, entry->size, (const void **)&rec));
+      ORT_ERR(log_get(ort, rec, user));
+    }
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+/* Appends a record for every dirty user with one write. */
+static orthrus_error_t* log_update(orthrus_t *ort, apr_hash_t *users)
+{
+  orthrus__log_t *log;
+  apr_hash_index_t *hi;
+  apr_size_t size, total = 0;
+  apr_size_t wsize;
+  apr_off_t off;
+  apr_status_t rv;
+  char *buf;
+
+  ORT_ERR(log_load(ort));
+  log = ort->log;
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    if (user->dirty) {
+      ORT_ERR(log_size(user, &size));
+      total += size;
+    }
+  }
+
+  buf = orthrus__arena_alloc(&ort->scratch, total);
+  if (buf == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+
+  for (hi = apr_hash_first(ort->tmppool, users), size = 0; hi;
+       hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+    apr_size_t len;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    if (user->dirty) {
+      log_size(user, &len);
+      log_put(user, len, buf + size);
+      size += len;
+    }
+  }
+
+  /* Drop whatever follows the last good record. */
+  off = log->end;
+  rv = APR_SUCCESS;
+  if (off != ort->dbinfo.size) {
+    rv = apr_file_trunc(ort->userdb, off);
+  }
+  if (!rv) {
+    rv = apr_file_seek(ort->userdb, APR_SET, &off);
+  }
+  if (!rv) {
+    rv = apr_file_write_full(ort->userdb, buf, total, &wsize);
+  }
+  if (rv) {
+    return orthrus_error_create(rv, "Can't append to dbfile");
+  }
+
+  for (hi = apr_hash_first(ort->tmppool, users); hi; hi = apr_hash_next(hi)) {
+    orthrus_user_t *user;
+    log_entry_t *entry;
+    apr_size_t len;
+
+    apr_hash_this(hi, NULL, NULL, (void **)&user);
+    if (!user->dirty) {
+      continue;
+    }
+
+    entry = apr_hash_get(log->latest, user->username, APR_HASH_KEY_STRING);
+    if (entry != NULL) {
+      log->garbage += entry->size;
+    }
+    else {
+      entry = apr_palloc(ort->mappool, sizeof(*entry));
+      apr_hash_set(log->latest, apr_pstrdup(ort->mappool, user->username),
+                   APR_HASH_KEY_STRING, entry);
+    }
+    log_size(user, &len);
+    entry->off = log->end;
+    entry->size = (apr_uint32_t)len;
+    log->end += len;
+    user->dirty = 0;
+  }
+
+  /* The file is the same one, so keep it mapped. */
+  if (apr_file_info_get(&ort->dbinfo,
+                        APR_FINFO_IDENT|APR_FINFO_SIZE|APR_FINFO_MTIME,
+                        ort->userdb) != APR_SUCCESS) {
+    ort->dbinfo.size = -1;
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+orthrus_error_t* orthrus__userdb_log_compact(orthrus_t *ort)
+{
+  orthrus__log_t *log;
+
+  ORT_ERR(log_load(ort));
+  log = ort->log;
+
+  if (log->end > ORT_LOG_COMPACT_MIN &&
+      log->garbage > log->end - (apr_off_t)sizeof(log_header_t) - log->garbage) {
+    return orthrus__userdb_rewrite(ort, &orthrus__userdb_log, NULL);
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* log_each(orthrus_t *ort, orthrus__userdb_each_t cb,
+                                 void *baton)
+{
+  apr_off_t off = sizeof(log_header_t);
+
+  ORT_ERR(log_load(ort));
+
+  while (off < ort->log->end) {
+    const log_record_t *rec;
+    const log_entry_t *entry;
+    orthrus_user_t *user;
+    char *username;
+
+    ORT_ERR(log_read(ort, off, sizeof(*rec), (const void **)&rec));
+    ORT_ERR(log_read(ort, off, rec->size, (const void **)&rec));
+
+    entry = apr_hash_get(ort->log->latest, rec + 1, rec->namelen);
+    if (entry != NULL && entry->off == off) {
+      user = orthrus__arena_calloc(&ort->scratch, sizeof(*user));
+      username = orthrus__arena_alloc(&ort->scratch, rec->namelen + 1);
+      if (user == NULL || username == NULL) {
+        return orthrus_error_create(APR_ENOMEM, "out of memory");
+      }
+      memcpy(username, rec + 1, rec->namelen);
+      username[rec->namelen] = '\0';
+      user->username = username;
+
+      ORT_ERR(log_get(ort, rec, user));
+      ORT_ERR(cb(baton, user));
+    }
+
+    off += rec->size;
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+static orthrus_error_t* log_write(orthrus_t *ort, apr_file_t *file,
+                                  orthrus_user_t **users, apr_size_t count)
+{
+  orthrus__userdb_writer_t writer;
+  log_header_t h;
+  apr_status_t rv;
+  apr_size_t i, size;
+  char *buf = orthrus__arena_alloc(&ort->scratch, LOG_RECORD_MAX);
+
+  if (buf == NULL) {
+    return orthrus_error_create(APR_ENOMEM, "out of memory");
+  }
+
+  writer.file = file;
+  writer.buf = ort->writebuf;
+  writer.len = 0;
+  writer.off = 0;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, orthrus__userdb_log.magic, sizeof(h.magic));
+  h.version = LOG_VERSION;
+
+  rv = orthrus__userdb_writer_write(&writer, &h, sizeof(h));
+  for (i = 0; i < count && !rv; i++) {
+    ORT_ERR(log_size(users[i], &size));
+    log_put(users[i], size, buf);
+    rv = orthrus__userdb_writer_write(&writer, buf, size);
+  }
+  if (!rv) {
+    rv = orthrus__userdb_writer_flush(&writer);
+  }
+  if (rv) {
+    return orthrus_error_create(rv, "Can't write to temporary dbfile");
+  }
+
+  return ORTHRUS_SUCCESS;
+}
+
+const orthrus__userdb_backend_t orthrus__userdb_log = {
+  "log",
+  ORTHRUS_USERDB_LOG,
+  ORT_USERDB_LOG_MAGIC,
+  log_get_users,
+  log_update,
+  log_each,
+  log_write
+};
@@ -17,10 +17,11 @@
 #include "orthrus.h"
 #include "private/context.h"
 #include "apr_strings.h"
-#include <ctype.h>
+#include "private/wordhash.h"
 
-/* This array is verbatim from RFC 2289 */
-static const char *rfc_2289_dict[] = {
+/* This array is verbatim from RFC 2289.  Entries are a fixed five bytes,
+ * so a word is one unaligned four byte copy plus a NUL padded tail. */
+static const char rfc_2289_dict[][5] = {
   "A",     "ABE",   "ACE",   "ACT",   "AD",    "ADA",   "ADD",
   "AGO",   "AID",   "AIM",   "AIR",   "ALL",   "ALP",   "AM",    "AMY",
   "AN",    "ANA",   "AND",   "ANN",   "ANT",   "ANY",   "APE",   "APS",
@@ -284,67 +285,72 @@ static const char *rfc_2289_dict[] = {
   "YARD",  "YARN",  "YAWL",  "YAWN",  "YEAH",  "YEAR",  "YELL",  "YOGA",
   "YOKE"   };
 
-/* based on freebsd:src/contrib/opie/libopie/btoe.c extract */
-static apr_uint32_t extract_bits(unsigned char *s, apr_size_t start, apr_size_t length)
+/* Letters only, without the locale dependence of isalpha. */
+#define WORD_ISALPHA(c) ((apr_uint32_t)(((c) | 0x20) - 'a') < 26)
+
+/* Sum of the 32 two bit groups of @a v, modulo four. */
+static APR_INLINE apr_uint32_t words_checksum(apr_uint64_t v)
 {
-  apr_uint32_t x;
-  unsigned char cl;
-  unsigned char cc;
-  unsigned char cr;
+  const apr_uint64_t lo = APR_UINT64_C(0x5555555555555555);
 
-  cl = s[start / 8];
-  cc = s[start / 8 + 1];
-  cr = s[start / 8 + 2];
-  x = ((apr_uint32_t) (cl << 8 | cc) << 8 | cr);
-  x = x >> (24 - (length + (start % 8)));
-  x = (x & (0xffff >> (16 - length)));
-  return (x);
+#if defined(__GNUC__)
+  return (2 * __builtin_popcountll(v & ~lo) + __builtin_popcountll(v & lo)) & 3;
+#else
+  /* Each 2 bit group already holds its own value, add them up in place. */
+  v = (v & APR_UINT64_C(0x3333333333333333)) +
+      ((v >> 2) & APR_UINT64_C(0x3333333333333333));
+  v = (v & APR_UINT64_C(0x0f0f0f0f0f0f0f0f)) +
+      ((v >> 4) & APR_UINT64_C(0x0f0f0f0f0f0f0f0f));
+  return (apr_uint32_t)((v * APR_UINT64_C(0x0101010101010101)) >> 56) & 3;
+#endif
 }
 
-void orthrus__format_words(orthrus_response_t *reply, apr_pool_t *pool)
+/* Length of dictionary entry @a w, from its NUL padding. */
+#define WORD_LEN(w) (1 + ((w)[1] != 0) + ((w)[2] != 0) + ((w)[3] != 0))
+
+/*
+ * The six words hold 66 bits: the 64 bits of the key, first word most
+ * significant, followed by a two bit checksum.  The 64 bits of key are
+ * broken down into pairs of bits, then these pairs are summed together.
+ * The two least significant bits of this sum are encoded in the last two
+ * bits of the six word sequence with the least significant bit of the sum
+ * as the last bit encoded.
+ *
+ * Every word is copied as four bytes and the output advanced by its real
+ * length, so @a out must have room for ORT_WORDS_MAX_LEN bytes.
+ */
+apr_size_t orthrus__words_write(apr_uint64_t value, char *out)
 {
+  char *p = out;
+  const char *w;
   int i;
-  /* The words format encodes the 65/66 bit with a parity of the previous 64 bits */
-  unsigned char bits[9];
-  apr_uint32_t checksum = 0;
 
-  /*
-   * The two extra bits in this encoding are used to store a checksum.
-   * The 64 bits of key are broken down into pairs of bits, then these
-   * pairs are summed together. The two least significant bits of this sum
-   * are encoded in the last two bits of the six word sequence with the
-   * least significant bit of the sum as the last bit encoded. 
-   */
-  bits[8] = '\0';
-  memcpy(&bits[0], &reply->reply, 8);
+  for (i = 0; i < 5; i++) {
+    w = rfc_2289_dict[(value >> (53 - 11 * i)) & 2047];
+    memcpy(p, w, 4);
+    p += WORD_LEN(w);
+    *p++ = ' ';
+  }
 
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (i=0; i<4; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[7-i];
-        bits[7-i]= tmp;
-    }
-#endif
+  w = rfc_2289_dict[((value << 2) | words_checksum(value)) & 2047];
+  memcpy(p, w, 4);
+  p += WORD_LEN(w);
 
-  for (i = 0; i < 64; i += 2) {
-    checksum += extract_bits(bits, i, 2);
-  }
+  return p - out;
+}
 
-  bits[8] = (unsigned char)(checksum << 6);
+void orthrus__format_words(orthrus_response_t *reply, apr_pool_t *pool)
+{
+  char *r = (char *)&reply->words[0];
 
-  reply->words = apr_pstrcat(pool,
-                  rfc_2289_dict[extract_bits(bits, 0, 11)], " ", 
-                  rfc_2289_dict[extract_bits(bits, 11, 11)], " ", 
-                  rfc_2289_dict[extract_bits(bits, 22, 11)], " ", 
-                  rfc_2289_dict[extract_bits(bits, 33, 11)], " ", 
-                  rfc_2289_dict[extract_bits(bits, 44, 11)], " ", 
-                  rfc_2289_dict[extract_bits(bits, 55, 11)], 
-                  NULL);
+  r[orthrus__words_write(reply->reply, r)] = 0;
 }
 
 void orthrus_response_format_words(orthrus_response_t *reply, const char **output)
 {
+  if (reply->words[0] == '\0') {
+    orthrus__format_words(reply, reply->pool);
+  }
   *output = reply->words;
 }
 
@@ -362,118 +368,65 @@ to the U.S. Naval Research Laboratory (NRL). The NRL Copyright Notice and
 License Agreement applies to this software.
 **/
 
-static
-void insert_bits(unsigned char *s, int x, apr_size_t start, apr_size_t length)
+/* One probe of the generated perfect hash.  Any word not in the dictionary
+ * leaves a non zero mark in @a miss rather than branching.
+ */
+static APR_INLINE apr_uint32_t words_lookup(apr_uint32_t key,
+                                            apr_uint32_t *miss)
 {
-  unsigned char cl;
-  unsigned char cc;
-  unsigned char cr;
-  apr_uint32_t y;
-  int shift;
+  apr_uint32_t bucket = orthrus__wordhash_mix(key) >>
+                        (32 - ORT_WORDHASH_BUCKET_BITS);
+  apr_uint32_t slot = orthrus__wordhash_slots[
+      orthrus__wordhash_mix(key ^ orthrus__wordhash_disp[bucket]) & 2047];
 
-  shift = ((8 - ((start + length) % 8)) % 8);
-  y = (apr_uint32_t) x << shift;
-  cl = (y >> 16) & 0xff;
-  cc = (y >> 8) & 0xff;
-  cr = y & 0xff;
-  if (shift + length > 16) {
-    s[start / 8] |= cl;
-    s[start / 8 + 1] |= cc;
-    s[start / 8 + 2] |= cr;
-  } else
-    if (shift + length > 8) {
-      s[start / 8] |= cc;
-      s[start / 8 + 1] |= cr;
-    } else {
-      s[start / 8] |= cr;
-    }
-}
-
-static
-int wsrch(char *w, int low, int high)
-{
-  int i, j;
+  *miss |= (slot >> 11) ^ key;
 
-  for (;;) {
-    i = (low + high) / 2;
-    if ((j = strncmp(w, rfc_2289_dict[i], 4)) == 0)
-      return i; /* Found it */
-    if (high == low + 1) {
-      /* Avoid effects of integer truncation in /2 */
-      if (strncmp(w, rfc_2289_dict[high], 4) == 0)
-        return high;
-      else
-        return -1;
-    }
-    if (low >= high)
-      return -1;        /* I don't *think* this can happen... */
-    if (j < 0)
-      high = i; /* Search lower half */
-    else
-      low = i;  /* Search upper half */
-  }
+  return slot & 2047;
 }
 
 orthrus_error_t* orthrus__decode_words(const char *words, apr_uint64_t *out)
 {
-    char input[64] = {0}, *word, *c;
-    unsigned char bits[9] = {0};
-    apr_uint32_t i, p, l, low, high;
-    int v;
+  const unsigned char *c = (const unsigned char *)words;
+  apr_uint64_t acc = 0;
+  apr_uint32_t miss = 0;
+  apr_uint32_t i, last = 0;
 
-    strncpy(input, words, sizeof(input) - 1);
+  for (i = 0; i < 6; i++) {
+    apr_uint32_t key = 0, len = 0;
 
-    for (i = 0, p = 0, word = c = input; i < 6; i++, p += 11) {
-        while (*c && !isalpha(*c))
-            c++;
-        word = c;
-        while (*c) {
-            if (islower(*c))
-                *c = toupper(*c);
-            if (!isalpha(*c))
-                break;
-            c++;
-        }
-        if ((!*c) && (i != 5)) {
-            return orthrus_error_create(APR_EGENERAL, "Didn't see precisely 6 words");
-        }
-        *c = 0;
-        c++;
-        l = strlen(word);
-        if (l > 4 || l < 1) {
-            return orthrus_error_create(APR_EGENERAL, "Word length out of range");
-        }
-        if (l < 4) {
-            low = 0;
-            high = 570;
-        } else {
-            low = 571;
-            high = 2047;
-        }
+    while (*c && !WORD_ISALPHA(*c))
+      c++;
 
-        if ((v = wsrch(word, low, high)) < 0) {
-            return orthrus_error_createf(APR_EGENERAL, "Word %s not found in table", word);
-        }
-        insert_bits(bits, v, p, 11);
+    while (WORD_ISALPHA(*c)) {
+      if (len == 4) {
+        return orthrus_error_static(ORTHRUS_EWORD_LENGTH);
+      }
+      key |= (apr_uint32_t)(*c & 0x1f) << (5 * len);
+      len++;
+      c++;
     }
 
-    /* now check the parity of what we got */
-    for (p = 0, i = 0; i < 64; i += 2)
-        p += extract_bits(bits, i, 2);
-
-    if ((p & 3) != extract_bits(bits, 64, 2)) {
-        return orthrus_error_create(APR_EGENERAL, "Parity error");
+    if (len == 0) {
+      return orthrus_error_static(ORTHRUS_EWORD_COUNT);
     }
 
-#ifndef BIGENDIAN
-    /* reverse the order */
-    for (i=0; i<4; ++i) {
-        char tmp = bits[i];
-        bits[i]  = bits[7-i];
-        bits[7-i]= tmp;
+    last = words_lookup(key, &miss);
+    if (i < 5) {
+      acc = (acc << 11) | last;
     }
-#endif
+  }
+
+  if (miss) {
+    return orthrus_error_static(ORTHRUS_EWORD_NOT_FOUND);
+  }
+
+  /* 66 bits: the 64 bit value, then two bits of checksum. */
+  acc = (acc << 9) | (last >> 2);
+  if (words_checksum(acc) != (last & 3)) {
+    return orthrus_error_static(ORTHRUS_EWORD_PARITY);
+  }
+
+  *out = acc;
 
-    memcpy(out, bits, sizeof *out);
-    return ORTHRUS_SUCCESS;
+  return ORTHRUS_SUCCESS;
 }